@@ -0,0 +1,177 @@
+'''
+Compile the commands of each site in sites.yaml into a command pack.
+
+For every site this writes, into the output directory:
+    <siteId>.pack   the pack itself, what `--publish` sends to <topic>/set_pack/<siteId>
+    <siteId>.img    an image of the "cmds" partition holding the pack, for
+                    `parttool.py write_partition --partition-name cmds --input <siteId>.img`
+    <siteId>.json   the command id -> text/intent/entity table of the pack
+
+The layout mirrors main/app/app_cmd_pack.h and main/app/app_cmd_bank.h.
+'''
+
+import argparse
+import json
+import os
+import re
+import struct
+import time
+import zlib
+
+from configure_sites import connect_mqtt, expand_site, load_conf, wait_for_results
+
+CMD_PACK_MAGIC = 0x50444d43     # "CMDP"
+CMD_PACK_VERSION = 1
+CMD_PACK_HEADER = struct.Struct('<IHHIII')
+CMD_BANK_MAGIC = 0x4b4e4243     # "CBNK"
+PARTITION_SIZE = 64 * 1024      # "cmds" in partitions.csv
+BANK_SIZE = PARTITION_SIZE // 2
+MN_PHRASE_MAX = 200             # ESP_MN_MAX_PHRASE_NUM, also MAX_CMDS in app_hass.c
+
+
+def firmware_limits(header='main/app/app_sr.h'):
+    '''Read SR_CMD_STR_LEN_MAX and SR_CMD_PHONEME_LEN_MAX so the limits follow the firmware'''
+    limits = {'SR_CMD_STR_LEN_MAX': 64, 'SR_CMD_PHONEME_LEN_MAX': 64}
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), header)
+    with open(path, 'r') as f:
+        for name, value in re.findall(r'#define\s+(SR_CMD_\w+_LEN_MAX)\s+\(?(\d+)\)?', f.read()):
+            limits[name] = int(value)
+    return limits['SR_CMD_STR_LEN_MAX'], limits['SR_CMD_PHONEME_LEN_MAX']
+
+
+def check_commands(commands, str_max, phoneme_max):
+    '''Drop what the firmware would refuse, returns (accepted, [(command, reason)])'''
+    accepted, rejected = [], []
+    phonemes = set()
+    for command in commands:
+        if not command['text'] or not command['phonetic']:
+            rejected.append((command, 'missing'))
+        elif len(command['text'].encode()) >= str_max or len(command['phonetic'].encode()) >= phoneme_max:
+            rejected.append((command, 'too_long'))
+        elif command['phonetic'] in phonemes:
+            rejected.append((command, 'duplicate'))
+        elif len(accepted) >= MN_PHRASE_MAX:
+            rejected.append((command, 'full'))
+        else:
+            phonemes.add(command['phonetic'])
+            accepted.append(command)
+    return accepted, rejected
+
+
+def build_pack(commands):
+    texts = [c['text'].encode() + b'\0' for c in commands]
+    phonemes = [c['phonetic'].encode() + b'\0' for c in commands]
+    text_table, phoneme_table = b''.join(texts), b''.join(phonemes)
+    if len(text_table) > 0xffff or len(phoneme_table) > 0xffff:
+        raise ValueError('Command set too large for a pack')
+
+    offsets = []
+    for table in (texts, phonemes):
+        off = 0
+        for s in table:
+            offsets.append(off)
+            off += len(s)
+    body = struct.pack(f'<{len(offsets)}H', *offsets) + text_table + phoneme_table
+    header = CMD_PACK_HEADER.pack(CMD_PACK_MAGIC, CMD_PACK_VERSION, len(commands),
+                         len(text_table), len(phoneme_table), zlib.crc32(body))
+    return header + body, len(text_table), len(phoneme_table)
+
+
+def check_pack(pack, str_max, phoneme_max):
+    '''Re-read a pack the way cmd_pack_validate() and app_hass_pack_end() do, raises ValueError'''
+    if len(pack) < CMD_PACK_HEADER.size:
+        raise ValueError('Pack too short')
+    magic, version, count, text_size, phoneme_size, crc = CMD_PACK_HEADER.unpack_from(pack)
+    if magic != CMD_PACK_MAGIC or version != CMD_PACK_VERSION:
+        raise ValueError('Bad pack magic or version')
+    text_start = CMD_PACK_HEADER.size + 4 * count
+    phoneme_start = text_start + text_size
+    if phoneme_start + phoneme_size > len(pack) or zlib.crc32(pack[CMD_PACK_HEADER.size:phoneme_start + phoneme_size]) != crc:
+        raise ValueError('Pack sizes or CRC do not match')
+    if count > MN_PHRASE_MAX:
+        raise ValueError(f'Pack holds {count} cmds, only {MN_PHRASE_MAX} allowed')
+    offsets = struct.unpack_from(f'<{2 * count}H', pack, CMD_PACK_HEADER.size)
+    for i in range(count):
+        for start, size, off, limit in ((text_start, text_size, offsets[i], str_max),
+                                        (phoneme_start, phoneme_size, offsets[count + i], phoneme_max)):
+            end = pack.find(b'\0', start + off, start + size)
+            if off >= size or end < 0:
+                raise ValueError(f'Cmd {i} is not terminated')
+            if not 0 < end - start - off < limit:
+                raise ValueError(f'Cmd {i} is {end - start - off} bytes, 1 - {limit - 1} allowed')
+
+
+def build_image(pack):
+    '''Bank 0 holds the pack as sequence 1, bank 1 is left erased'''
+    bank = struct.pack('<IIII', CMD_BANK_MAGIC, 1, len(pack), 0) + pack
+    if len(bank) > BANK_SIZE:
+        raise ValueError(f'Pack of {len(pack)} bytes exceeds the {BANK_SIZE} byte bank')
+    return bank + b'\xff' * (PARTITION_SIZE - len(bank))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-c', '--config', default='sites.yaml')
+    parser.add_argument('-o', '--out', default='build/cmd_packs')
+    parser.add_argument('--site', action='append', help='only these sites, may be repeated')
+    parser.add_argument('--publish', action='store_true', help='send each pack to its site over MQTT')
+    args = parser.parse_args()
+
+    conf = load_conf(args.config)
+    str_max, phoneme_max = firmware_limits()
+    os.makedirs(args.out, exist_ok=True)
+
+    packs = {}
+    failed = False
+    for siteId, entities in conf['sites'].items():
+        if args.site and siteId not in args.site:
+            continue
+        commands, rejected = check_commands(expand_site(entities), str_max, phoneme_max)
+        for command, reason in rejected:
+            print(f'{siteId}: rejected ({reason}): {command["text"]}')
+        try:
+            pack, text_size, phoneme_size = build_pack(commands)
+            check_pack(pack, str_max, phoneme_max)
+            image = build_image(pack)
+        except ValueError as e:
+            print(f'{siteId}: {e}')
+            failed = True
+            continue
+
+        base = os.path.join(args.out, siteId)
+        with open(base + '.pack', 'wb') as f:
+            f.write(pack)
+        with open(base + '.img', 'wb') as f:
+            f.write(image)
+        with open(base + '.json', 'w') as f:
+            table = [{'id': i, 'text': c['text'], 'phonetic': c['phonetic'], 'intent': c['intent'], 'name': c['name']}
+                     for i, c in enumerate(commands)]
+            json.dump({'siteId': siteId, 'commands': table}, f, indent=2)
+
+        print(f'{siteId}: {len(commands)}/{MN_PHRASE_MAX} cmds, {len(rejected)} rejected, '
+              f'text {text_size} B, phonemes {phoneme_size} B, pack {len(pack)} B '
+              f'({100 * (len(pack) + 16) // BANK_SIZE}% of a bank)')
+        packs[siteId] = pack
+
+    if args.publish and packs:
+        client = connect_mqtt(conf)
+        results = wait_for_results(conf, client)
+        for siteId, pack in packs.items():
+            client.publish(f'{conf["mqtt"]["topic"]}/set_pack/{siteId}', pack, qos=1).wait_for_publish()
+            print(f'Sent pack to {siteId}')
+        deadline = time.time() + 30
+        while len(results) < len(packs) and time.time() < deadline:
+            time.sleep(0.1)
+        for siteId in packs:
+            if siteId not in results:
+                print(f'No result from {siteId}, is it online?')
+                failed = True
+            elif not results[siteId]['ok']:
+                print(f'{siteId} refused the pack: {results[siteId].get("error", "unknown error")}')
+                failed = True
+
+    raise SystemExit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -106,6 +106,8 @@ typedef esp_err_t (*bsp_i2s_read_fn)(void *audio_buffer, size_t len, size_t *byt
 
 typedef esp_err_t (*bsp_i2s_write_fn)(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
 
+typedef uint32_t (*bsp_i2s_rx_overflow_fn)(void);
+
 typedef struct {
     bsp_codec_mute_fn mute_set_fn;
     bsp_codec_volume_fn volume_set_fn;
@@ -114,6 +116,35 @@ typedef struct {
     bsp_i2s_read_fn i2s_read_fn;
     bsp_i2s_write_fn i2s_write_fn;
     bsp_i2s_reconfig_clk_fn i2s_reconfig_clk_fn;
+
+    /**
+     * @brief Number of RX DMA buffers dropped because nobody read them in time
+     */
+    bsp_i2s_rx_overflow_fn i2s_rx_overflow_fn;
+
+    /**
+     * @brief Number of interleaved 16-bit channels in each frame returned by `i2s_read_fn`
+     *
+     * @note 3 means two mics and the reference lane, 2 means a plain stereo mic
+     *       frame without reference lane.
+     */
+    uint8_t i2s_rx_chan_num;
+
+    /**
+     * @brief With 3 channels, the reference lane is the first one of each frame instead of the last
+     */
+    bool i2s_rx_ref_first;
+
+    /**
+     * @brief Frames the TX DMA queue holds (dma_desc_num * dma_frame_num), how long a write
+     *        waits in the queue before it is played once the queue is full
+     */
+    uint32_t i2s_tx_dma_frames;
+
+    /**
+     * @brief Frames of one RX DMA buffer (dma_frame_num), the most a read frame can age before `i2s_read_fn` gets it
+     */
+    uint32_t i2s_rx_dma_frames;
 } bsp_codec_config_t;
 
 typedef struct {
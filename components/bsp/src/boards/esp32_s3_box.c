@@ -7,6 +7,7 @@
 #include "esp_log.h"
 #include "esp_check.h"
 #include "hal/i2s_hal.h"
+#include "driver/i2s_tdm.h"
 
 #include "bsp_board.h"
 #include "iot_button.h"
@@ -25,6 +26,20 @@
 #define ES7210_MIC_GAIN             ES7210_MIC_GAIN_30DB
 #define ES7210_ADC_VOLUME           (0)
 
+/**
+ * RX runs in TDM mode with the ES7210 slot layout of the S3-BOX, "RMNM":
+ * slot 0 is the speaker loopback used as reference, slots 1 and 3 are the
+ * two microphones and slot 2 is not connected. This is the layout Espressif's
+ * own esp-box firmware feeds to the AFE, taking slots 1 and 3 as mics and
+ * slot 0 as reference. Only the three used slots are captured, so frames
+ * arrive as reference, mic, mic; the SR feed task hands them to the AFE at a
+ * two-sample offset rather than reordering them. Four 16-bit slots per frame
+ * keep BCLK equal to the 2 x 32-bit TX frame.
+ */
+#define BSP_I2S_RX_SLOT_MASK        (I2S_TDM_SLOT0 | I2S_TDM_SLOT1 | I2S_TDM_SLOT3)
+#define BSP_I2S_RX_CHAN_NUM         (3)
+#define BSP_I2S_TDM_TOTAL_SLOT      (4)
+
 static bool bsp_home_button_get(void *param);
 
 static const pmod_pins_t g_pmod[2] = {
@@ -101,6 +116,7 @@ static const boards_info_t g_boards_info = {
 
 static i2s_chan_handle_t i2s_tx_chan;
 static i2s_chan_handle_t i2s_rx_chan;
+static volatile uint32_t i2s_rx_overflow = 0;
 
 static es7210_dev_handle_t es7210_handle = NULL;
 static es8311_handle_t es8311_handle = NULL;
@@ -162,6 +178,17 @@ static esp_err_t bsp_i2s_read(void *audio_buffer, size_t len, size_t *bytes_read
     return ret;
 }
 
+static bool IRAM_ATTR bsp_i2s_rx_overflow_cb(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx)
+{
+    i2s_rx_overflow++;
+    return false;
+}
+
+static uint32_t bsp_i2s_rx_overflow(void)
+{
+    return i2s_rx_overflow;
+}
+
 static esp_err_t bsp_i2s_write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
 {
     esp_err_t ret = ESP_OK;
@@ -177,6 +204,8 @@ static esp_err_t bsp_i2s_reconfig_clk(uint32_t rate, uint32_t bits_cfg, i2s_slot
         .slot_cfg = I2S_STD_PHILIP_SLOT_DEFAULT_CONFIG((i2s_data_bit_width_t)bits_cfg, (i2s_slot_mode_t)ch),
         .gpio_cfg = BSP_I2S_GPIO_CFG,
     };
+    /* Keep the frame length shared with the TDM RX channel */
+    std_cfg.slot_cfg.slot_bit_width = I2S_SLOT_BIT_WIDTH_32BIT;
 
     ret |= i2s_channel_disable(i2s_tx_chan);
     ret |= i2s_channel_reconfig_std_clock(i2s_tx_chan, &std_cfg.clk_cfg);
@@ -213,7 +242,7 @@ static esp_err_t bsp_codec_es7210_set()
         .bit_width = ES7210_BIT_WIDTH,
         .mic_bias = ES7210_MIC_BIAS,
         .mic_gain = ES7210_MIC_GAIN,
-        .flags.tdm_enable = false
+        .flags.tdm_enable = true
     };
     ret |= es7210_config_codec(es7210_handle, &codec_conf);
     ret |= es7210_config_volume(es7210_handle, ES7210_ADC_VOLUME);
@@ -246,7 +275,26 @@ static void bsp_codec_init()
         .slot_cfg = I2S_STD_PHILIP_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO),
         .gpio_cfg = BSP_I2S_GPIO_CFG,
     };
-    bsp_audio_init(&std_cfg, &i2s_tx_chan, &i2s_rx_chan);
+    std_cfg.slot_cfg.slot_bit_width = I2S_SLOT_BIT_WIDTH_32BIT;
+
+    i2s_tdm_config_t tdm_cfg = {
+        .clk_cfg = I2S_TDM_CLK_DEFAULT_CONFIG(16000),
+        .slot_cfg = I2S_TDM_PHILIP_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO, BSP_I2S_RX_SLOT_MASK),
+        .gpio_cfg = BSP_I2S_GPIO_CFG,
+    };
+    tdm_cfg.slot_cfg.total_slot = BSP_I2S_TDM_TOTAL_SLOT;
+
+    i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(CONFIG_BSP_I2S_NUM, I2S_ROLE_MASTER);
+    chan_cfg.auto_clear = true;
+    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, &i2s_tx_chan, &i2s_rx_chan));
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(i2s_tx_chan, &std_cfg));
+    ESP_ERROR_CHECK(i2s_channel_init_tdm_mode(i2s_rx_chan, &tdm_cfg));
+    i2s_event_callbacks_t rx_cbs = {
+        .on_recv_q_ovf = bsp_i2s_rx_overflow_cb,
+    };
+    ESP_ERROR_CHECK(i2s_channel_register_event_callback(i2s_rx_chan, &rx_cbs, NULL));
+    ESP_ERROR_CHECK(i2s_channel_enable(i2s_tx_chan));
+    ESP_ERROR_CHECK(i2s_channel_enable(i2s_rx_chan));
     bsp_audio_poweramp_enable(true);
 
     bsp_codec_config_t *codec_config = bsp_board_get_codec_handle();
@@ -256,6 +304,11 @@ static void bsp_codec_init()
     codec_config->i2s_read_fn = bsp_i2s_read;
     codec_config->i2s_write_fn = bsp_i2s_write;
     codec_config->i2s_reconfig_clk_fn = bsp_i2s_reconfig_clk;
+    codec_config->i2s_rx_overflow_fn = bsp_i2s_rx_overflow;
+    codec_config->i2s_rx_chan_num = BSP_I2S_RX_CHAN_NUM;
+    codec_config->i2s_rx_ref_first = true;
+    codec_config->i2s_tx_dma_frames = chan_cfg.dma_desc_num * chan_cfg.dma_frame_num;
+    codec_config->i2s_rx_dma_frames = chan_cfg.dma_frame_num;
 }
 
 __attribute__((weak)) void mute_btn_handler(void *handle, void *arg)
@@ -111,6 +111,7 @@ static const boards_info_t g_boards_info = {
 
 static i2s_chan_handle_t i2s_tx_chan;
 static i2s_chan_handle_t i2s_rx_chan;
+static volatile uint32_t i2s_rx_overflow = 0;
 
 static const char *TAG = "board";
 
@@ -165,6 +166,17 @@ static esp_err_t bsp_i2s_read(void *audio_buffer, size_t len, size_t *bytes_read
     return ret;
 }
 
+static bool IRAM_ATTR bsp_i2s_rx_overflow_cb(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx)
+{
+    i2s_rx_overflow++;
+    return false;
+}
+
+static uint32_t bsp_i2s_rx_overflow(void)
+{
+    return i2s_rx_overflow;
+}
+
 static esp_err_t bsp_i2s_write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
 {
     esp_err_t ret = ESP_OK;
@@ -215,6 +227,14 @@ static void bsp_codec_init()
         .gpio_cfg = BSP_I2S_GPIO_CFG,
     };
     bsp_audio_init(&std_cfg, &i2s_tx_chan, &i2s_rx_chan);
+
+    /* Callbacks can only be registered while the channel is disabled */
+    i2s_event_callbacks_t rx_cbs = {
+        .on_recv_q_ovf = bsp_i2s_rx_overflow_cb,
+    };
+    i2s_channel_disable(i2s_rx_chan);
+    i2s_channel_register_event_callback(i2s_rx_chan, &rx_cbs, NULL);
+    i2s_channel_enable(i2s_rx_chan);
     bsp_audio_poweramp_enable(true);
 
     bsp_codec_config_t *codec_config = bsp_board_get_codec_handle();
@@ -224,6 +244,12 @@ static void bsp_codec_init()
     codec_config->i2s_read_fn = bsp_i2s_read;
     codec_config->i2s_write_fn = bsp_i2s_write;
     codec_config->i2s_reconfig_clk_fn = bsp_i2s_reconfig_clk;
+    codec_config->i2s_rx_overflow_fn = bsp_i2s_rx_overflow;
+    codec_config->i2s_rx_chan_num = 2;
+    /* bsp_audio_init() creates both channels with the IDF default DMA configuration */
+    i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
+    codec_config->i2s_tx_dma_frames = chan_cfg.dma_desc_num * chan_cfg.dma_frame_num;
+    codec_config->i2s_rx_dma_frames = chan_cfg.dma_frame_num;
 }
 
 esp_err_t bsp_board_s3_box_lite_init(void)
@@ -2,8 +2,10 @@
 Load sites/sattelites from a file and configure the commands.
 
 The site configuration is loaded from sites.yaml, the intents are loaded from the github.com/home-assistant/intents repo.
+The helpers are shared with build_cmd_pack.py.
 '''
 
+import json
 import re
 import time
 
@@ -16,47 +18,47 @@ base_repo = 'https://raw.githubusercontent.com/home-assistant/intents/main/sente
 intent_scripts = ['homeassistant_HassTurnOff.yaml', 'homeassistant_HassTurnOn.yaml']
 common_script = '_common.yaml'
 
-# Load sites
-with open('sites.yaml', 'r') as f:
-    conf = yaml.safe_load(f)
-    sites = conf['sites']
+# Sentences and the intent each one triggers
+sentences = [
+    ('turn on the <name>', 'HassTurnOn'),
+    ('turn off the <name>', 'HassTurnOff'),
+    ('turn on <name>', 'HassTurnOn'),
+    ('turn off <name>', 'HassTurnOff'),
+    ('switch on the <name>', 'HassTurnOn'),
+    ('switch off the <name>', 'HassTurnOff'),
+    ('switch on <name>', 'HassTurnOn'),
+    ('switch off <name>', 'HassTurnOff'),
+    ('activate the <name>', 'HassTurnOn'),
+    ('deactivate the <name>', 'HassTurnOff'),
+    ('activate <name>', 'HassTurnOn'),
+    ('deactivate <name>', 'HassTurnOff'),
+]
 
-# Load intents from repo
-intents = {}
-for script in intent_scripts:
-    r = requests.get(base_repo + script)
+def load_conf(path='sites.yaml'):
+    with open(path, 'r') as f:
+        return yaml.safe_load(f)
+
+def load_intents():
+    # Load intents from repo
+    intents = {}
+    for script in intent_scripts:
+        r = requests.get(base_repo + script)
+        if r.status_code == 200:
+            ryaml = yaml.safe_load(r.text)
+            for intent, data in ryaml['intents'].items():
+                intents[intent] = data['data'][0]['sentences']
+        else:
+            SystemError('Failed to load intent script: ' + script)
+
+    # Load expansion rules
+    expansions = {}
+    r = requests.get(base_repo + common_script)
     if r.status_code == 200:
         ryaml = yaml.safe_load(r.text)
-        for intent, data in ryaml['intents'].items():
-            intents[intent] = data['data'][0]['sentences']
-    else:
-        SystemError('Failed to load intent script: ' + script)
-
-
-# Load expansion rules
-r = requests.get(base_repo + common_script)
-if r.status_code == 200:
-    ryaml = yaml.safe_load(r.text)
-    expansions = ryaml['expansion_rules']
-    for k, v in expansions.items():
-        expansions[k] = v[1:-1].split('|') # Remove quotes and split
-
-        
-# Construct sentences
-sentences = [
-    'turn on the <name>',
-    'turn off the <name>',
-    'turn on <name>',
-    'turn off <name>',
-    'switch on the <name>',
-    'switch off the <name>',
-    'switch on <name>',
-    'switch off <name>',
-    'activate the <name>',
-    'deactivate the <name>',
-    'activate <name>',
-    'deactivate <name>',
-]
+        expansions = ryaml['expansion_rules']
+        for k, v in expansions.items():
+            expansions[k] = v[1:-1].split('|') # Remove quotes and split
+    return intents, expansions
 
 def english_g2p(text_list, alphabet=None):
     g2p = G2p()
@@ -82,55 +84,90 @@ def english_g2p(text_list, alphabet=None):
     
     return outs
 
-site_sentences = {}
-for siteId, entities in sites.items():
-    site_sentences[siteId] = {'text': []}
+def expand_site(entities):
+    """Commands of one site as dicts of text, phonetic, intent and entity name"""
+    commands = []
     for entity in entities['lights']: # TODO: Add other entities
-        for sentence in sentences:
-            site_sentences[siteId]['text'].append(sentence.replace('<name>', entity))
-    site_sentences[siteId]['phonetic'] = english_g2p(site_sentences[siteId]['text'])
-
-    assert len(site_sentences[siteId]['text']) == len(site_sentences[siteId]['phonetic'])
-    assert len(site_sentences[siteId]['text']) <= 200
-
-# Connect to MQTT
-mqtt_connected = False
-def on_connect(client, userdata, flags, rc):
-    global mqtt_connected
-    if rc == 0:
-        print("Connected to MQTT")
-        mqtt_connected = True
-    else:
+        for sentence, intent in sentences:
+            commands.append({'text': sentence.replace('<name>', entity), 'intent': intent, 'name': entity})
+    phonetics = english_g2p([command['text'] for command in commands])
+    assert len(commands) == len(phonetics)
+    for command, phonetic in zip(commands, phonetics):
+        command['phonetic'] = phonetic
+    return commands
+
+def connect_mqtt(conf):
+    mqtt_connected = False
+    def on_connect(client, userdata, flags, rc):
+        nonlocal mqtt_connected
+        if rc == 0:
+            print("Connected to MQTT")
+            mqtt_connected = True
+        else:
+            print("Failed to connect, return code %d\n", rc)
+
+    def on_connect_fail(client, userdata, flags, rc):
         print("Failed to connect, return code %d\n", rc)
 
-def on_connect_fail(client, userdata, flags, rc):
-    print("Failed to connect, return code %d\n", rc)
-
-print("Trying to connect to:")
-print(f"\thost: {conf['mqtt']['host']}")
-print(f"\tport: {conf['mqtt']['port']}")
-print(f"\tusername: {conf['mqtt']['username']}")
-print(f"\tpassword: {conf['mqtt']['password']}")
-
-client = mqtt_client.Client()
-client.username_pw_set(conf['mqtt']['username'], conf['mqtt']['password'])
-client.on_connect = on_connect
-client.on_connect_fail = on_connect_fail
-client.connect(conf['mqtt']['host'], conf['mqtt']['port'])
-client.loop_start()
-
-counter = 0
-while not mqtt_connected:
-    print("Waiting to connect...")
-    time.sleep(3)
-    if counter > 10:
-        print("Could not connect")
-        exit
-
-# Send intents
-for siteId, data in site_sentences.items():
-    for i, (text, phonetic) in enumerate(zip(data['text'], data['phonetic'])):
-        message = f'{{"text": "{text}", "phonetic": "{phonetic}", "siteId": "{siteId}"}}'
-        client.publish(f'{conf["mqtt"]["topic"]}/add_cmd', message)
-        print(f'Sent {i+1}/{len(data["text"])}: {message}')
-        time.sleep(0.5)
+    print("Trying to connect to:")
+    print(f"\thost: {conf['mqtt']['host']}")
+    print(f"\tport: {conf['mqtt']['port']}")
+    print(f"\tusername: {conf['mqtt']['username']}")
+    print(f"\tpassword: {conf['mqtt']['password']}")
+
+    client = mqtt_client.Client()
+    client.username_pw_set(conf['mqtt']['username'], conf['mqtt']['password'])
+    client.on_connect = on_connect
+    client.on_connect_fail = on_connect_fail
+    client.connect(conf['mqtt']['host'], conf['mqtt']['port'])
+    client.loop_start()
+
+    counter = 0
+    while not mqtt_connected:
+        print("Waiting to connect...")
+        time.sleep(3)
+        counter += 1
+        if counter > 10:
+            raise SystemExit("Could not connect")
+    return client
+
+def wait_for_results(conf, client):
+    """Print what each site reports on <topic>/cmds_result/<siteId>, the returned dict fills in as results arrive"""
+    results = {}
+    def on_message(client, userdata, msg):
+        result = json.loads(msg.payload)
+        results[result['siteId']] = result
+        print(f"{result['siteId']}: {'ok' if result.get('ok', True) else 'FAILED'}, {result['total']} cmds in total")
+        for rejected in result.get('rejected', []):
+            print(f"\trejected ({rejected['reason']}): {rejected['text']}")
+
+    client.on_message = on_message
+    client.subscribe(f'{conf["mqtt"]["topic"]}/cmds_result/#')
+    return results
+
+if __name__ == '__main__':
+    conf = load_conf()
+    sites = conf['sites']
+    intents, expansions = load_intents()
+
+    site_commands = {}
+    for siteId, entities in sites.items():
+        site_commands[siteId] = expand_site(entities)
+        assert len(site_commands[siteId]) <= 200
+
+    client = connect_mqtt(conf)
+    results = wait_for_results(conf, client)
+
+    # Send intents, one message per site replaces its whole command set
+    for siteId, commands in site_commands.items():
+        message = json.dumps({'siteId': siteId, 'commands': [{'text': c['text'], 'phonetic': c['phonetic']} for c in commands]})
+        client.publish(f'{conf["mqtt"]["topic"]}/set_cmds', message, qos=1).wait_for_publish()
+        print(f'Sent {len(commands)} commands to {siteId}')
+
+    # Wait for every site to report back
+    deadline = time.time() + 30
+    while len(results) < len(site_commands) and time.time() < deadline:
+        time.sleep(0.1)
+    for siteId in site_commands:
+        if siteId not in results:
+            print(f'No result from {siteId}, is it online?')
@@ -0,0 +1,109 @@
+'''
+Stand-in for the Home Assistant WebSocket API, enough of it to run the firmware in NLU_WEBSOCKET mode against.
+
+It speaks the auth handshake, conversation/process and subscribe_events for state_changed.
+"turn on/off [the] <name>" toggles a fake entity and emits its state_changed event before
+the reply, like Home Assistant does. With --delay each reply is held back for a random time,
+so pipelined requests are answered out of order.
+
+Point HASS_WS_URI in secrets.h at ws://<this host>:8765/api/websocket.
+'''
+
+import argparse
+import asyncio
+import json
+import random
+import re
+
+import websockets
+
+TURN_RE = re.compile(r'^(?:turn|switch) (on|off) (?:the )?(.+)$|^(activate|deactivate) (?:the )?(.+)$')
+
+
+class StandIn:
+    def __init__(self, token, delay):
+        self.token = token
+        self.delay = delay
+        self.states = {}
+
+    def conversation(self, text):
+        m = TURN_RE.match(text.strip().lower())
+        if not m:
+            return [], {'response_type': 'error', 'speech': {'plain': {'speech': "Sorry, I couldn't understand that"}},
+                        'data': {'code': 'no_intent_match'}}
+        state = 'on' if m.group(1) == 'on' or m.group(3) == 'activate' else 'off'
+        name = m.group(2) or m.group(4)
+        entity_id = 'light.' + re.sub(r'\W+', '_', name)
+        old = self.states.get(entity_id, 'off')
+        self.states[entity_id] = state
+        event = {'event_type': 'state_changed', 'data': {
+            'entity_id': entity_id,
+            'old_state': {'entity_id': entity_id, 'state': old},
+            'new_state': {'entity_id': entity_id, 'state': state, 'attributes': {'friendly_name': name.title()}},
+        }}
+        target = {'type': 'entity', 'name': name.title(), 'id': entity_id}
+        return [event], {'response_type': 'action_done', 'speech': {'plain': {'speech': f'Turned {state}'}},
+                         'data': {'targets': [target], 'success': [target], 'failed': []}}
+
+    async def serve(self, ws):
+        await ws.send(json.dumps({'type': 'auth_required', 'ha_version': 'stand-in'}))
+        auth = json.loads(await ws.recv())
+        if auth.get('type') != 'auth' or auth.get('access_token') != self.token:
+            await ws.send(json.dumps({'type': 'auth_invalid', 'message': 'Invalid access token or password'}))
+            return
+        await ws.send(json.dumps({'type': 'auth_ok', 'ha_version': 'stand-in'}))
+        print('Client authenticated')
+
+        last_id = 0
+        subscription = None
+        pending = set()
+        async for raw in ws:
+            msg = json.loads(raw)
+            msg_id = msg.get('id', 0)
+            if msg_id <= last_id:
+                await ws.send(json.dumps({'id': msg_id, 'type': 'result', 'success': False,
+                                          'error': {'code': 'id_reuse', 'message': 'Identifier values have to increase.'}}))
+                continue
+            last_id = msg_id
+            print(f'<- {raw}')
+
+            if msg.get('type') == 'subscribe_events' and msg.get('event_type') == 'state_changed':
+                subscription = msg_id
+                await ws.send(json.dumps({'id': msg_id, 'type': 'result', 'success': True, 'result': None}))
+            elif msg.get('type') == 'conversation/process':
+                task = asyncio.create_task(self.process(ws, msg_id, msg.get('text', ''), subscription))
+                pending.add(task)
+                task.add_done_callback(pending.discard)
+            else:
+                await ws.send(json.dumps({'id': msg_id, 'type': 'result', 'success': False,
+                                          'error': {'code': 'unknown_command', 'message': 'Unknown command.'}}))
+
+    async def process(self, ws, msg_id, text, subscription):
+        if self.delay:
+            await asyncio.sleep(random.uniform(0, self.delay))
+        events, response = self.conversation(text)
+        if subscription is not None:
+            for event in events:
+                await ws.send(json.dumps({'id': subscription, 'type': 'event', 'event': event}))
+        reply = json.dumps({'id': msg_id, 'type': 'result', 'success': True,
+                            'result': {'response': response, 'conversation_id': None}})
+        print(f'-> {reply}')
+        await ws.send(reply)
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--host', default='0.0.0.0')
+    parser.add_argument('--port', type=int, default=8765)
+    parser.add_argument('--token', default='yourtoken', help='HASS_TOKEN of the firmware')
+    parser.add_argument('--delay', type=float, default=0, help='hold each reply back up to this many seconds')
+    args = parser.parse_args()
+
+    standin = StandIn(args.token, args.delay)
+    async with websockets.serve(standin.serve, args.host, args.port):
+        print(f'Listening on ws://{args.host}:{args.port}/api/websocket')
+        await asyncio.Future()
+
+
+if __name__ == '__main__':
+    asyncio.run(main())
@@ -16,12 +16,18 @@
 
 #include "app_api_mqtt.h"
 #include "app_hass.h"
+#include "app_sr.h"
+#include "app_sr_trace.h"
+#include "app_json_writer.h"
 #include "ui_net_config.h"
 #include "secrets.h"
 
 static const char *TAG = "app_api_mqtt";
 static esp_mqtt_client_handle_t client = NULL;
 static bool mqtt_connected = false;
+static bool mqtt_batch_active = false;
+static bool mqtt_pack_active = false;
+static bool mqtt_own_active = false;
 
 static void log_error_if_nonzero(const char *message, int error_code)
 {
@@ -62,13 +68,12 @@ esp_err_t data_handler(char *topic_, char *data, int topic_len, int data_len)
     // HERMES MESSAGES"
     if (strcmp(subtopic, "hermes") == 0) {
         // Handle hermes messages
-        ESP_LOGI(TAG, "hermes message: %s", cJSON_Print(jData));
-        
+        ESP_LOGI(TAG, "hermes message: %.*s", data_len, data);
 
     // ESP-HA MESSAGES"
     } else if (strcmp(subtopic, "esp-ha-speech") == 0) {
         // Handle esp-ha messages
-        ESP_LOGI(TAG, "esp-ha-speech message: %s", cJSON_Print(jData));
+        ESP_LOGI(TAG, "esp-ha-speech message: %.*s", data_len, data);
 
         subtopic = strtok(NULL, "/");
         if (strcmp(subtopic, "add_cmd") == 0) {
@@ -79,6 +84,28 @@ esp_err_t data_handler(char *topic_, char *data, int topic_len, int data_len)
             // Handle config messages
             app_hass_rm_all_cmd(jData);
 
+        } else if (strcmp(subtopic, "set_threshold") == 0) {
+            // Handle config messages
+            app_hass_set_threshold_from_msg(jData);
+
+        } else if (strcmp(subtopic, "set_followup") == 0) {
+            // Handle config messages
+            app_hass_set_followup_from_msg(jData);
+
+        } else if (strcmp(subtopic, "feedback") == 0) {
+            // Correct or confirm the last dispatch of a command
+            app_hass_feedback_from_msg(jData);
+
+        } else if (strcmp(subtopic, "dump_trace") == 0) {
+            // Print the latest utterance timings
+            sr_trace_dump();
+
+        } else if (strcmp(subtopic, "restart_sr") == 0) {
+            // Reload AFE and MultiNet with the current settings. Kept on this task,
+            // which makes every other change to the command set, so none of them can
+            // run into the teardown. The SR tasks are joined and dispatch uses copies.
+            app_sr_restart();
+
         }
     } else {
         ESP_LOGW(TAG, "Unknown subtopic: %s", subtopic);
@@ -87,6 +114,51 @@ esp_err_t data_handler(char *topic_, char *data, int topic_len, int data_len)
     return ESP_OK;
 }
 
+/**
+ * @brief 1 for set_cmds, 0 for add_cmds, -1 for any other topic
+ *
+ * Command batches don't fit the client buffer, so they are streamed to the
+ * parser fragment by fragment instead of going through data_handler.
+ */
+static int mqtt_batch_topic(const char *topic, int topic_len)
+{
+    static const char prefix[] = "esp-ha-speech/";
+    const int prefix_len = sizeof(prefix) - 1;
+    if (topic_len != prefix_len + 8 || 0 != strncmp(topic, prefix, prefix_len)) {
+        return -1;
+    }
+    if (0 == strncmp(topic + prefix_len, "set_cmds", 8)) {
+        return 1;
+    }
+    return 0 == strncmp(topic + prefix_len, "add_cmds", 8) ? 0 : -1;
+}
+
+/* Packs are binary and carry no siteId, the site is the last topic level instead */
+static bool mqtt_pack_topic(const char *topic, int topic_len)
+{
+    static const char pack_topic[] = "esp-ha-speech/set_pack/" MQTT_SITE_ID;
+    return topic_len == sizeof(pack_topic) - 1 && 0 == strncmp(topic, pack_topic, topic_len);
+}
+
+/**
+ * @brief Topics this device publishes to under its own subscription
+ *
+ * The broker echoes them back, they are dropped before being parsed.
+ */
+static bool mqtt_own_topic(const char *topic, int topic_len)
+{
+    static const char *const own[] = {
+        "esp-ha-speech/nbest/" MQTT_SITE_ID,
+        "esp-ha-speech/cmds_result/" MQTT_SITE_ID,
+        "esp-ha-speech/trace/" MQTT_SITE_ID,
+    };
+    for (size_t i = 0; i < sizeof(own) / sizeof(own[0]); i++) {
+        if ((size_t)topic_len == strlen(own[i]) && 0 == strncmp(topic, own[i], topic_len)) {
+            return true;
+        }
+    }
+    return false;
+}
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
@@ -119,6 +191,39 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+        // The topic only comes with the first fragment of a message
+        if (0 == event->current_data_offset) {
+            mqtt_own_active = mqtt_own_topic(event->topic, event->topic_len);
+            int replace = mqtt_batch_topic(event->topic, event->topic_len);
+            mqtt_batch_active = replace >= 0 && ESP_OK == app_hass_cmds_begin(replace);
+            mqtt_pack_active = mqtt_pack_topic(event->topic, event->topic_len)
+                               && ESP_OK == app_hass_pack_begin(event->total_data_len);
+        }
+        if (mqtt_own_active) {
+            break;
+        }
+        if (mqtt_pack_active) {
+            app_hass_pack_feed(event->data, event->data_len, event->current_data_offset);
+            if (event->current_data_offset + event->data_len >= event->total_data_len) {
+                app_hass_pack_end();
+                mqtt_pack_active = false;
+            }
+            break;
+        }
+        if (mqtt_batch_active) {
+            app_hass_cmds_feed(event->data, event->data_len);
+            if (event->current_data_offset + event->data_len >= event->total_data_len) {
+                app_hass_cmds_end();
+                mqtt_batch_active = false;
+            }
+            break;
+        }
+        if (event->data_len < event->total_data_len) {
+            if (0 == event->current_data_offset) {
+                ESP_LOGW(TAG, "Message of %d bytes doesn't fit the buffer, dropped", event->total_data_len);
+            }
+            break;
+        }
         // handle data
         data_handler(event->topic, event->data, event->topic_len, event->data_len);
         break;
@@ -162,10 +267,19 @@ esp_err_t mqtt_connect(void)
     return ESP_OK;
 }
 
+/* publish per-utterance stage timings */
+static void mqtt_publish_trace(const sr_trace_record_t *record)
+{
+    char payload[320];
+    int len = sr_trace_to_json(record, payload, sizeof(payload));
+    esp_mqtt_client_enqueue(client, "esp-ha-speech/trace/" MQTT_SITE_ID, payload, len, 0, 0, true);
+}
+
 /* start mqtt client */
 void app_api_mqtt_start(void)
 {
     ESP_ERROR_CHECK(mqtt_connect());
+    sr_trace_set_report_cb(mqtt_publish_trace);
 
     // Subscribe to hermes and configuration topics
     esp_mqtt_client_subscribe(client, "hermes/#", 0);
@@ -173,11 +287,26 @@ void app_api_mqtt_start(void)
 
 }
 
+void app_api_mqtt_publish(const char *topic, const char *payload, int len)
+{
+    esp_mqtt_client_enqueue(client, topic, payload, len, 0, 0, true);
+}
+
 /* send commands to mqtt */
-void app_api_mqtt_send_cmd(char *topic, char *cmd)
+esp_err_t app_api_mqtt_send_cmd(char *topic, char *cmd)
 {
-    char *payload = malloc(strlen(cmd) + 100);
-    sprintf(payload, "{\"input\": \"%s\", \"siteId\": \"%s\"}", cmd, MQTT_SITE_ID);
+    char payload[2 * SR_CMD_STR_LEN_MAX + 96];
+    json_writer_t w;
+    json_writer_init(&w, payload, sizeof(payload));
+    json_writer_object_begin(&w, NULL);
+    json_writer_string(&w, "input", cmd);
+    json_writer_string(&w, "siteId", MQTT_SITE_ID);
+    json_writer_object_end(&w);
+    int len = json_writer_finish(&w);
+    ESP_RETURN_ON_FALSE(len > 0, ESP_ERR_INVALID_SIZE, TAG, "Command too long: %s", cmd);
 
-    esp_mqtt_client_publish(client, topic, payload, 0, 0, 0);
+    int msg_id = esp_mqtt_client_publish(client, topic, payload, len, 0, 0);
+    sr_trace_mark(SR_TRACE_NET_DONE);
+    ESP_RETURN_ON_FALSE(msg_id >= 0, ESP_FAIL, TAG, "Failed to publish to %s", topic);
+    return ESP_OK;
 }
\ No newline at end of file
@@ -6,7 +6,12 @@ extern "C" {
 #endif
 
 void app_api_mqtt_start(void);
-void app_api_mqtt_send_cmd(char *topic, char *payload);
+esp_err_t app_api_mqtt_send_cmd(char *topic, char *payload);
+
+/**
+ * @brief Queue a raw payload for publishing, does not wait for the broker
+ */
+void app_api_mqtt_publish(const char *topic, const char *payload, int len);
 
 #ifdef __cplusplus
 }
@@ -4,8 +4,12 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 
 #include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "esp_event.h"
 #include "esp_netif.h"
@@ -16,6 +20,7 @@
 
 // #include "app_hass.h"
 #include "app_api_rest.h"
+#include "app_sr_trace.h"
 #include "ui_net_config.h"
 
 
@@ -31,17 +36,36 @@
 
 #define HTTP_OK 200
 
+#define REST_TIMEOUT_MS 3000
+#define REST_QUEUE_LEN 4
+#define REST_BACKOFF_MIN_MS 500
+#define REST_BACKOFF_MAX_MS 30000
+#define REST_KEEPALIVE_PROBE_MS 50000   /**< Below the 75 s idle timeout of the Home Assistant web server */
+
 #include "secrets.h"
 
 #define CONV_API_PATH "/api/conversation/process"
 
 static const char *TAG = "app_api_rest";
 
-/* Event Handler */
-esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+/* One request handed to the worker, lives on the caller's stack until `done` is given */
+typedef struct {
+    esp_http_client_method_t method;
+    const char *path;
+    const char *body;
+    app_api_rest_data_cb_t on_data;
+    void *ctx;
+    size_t received;            /**< Body bytes passed to `on_data` */
+    esp_err_t err;
+    int status;
+    SemaphoreHandle_t done;
+    StaticSemaphore_t done_buf;
+} rest_req_t;
+
+/* Event Handler, `user_data` is the request being performed */
+static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 {
-    static char *output_buffer;  // Buffer to store response of http request from event handler
-    static int output_len;       // Stores number of bytes read
+    rest_req_t *req = evt->user_data;
     switch(evt->event_id) {
         case HTTP_EVENT_ERROR:
             ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
@@ -57,46 +81,16 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
             break;
         case HTTP_EVENT_ON_DATA:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-            /*
-             *  Check for chunked encoding is added as the URL for chunked encoding used in this example returns binary data.
-             *  However, event handler can also be used in case chunked encoding is used.
-             */
-            if (!esp_http_client_is_chunked_response(evt->client)) {
-                // If user_data buffer is configured, copy the response into the buffer
-                int copy_len = 0;
-                if (evt->user_data) {
-                    copy_len = MIN(evt->data_len, (MAX_HTTP_OUTPUT_BUFFER - output_len));
-                    if (copy_len) {
-                        memcpy(evt->user_data + output_len, evt->data, copy_len);
-                    }
-                } else {
-                    const int buffer_len = esp_http_client_get_content_length(evt->client);
-                    if (output_buffer == NULL) {
-                        output_buffer = (char *) malloc(buffer_len);
-                        output_len = 0;
-                        if (output_buffer == NULL) {
-                            ESP_LOGE(TAG, "Failed to allocate memory for output buffer");
-                            return ESP_FAIL;
-                        }
-                    }
-                    copy_len = MIN(evt->data_len, (buffer_len - output_len));
-                    if (copy_len) {
-                        memcpy(output_buffer + output_len, evt->data, copy_len);
-                    }
-                }
-                output_len += copy_len;
+            /* The client has already taken any chunked encoding off, this is body as it arrives */
+            if (req && req->on_data) {
+                req->on_data(evt->data, evt->data_len, req->ctx);
+            }
+            if (req) {
+                req->received += evt->data_len;
             }
-
             break;
         case HTTP_EVENT_ON_FINISH:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-            if (output_buffer != NULL) {
-                // Response is accumulated in output_buffer. Uncomment the below line to print the accumulated response
-                // ESP_LOG_BUFFER_HEX(TAG, output_buffer, output_len);
-                free(output_buffer);
-                output_buffer = NULL;
-            }
-            output_len = 0;
             break;
         case HTTP_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
@@ -106,11 +100,6 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
                 ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
                 ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
             }
-            if (output_buffer != NULL) {
-                free(output_buffer);
-                output_buffer = NULL;
-            }
-            output_len = 0;
             break;
         case HTTP_EVENT_REDIRECT:
             ESP_LOGD(TAG, "HTTP_EVENT_REDIRECT");
@@ -122,70 +111,180 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
-void app_api_rest_get(char* path, char* response_buffer) {
+static QueueHandle_t s_req_que = NULL;
+static esp_http_client_handle_t s_client = NULL;
+static app_api_rest_health_t s_health = {0};
+static uint32_t s_backoff_ms = 0;
+
+static esp_http_client_handle_t rest_client_create(void)
+{
     esp_http_client_config_t config = {
         .host = HASS_URL,
         .port = HASS_PORT,
-        .path = path,
-        .method = HTTP_METHOD_GET,
+        .path = "/api/",
         .event_handler = _http_event_handler,
-        .user_data = response_buffer,       // Pass address of local buffer to get response
-        .timeout_ms = 3000,
+        .timeout_ms = REST_TIMEOUT_MS,
         .buffer_size = MAX_HTTP_OUTPUT_BUFFER,
+        .keep_alive_enable = true,
         .is_async = false,
     };
-
     esp_http_client_handle_t client = esp_http_client_init(&config);
-    // Add headers
-    esp_http_client_set_header(client, "Authorization", "Bearer " HASS_TOKEN);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-
-    // Get
-    esp_err_t err = esp_http_client_perform(client);
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "HTTP GET Status = %d, content_length = %d"PRIu64,
-                esp_http_client_get_status_code(client),
-                esp_http_client_get_content_length(client));
+    if (client) {
+        esp_http_client_set_header(client, "Authorization", "Bearer " HASS_TOKEN);
+        esp_http_client_set_header(client, "Content-Type", "application/json");
+    }
+    return client;
+}
+
+static esp_err_t rest_perform(rest_req_t *req)
+{
+    esp_http_client_set_url(s_client, req->path);
+    esp_http_client_set_method(s_client, req->method);
+    esp_http_client_set_post_field(s_client, req->body, req->body ? strlen(req->body) : 0);
+    esp_http_client_set_user_data(s_client, req);
+    esp_err_t err = esp_http_client_perform(s_client);
+    req->status = ESP_OK == err ? esp_http_client_get_status_code(s_client) : 0;
+    return err;
+}
+
+/**
+ * @brief A failed request can be sent again without Home Assistant acting on it twice
+ *
+ * A GET only reads, but a POST such as conversation/process may have run once its
+ * body went out, whatever happened to the reply. It is only retried when the
+ * connection couldn't be opened or the request couldn't be written.
+ */
+static bool rest_may_retry(const rest_req_t *req)
+{
+    if (req->received) {
+        return false;   /* `on_data` would be fed twice */
+    }
+    if (HTTP_METHOD_GET == req->method) {
+        return true;
+    }
+    return ESP_ERR_HTTP_CONNECT == req->err || ESP_ERR_HTTP_WRITE_DATA == req->err;
+}
+
+static void rest_request(rest_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    bool reused = s_health.connected;
+    s_health.requests++;
+
+    req->err = rest_perform(req);
+    if (ESP_OK != req->err && reused && rest_may_retry(req)) {
+        /* The server may have dropped the idle socket, one retry on a fresh connection */
+        ESP_LOGW(TAG, "Kept-alive connection failed (%s), reconnecting", esp_err_to_name(req->err));
+        esp_http_client_close(s_client);
+        s_health.reconnects++;
+        req->err = rest_perform(req);
+    }
+
+    if (ESP_OK == req->err) {
+        s_health.connected = true;
+        s_health.consecutive_failures = 0;
+        s_health.last_ok_us = esp_timer_get_time();
+        s_health.last_latency_ms = (s_health.last_ok_us - start) / 1000;
+        s_backoff_ms = 0;
     } else {
-        ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+        esp_http_client_close(s_client);
+        s_health.connected = false;
+        s_health.failures++;
+        s_health.consecutive_failures++;
+        s_backoff_ms = s_backoff_ms ? MIN(2 * s_backoff_ms, REST_BACKOFF_MAX_MS) : REST_BACKOFF_MIN_MS;
     }
+}
+
+/**
+ * @brief Owns the client, so requests are serialized and every one of them can reuse the socket
+ *
+ * While idle it probes the API, at backoff intervals when the last attempt failed and
+ * otherwise just often enough to keep the connection from timing out.
+ */
+static void rest_worker_task(void *arg)
+{
+    while (true) {
+        TickType_t wait = pdMS_TO_TICKS(s_health.connected ? REST_KEEPALIVE_PROBE_MS : s_backoff_ms);
+        rest_req_t *req = NULL;
+        if (pdTRUE == xQueueReceive(s_req_que, &req, s_backoff_ms || s_health.connected ? wait : portMAX_DELAY)) {
+            rest_request(req);
+            xSemaphoreGive(req->done);
+            continue;
+        }
 
-    ESP_LOGI(TAG, "HTTP GET at %s Yielded: %s", path, response_buffer);
-    esp_http_client_cleanup(client);
+        /* The body is of no interest, the status tells whether the API takes the token */
+        rest_req_t probe = {
+            .method = HTTP_METHOD_GET,
+            .path = "/api/",
+        };
+        rest_request(&probe);
+        if (ESP_OK != probe.err) {
+            ESP_LOGW(TAG, "Home Assistant unreachable, next attempt in %u ms", s_backoff_ms);
+        }
+    }
 }
 
-void app_api_rest_post(char* path, char* response_buffer, char* message) {
-    esp_http_client_config_t config = {
-        .host = HASS_URL,
-        .port = HASS_PORT,
+esp_err_t app_api_rest_start(void)
+{
+    if (s_req_que) {
+        return ESP_OK;
+    }
+    s_client = rest_client_create();
+    ESP_RETURN_ON_FALSE(NULL != s_client, ESP_FAIL, TAG, "Failed to create http client");
+    s_req_que = xQueueCreate(REST_QUEUE_LEN, sizeof(rest_req_t *));
+    ESP_RETURN_ON_FALSE(NULL != s_req_que, ESP_ERR_NO_MEM, TAG, "Failed to create request queue");
+    BaseType_t ret_val = xTaskCreatePinnedToCore(rest_worker_task, "REST Worker", 6 * 1024, NULL, 5, NULL, 0);
+    ESP_RETURN_ON_FALSE(pdPASS == ret_val, ESP_FAIL, TAG, "Failed create REST worker");
+    return ESP_OK;
+}
+
+esp_err_t app_api_rest_get_health(app_api_rest_health_t *health)
+{
+    ESP_RETURN_ON_FALSE(NULL != health, ESP_ERR_INVALID_ARG, TAG, "pointer of health is invaild");
+    memcpy(health, &s_health, sizeof(app_api_rest_health_t));
+    return ESP_OK;
+}
+
+/* Hand a request to the worker and wait for it, the worker bounds it with REST_TIMEOUT_MS per attempt */
+static esp_err_t rest_call(esp_http_client_method_t method, const char *path, const char *body,
+                           app_api_rest_data_cb_t on_data, void *ctx)
+{
+    ESP_RETURN_ON_ERROR(app_api_rest_start(), TAG, "REST worker not running");
+    rest_req_t req = {
+        .method = method,
         .path = path,
-        .method = HTTP_METHOD_POST,
-        .event_handler = _http_event_handler,
-        .user_data = response_buffer,       // Pass address of local buffer to get response
-        .timeout_ms = 3000,
-        .buffer_size = MAX_HTTP_OUTPUT_BUFFER,
-        .is_async = false,
+        .body = body,
+        .on_data = on_data,
+        .ctx = ctx,
     };
+    req.done = xSemaphoreCreateBinaryStatic(&req.done_buf);
+    rest_req_t *p = &req;
+    ESP_RETURN_ON_FALSE(pdTRUE == xQueueSend(s_req_que, &p, 0), ESP_ERR_TIMEOUT, TAG, "REST queue full");
+    xSemaphoreTake(req.done, portMAX_DELAY);
+    vSemaphoreDelete(req.done);
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    // Add headers
-    esp_http_client_set_header(client, "Authorization", "Bearer " HASS_TOKEN);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-
-    esp_http_client_set_post_field(client, message, strlen(message));
-
-    // Post
-    esp_err_t err = esp_http_client_perform(client);
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "HTTP POST Status = %d, content_length = %d"PRIu64,
-                esp_http_client_get_status_code(client),
-                esp_http_client_get_content_length(client));
+    if (ESP_OK == req.err && req.status >= 400) {
+        req.err = ESP_FAIL;
+    }
+    if (ESP_OK == req.err) {
+        ESP_LOGI(TAG, "HTTP %s %s Status = %d, %u ms", HTTP_METHOD_GET == method ? "GET" : "POST", path,
+                 req.status, s_health.last_latency_ms);
     } else {
-        ESP_LOGE(TAG, "HTTP POST request failed: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "HTTP %s %s failed: %s, Status = %d", HTTP_METHOD_GET == method ? "GET" : "POST", path,
+                 esp_err_to_name(req.err), req.status);
     }
+    return req.err;
+}
+
+esp_err_t app_api_rest_get(const char *path, app_api_rest_data_cb_t on_data, void *ctx) {
+    return rest_call(HTTP_METHOD_GET, path, NULL, on_data, ctx);
+}
 
-    ESP_LOGI(TAG, "HTTP POST at %s with data %s, Yielded: %s", path, message, response_buffer);
-    esp_http_client_cleanup(client);
+esp_err_t app_api_rest_post(const char *path, const char *message, app_api_rest_data_cb_t on_data, void *ctx) {
+    esp_err_t ret = rest_call(HTTP_METHOD_POST, path, message, on_data, ctx);
+    sr_trace_mark(SR_TRACE_NET_DONE);
+    ESP_LOGI(TAG, "HTTP POST at %s with data %s", path, message);
+    return ret;
 }
 
 // void app_api_rest_test(void *pvParameters) {
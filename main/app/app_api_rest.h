@@ -1,14 +1,46 @@
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 #include "esp_err.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct {
+    bool connected;                 /**< The last request succeeded, the next one reuses its socket */
+    uint32_t requests;
+    uint32_t failures;
+    uint32_t reconnects;            /**< Kept-alive sockets found dead and reopened */
+    uint32_t consecutive_failures;
+    int64_t last_ok_us;             /**< esp_timer time of the last success, 0 if none yet */
+    uint32_t last_latency_ms;
+} app_api_rest_health_t;
+
 // void app_api_rest_test(void)
 
-void app_api_rest_get(char* path, char* response_buffer);
-void app_api_rest_post(char* path, char* response_buffer, char* message);
+/**
+ * @brief Start the REST worker, which owns one keep-alive connection to Home Assistant
+ *
+ * @note app_api_rest_get/post start it on first use
+ */
+esp_err_t app_api_rest_start(void);
+esp_err_t app_api_rest_get_health(app_api_rest_health_t *health);
+
+/**
+ * @brief Receives the response body piece by piece, from the REST worker while the request runs
+ */
+typedef void (*app_api_rest_data_cb_t)(const char *data, int len, void *ctx);
+
+/**
+ * @brief Blocking requests, run by the REST worker on its connection
+ *
+ * The body goes to `on_data` as it arrives and is not kept, `on_data` may be
+ * NULL when only the status matters. A request fails on a transport error as
+ * well as on an HTTP error status.
+ */
+esp_err_t app_api_rest_get(const char *path, app_api_rest_data_cb_t on_data, void *ctx);
+esp_err_t app_api_rest_post(const char *path, const char *message, app_api_rest_data_cb_t on_data, void *ctx);
 
 #ifdef __cplusplus
 }
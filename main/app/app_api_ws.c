@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_websocket_client.h"
+
+#include "cJSON.h"
+
+#include "app_api_ws.h"
+#include "ui_net_config.h"
+
+#define WS_TIMEOUT_MS 3000
+#define WS_RECONNECT_MS 5000
+#define WS_PENDING_MAX 8
+#define WS_TX_BUFFER_MAX 512
+#define WS_RX_BUFFER_MAX (8 * 1024)    /**< Larger messages, typically events of entities with big attributes, are dropped */
+#define WS_OPCODE_TEXT 0x01
+#define WS_SUBSCRIBE_ID 1               /**< Sent right after auth_ok, requests are numbered from here on */
+
+#include "secrets.h"
+
+static const char *TAG = "app_api_ws";
+
+/* A request waiting for its reply, `id` 0 marks a free slot */
+typedef struct {
+    uint32_t id;
+    app_api_ws_result_cb_t cb;
+    void *ctx;
+} ws_pending_t;
+
+/* A blocking call, lives on the caller's stack until `done` is given */
+typedef struct {
+    app_api_ws_result_cb_t cb;
+    void *ctx;
+    esp_err_t err;
+    SemaphoreHandle_t done;
+    StaticSemaphore_t done_buf;
+} ws_call_t;
+
+static esp_websocket_client_handle_t s_client = NULL;
+static SemaphoreHandle_t s_lock = NULL;         /**< Guards the pending table, also taken by the client task */
+static SemaphoreHandle_t s_tx_lock = NULL;      /**< Keeps ids going out in increasing order, never taken by the client task */
+static ws_pending_t s_pending[WS_PENDING_MAX];
+static uint32_t s_next_id = WS_SUBSCRIBE_ID + 1;
+static volatile bool s_ready = false;
+static char *s_rx_buf = NULL;
+static size_t s_rx_len = 0;
+static bool s_rx_drop = false;
+static app_api_ws_event_cb_t s_event_cb = NULL;
+static void *s_event_ctx = NULL;
+
+static esp_err_t ws_pending_add(uint32_t id, app_api_ws_result_cb_t cb, void *ctx)
+{
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < WS_PENDING_MAX; i++) {
+        if (0 == s_pending[i].id) {
+            s_pending[i] = (ws_pending_t) {
+                .id = id,
+                .cb = cb,
+                .ctx = ctx,
+            };
+            ret = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return ret;
+}
+
+/* Remove the request `id`, false if its reply is already being delivered */
+static bool ws_pending_take(uint32_t id, ws_pending_t *out)
+{
+    bool found = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < WS_PENDING_MAX; i++) {
+        if (id == s_pending[i].id) {
+            if (out) {
+                *out = s_pending[i];
+            }
+            s_pending[i].id = 0;
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+/* The connection is gone, and with it any reply still due */
+static void ws_pending_fail_all(void)
+{
+    for (int i = 0; i < WS_PENDING_MAX; i++) {
+        ws_pending_t p;
+        uint32_t id = s_pending[i].id;
+        if (id && ws_pending_take(id, &p) && p.cb) {
+            p.cb(ESP_ERR_INVALID_STATE, NULL, p.ctx);
+        }
+    }
+}
+
+static void ws_send_raw(const char *msg)
+{
+    if (esp_websocket_client_send_text(s_client, msg, strlen(msg), pdMS_TO_TICKS(WS_TIMEOUT_MS)) < 0) {
+        ESP_LOGE(TAG, "Failed to send %s", msg);
+    }
+}
+
+static void ws_handle_result(const cJSON *msg, uint32_t id)
+{
+    bool success = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(msg, "success"));
+    if (WS_SUBSCRIBE_ID == id) {
+        ESP_LOGI(TAG, "Subscription to state_changed %s", success ? "active" : "refused");
+        return;
+    }
+
+    ws_pending_t p;
+    if (!ws_pending_take(id, &p)) {
+        ESP_LOGW(TAG, "Reply to id %u nobody waits for", id);
+        return;
+    }
+    if (p.cb) {
+        p.cb(success ? ESP_OK : ESP_FAIL, cJSON_GetObjectItemCaseSensitive(msg, success ? "result" : "error"), p.ctx);
+    }
+}
+
+static void ws_handle_message(const cJSON *msg)
+{
+    const cJSON *type = cJSON_GetObjectItemCaseSensitive(msg, "type");
+    const cJSON *id = cJSON_GetObjectItemCaseSensitive(msg, "id");
+    if (!cJSON_IsString(type)) {
+        ESP_LOGW(TAG, "Message without type");
+        return;
+    }
+
+    if (0 == strcmp(type->valuestring, "result") && cJSON_IsNumber(id)) {
+        ws_handle_result(msg, id->valueint);
+    } else if (0 == strcmp(type->valuestring, "event") && cJSON_IsNumber(id)) {
+        if (WS_SUBSCRIBE_ID == id->valueint && s_event_cb) {
+            s_event_cb(cJSON_GetObjectItemCaseSensitive(msg, "event"), s_event_ctx);
+        }
+    } else if (0 == strcmp(type->valuestring, "auth_required")) {
+        ws_send_raw("{\"type\": \"auth\", \"access_token\": \"" HASS_TOKEN "\"}");
+    } else if (0 == strcmp(type->valuestring, "auth_ok")) {
+        ws_send_raw("{\"id\": 1, \"type\": \"subscribe_events\", \"event_type\": \"state_changed\"}");
+        s_next_id = WS_SUBSCRIBE_ID + 1;
+        s_ready = true;
+        ESP_LOGI(TAG, "Authenticated");
+        ui_net_config_update_cb(UI_NET_EVT_CLOUD_CONNECTED, NULL);
+    } else if (0 == strcmp(type->valuestring, "auth_invalid")) {
+        const cJSON *message = cJSON_GetObjectItemCaseSensitive(msg, "message");
+        ESP_LOGE(TAG, "Authentication refused: %s", cJSON_IsString(message) ? message->valuestring : "");
+    }
+}
+
+/* Frames may come in several pieces of the client buffer size, they are joined before parsing */
+static void ws_handle_data(const esp_websocket_event_data_t *data)
+{
+    if (WS_OPCODE_TEXT != data->op_code) {
+        return;
+    }
+    if (0 == data->payload_offset) {
+        s_rx_len = 0;
+        s_rx_drop = data->payload_len >= WS_RX_BUFFER_MAX;
+        if (s_rx_drop) {
+            ESP_LOGD(TAG, "Dropping message of %d bytes", data->payload_len);
+        }
+    }
+    if (s_rx_drop || s_rx_len + data->data_len >= WS_RX_BUFFER_MAX) {
+        return;
+    }
+    memcpy(s_rx_buf + s_rx_len, data->data_ptr, data->data_len);
+    s_rx_len += data->data_len;
+    if (data->payload_offset + data->data_len < data->payload_len) {
+        return;
+    }
+
+    cJSON *root = cJSON_ParseWithLength(s_rx_buf, s_rx_len);
+    if (NULL == root) {
+        ESP_LOGW(TAG, "Invalid JSON of %d bytes", s_rx_len);
+        return;
+    }
+    /* With coalescing the server may batch messages in an array */
+    if (cJSON_IsArray(root)) {
+        const cJSON *msg;
+        cJSON_ArrayForEach(msg, root) {
+            ws_handle_message(msg);
+        }
+    } else {
+        ws_handle_message(root);
+    }
+    cJSON_Delete(root);
+}
+
+static void ws_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_websocket_event_data_t *data = (esp_websocket_event_data_t *) event_data;
+    switch (event_id) {
+    case WEBSOCKET_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "WEBSOCKET_EVENT_CONNECTED");
+        break;
+    case WEBSOCKET_EVENT_DISCONNECTED:
+    case WEBSOCKET_EVENT_CLOSED:
+        ESP_LOGI(TAG, "WEBSOCKET_EVENT_DISCONNECTED");
+        if (s_ready) {
+            ui_net_config_update_cb(UI_NET_EVT_WIFI_CONNECTED, NULL);
+        }
+        s_ready = false;
+        ws_pending_fail_all();
+        break;
+    case WEBSOCKET_EVENT_DATA:
+        ws_handle_data(data);
+        break;
+    case WEBSOCKET_EVENT_ERROR:
+        ESP_LOGW(TAG, "WEBSOCKET_EVENT_ERROR");
+        break;
+    }
+}
+
+esp_err_t app_api_ws_start(void)
+{
+    if (s_client) {
+        return ESP_OK;
+    }
+    s_lock = xSemaphoreCreateMutex();
+    s_tx_lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(NULL != s_lock && NULL != s_tx_lock, ESP_ERR_NO_MEM, TAG, "Failed create ws locks");
+    s_rx_buf = heap_caps_malloc(WS_RX_BUFFER_MAX, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != s_rx_buf, ESP_ERR_NO_MEM, TAG, "No mem for ws receive buffer");
+
+    esp_websocket_client_config_t config = {
+#ifdef HASS_WS_URI
+        .uri = HASS_WS_URI,
+#else
+        .host = HASS_URL,
+        .port = HASS_PORT,
+        .path = "/api/websocket",
+#endif
+        .reconnect_timeout_ms = WS_RECONNECT_MS,
+        .network_timeout_ms = WS_TIMEOUT_MS,
+        .task_stack = 6 * 1024,
+    };
+    s_client = esp_websocket_client_init(&config);
+    ESP_RETURN_ON_FALSE(NULL != s_client, ESP_FAIL, TAG, "Failed to create websocket client");
+    esp_websocket_register_events(s_client, WEBSOCKET_EVENT_ANY, ws_event_handler, NULL);
+    return esp_websocket_client_start(s_client);
+}
+
+bool app_api_ws_is_connected(void)
+{
+    return s_ready;
+}
+
+void app_api_ws_set_event_cb(app_api_ws_event_cb_t cb, void *ctx)
+{
+    s_event_ctx = ctx;
+    s_event_cb = cb;
+}
+
+static esp_err_t ws_request(const char *payload, app_api_ws_result_cb_t cb, void *ctx, uint32_t *out_id)
+{
+    ESP_RETURN_ON_FALSE(NULL != payload && '{' == payload[0], ESP_ERR_INVALID_ARG, TAG, "payload is not an object");
+    ESP_RETURN_ON_FALSE(s_ready, ESP_ERR_INVALID_STATE, TAG, "Not connected to Home Assistant");
+
+    esp_err_t ret = ESP_OK;
+    char msg[WS_TX_BUFFER_MAX];
+    xSemaphoreTake(s_tx_lock, portMAX_DELAY);
+    uint32_t id = s_next_id++;
+    int len = snprintf(msg, sizeof(msg), "{\"id\": %u, %s", id, payload + 1);
+    ESP_GOTO_ON_FALSE(len > 0 && len < sizeof(msg), ESP_ERR_INVALID_SIZE, err, TAG, "Request of %d bytes too long", len);
+    ESP_GOTO_ON_ERROR(ws_pending_add(id, cb, ctx), err, TAG, "Too many requests in flight");
+    if (esp_websocket_client_send_text(s_client, msg, len, pdMS_TO_TICKS(WS_TIMEOUT_MS)) < 0) {
+        ws_pending_take(id, NULL);
+        ESP_GOTO_ON_FALSE(false, ESP_FAIL, err, TAG, "Failed to send request %u", id);
+    }
+    if (out_id) {
+        *out_id = id;
+    }
+err:
+    xSemaphoreGive(s_tx_lock);
+    return ret;
+}
+
+esp_err_t app_api_ws_request(const char *payload, app_api_ws_result_cb_t cb, void *ctx)
+{
+    return ws_request(payload, cb, ctx, NULL);
+}
+
+static void ws_call_done(esp_err_t err, const cJSON *result, void *ctx)
+{
+    ws_call_t *call = ctx;
+    if (call->cb) {
+        call->cb(err, result, call->ctx);
+    }
+    call->err = err;
+    xSemaphoreGive(call->done);
+}
+
+esp_err_t app_api_ws_call(const char *payload, uint32_t timeout_ms, app_api_ws_result_cb_t cb, void *ctx)
+{
+    ws_call_t call = {
+        .cb = cb,
+        .ctx = ctx,
+    };
+    call.done = xSemaphoreCreateBinaryStatic(&call.done_buf);
+
+    uint32_t id = 0;
+    esp_err_t ret = ws_request(payload, ws_call_done, &call, &id);
+    if (ESP_OK == ret) {
+        if (pdTRUE == xSemaphoreTake(call.done, pdMS_TO_TICKS(timeout_ms))) {
+            ret = call.err;
+        } else if (ws_pending_take(id, NULL)) {
+            ESP_LOGW(TAG, "No reply to request %u within %u ms", id, timeout_ms);
+            ret = ESP_ERR_TIMEOUT;
+        } else {
+            /* The reply came just now and `call` is in use, wait for it to be done */
+            xSemaphoreTake(call.done, portMAX_DELAY);
+            ret = call.err;
+        }
+    }
+    vSemaphoreDelete(call.done);
+    return ret;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Outcome of a request
+ *
+ * @param err ESP_OK with the `result` member of the reply, ESP_FAIL with its `error`
+ *            member when Home Assistant refused the request, ESP_ERR_INVALID_STATE
+ *            with NULL when the connection dropped before the reply came
+ */
+typedef void (*app_api_ws_result_cb_t)(esp_err_t err, const cJSON *result, void *ctx);
+
+/**
+ * @brief Called with the `event` member of every state_changed event
+ */
+typedef void (*app_api_ws_event_cb_t)(const cJSON *event, void *ctx);
+
+/**
+ * @brief Connect to the Home Assistant WebSocket API at HASS_WS_URI
+ *
+ * The client authenticates with HASS_TOKEN on every (re)connection and then
+ * subscribes to state_changed events. Requests are refused until that is done.
+ */
+esp_err_t app_api_ws_start(void);
+bool app_api_ws_is_connected(void);
+void app_api_ws_set_event_cb(app_api_ws_event_cb_t cb, void *ctx);
+
+/**
+ * @brief Send a request and return without waiting for its reply
+ *
+ * `payload` is a JSON object without an "id", e.g. {"type": "conversation/process", "text": "..."},
+ * the client numbers it and matches the reply by that number, so any number of
+ * requests, up to the pending table, can be in flight on the one connection.
+ * `cb` is called from the client task once, on the reply or on a disconnect.
+ */
+esp_err_t app_api_ws_request(const char *payload, app_api_ws_result_cb_t cb, void *ctx);
+
+/**
+ * @brief Blocking app_api_ws_request(), `cb` may be NULL
+ *
+ * @return The `err` that `cb` got, or ESP_ERR_TIMEOUT when no reply came within `timeout_ms`
+ */
+esp_err_t app_api_ws_call(const char *payload, uint32_t timeout_ms, app_api_ws_result_cb_t cb, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
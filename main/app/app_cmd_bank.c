@@ -0,0 +1,114 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "esp_partition.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "app_cmd_pack.h"
+#include "app_cmd_bank.h"
+
+static const char *TAG = "cmd_bank";
+
+static const esp_partition_t *g_part = NULL;
+static const uint8_t *g_map = NULL;
+static esp_partition_mmap_handle_t g_map_handle;
+static size_t g_bank_size = 0;
+static int g_active = -1;
+
+static const cmd_bank_header_t *bank_header(int bank)
+{
+    return (const cmd_bank_header_t *)(g_map + bank * g_bank_size);
+}
+
+static bool bank_is_valid(int bank)
+{
+    const cmd_bank_header_t *h = bank_header(bank);
+    return CMD_BANK_MAGIC == h->magic && h->size <= g_bank_size - sizeof(cmd_bank_header_t)
+           && ESP_OK == cmd_pack_validate(h + 1, h->size);
+}
+
+/* Newest valid bank, -1 if neither is */
+static int bank_pick(void)
+{
+    bool valid0 = bank_is_valid(0);
+    bool valid1 = bank_is_valid(1);
+    if (valid0 && valid1) {
+        return (int32_t)(bank_header(1)->seq - bank_header(0)->seq) > 0 ? 1 : 0;
+    }
+    return valid0 ? 0 : (valid1 ? 1 : -1);
+}
+
+esp_err_t cmd_bank_init(void)
+{
+    if (g_map) {
+        return ESP_OK;
+    }
+
+    g_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, CMD_BANK_PARTITION_SUBTYPE, CMD_BANK_PARTITION_NAME);
+    ESP_RETURN_ON_FALSE(NULL != g_part, ESP_ERR_NOT_FOUND, TAG, "No command pack partition");
+    g_bank_size = (g_part->size / 2) & ~(g_part->erase_size - 1);
+    ESP_RETURN_ON_FALSE(g_bank_size > sizeof(cmd_bank_header_t), ESP_ERR_INVALID_SIZE, TAG, "Command pack partition too small");
+
+    const void *map = NULL;
+    ESP_RETURN_ON_ERROR(esp_partition_mmap(g_part, 0, 2 * g_bank_size, ESP_PARTITION_MMAP_DATA, &map, &g_map_handle),
+                        TAG, "Failed to map command pack partition");
+    g_map = map;
+    g_active = bank_pick();
+    ESP_LOGI(TAG, "Command pack partition, %d bytes per bank, active bank %d", g_bank_size, g_active);
+    return ESP_OK;
+}
+
+bool cmd_bank_is_ready(void)
+{
+    return NULL != g_map;
+}
+
+const void *cmd_bank_active(size_t *len)
+{
+    if (NULL == g_map || g_active < 0) {
+        return NULL;
+    }
+    const cmd_bank_header_t *h = bank_header(g_active);
+    if (len) {
+        *len = h->size;
+    }
+    return h + 1;
+}
+
+esp_err_t cmd_bank_write(const void *pack, size_t len)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_map, ESP_ERR_INVALID_STATE, TAG, "Command pack partition not ready");
+    ESP_RETURN_ON_FALSE(len <= g_bank_size - sizeof(cmd_bank_header_t), ESP_ERR_INVALID_SIZE, TAG,
+                        "Pack of %d bytes exceeds the bank", len);
+
+    int bank = g_active < 0 ? 0 : !g_active;
+    size_t offset = bank * g_bank_size;
+    cmd_bank_header_t h = {
+        .magic = CMD_BANK_MAGIC,
+        .seq = g_active < 0 ? 1 : bank_header(g_active)->seq + 1,
+        .size = len,
+    };
+
+    /* Header goes last, a bank cut short by a power loss never looks valid */
+    ESP_RETURN_ON_ERROR(esp_partition_erase_range(g_part, offset, g_bank_size), TAG, "Failed to erase bank %d", bank);
+    ESP_RETURN_ON_ERROR(esp_partition_write(g_part, offset + sizeof(h), pack, len), TAG, "Failed to write bank %d", bank);
+    ESP_RETURN_ON_ERROR(esp_partition_write(g_part, offset, &h, sizeof(h)), TAG, "Failed to flip to bank %d", bank);
+
+    ESP_RETURN_ON_FALSE(bank_is_valid(bank), ESP_ERR_INVALID_CRC, TAG, "Bank %d doesn't read back", bank);
+    g_active = bank;
+    ESP_LOGI(TAG, "Pack of %d bytes active in bank %d, seq %u", len, bank, h.seq);
+    return ESP_OK;
+}
+
+esp_err_t cmd_bank_erase(void)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_map, ESP_ERR_INVALID_STATE, TAG, "Command pack partition not ready");
+    g_active = -1;
+    ESP_RETURN_ON_ERROR(esp_partition_erase_range(g_part, 0, 2 * g_bank_size), TAG, "Failed to erase banks");
+    ESP_LOGI(TAG, "Both banks erased");
+    return ESP_OK;
+}
@@ -0,0 +1,69 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CMD_BANK_PARTITION_NAME "cmds"
+#define CMD_BANK_PARTITION_SUBTYPE (0x40)
+#define CMD_BANK_MAGIC (0x4b4e4243)     /**< "CBNK" */
+
+/**
+ * @brief Header at the start of each bank, written after the pack it describes
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;       /**< The valid bank with the higher sequence is the active one */
+    uint32_t size;      /**< Bytes of the command pack that follows */
+    uint32_t reserved;
+} cmd_bank_header_t;
+
+/**
+ * @brief Command pack partition, two banks mapped once through the flash cache
+ *
+ * Packs are read in place, so commands loaded from here reference their
+ * strings in flash. A new pack goes to the inactive bank and only becomes
+ * active once its header is written, so a power loss keeps the previous set.
+ *
+ * @return ESP_ERR_NOT_FOUND if the partition table has no command pack partition
+ */
+esp_err_t cmd_bank_init(void);
+
+/**
+ * @brief true once cmd_bank_init() succeeded
+ */
+bool cmd_bank_is_ready(void);
+
+/**
+ * @brief Mapped pack of the active bank, validated, NULL if no bank holds one
+ */
+const void *cmd_bank_active(size_t *len);
+
+/**
+ * @brief Write a pack to the inactive bank and make it the active one
+ *
+ * @note The previously active pack stays readable until the next write
+ */
+esp_err_t cmd_bank_write(const void *pack, size_t len);
+
+/**
+ * @brief Erase both banks, so no pack is active anymore
+ *
+ * @note Nothing may still reference strings of the active pack
+ */
+esp_err_t cmd_bank_erase(void);
+
+#ifdef __cplusplus
+}
+#endif
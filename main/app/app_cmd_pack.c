@@ -0,0 +1,128 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "esp_rom_crc.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "app_cmd_pack.h"
+
+static const char *TAG = "cmd_pack";
+
+static inline const uint16_t *pack_text_off(const cmd_pack_header_t *h)
+{
+    return (const uint16_t *)(h + 1);
+}
+
+static inline const uint16_t *pack_phoneme_off(const cmd_pack_header_t *h)
+{
+    return pack_text_off(h) + h->count;
+}
+
+static inline const char *pack_text_table(const cmd_pack_header_t *h)
+{
+    return (const char *)(pack_phoneme_off(h) + h->count);
+}
+
+static inline const char *pack_phoneme_table(const cmd_pack_header_t *h)
+{
+    return pack_text_table(h) + h->text_size;
+}
+
+static inline size_t pack_size(const cmd_pack_header_t *h)
+{
+    return sizeof(cmd_pack_header_t) + 2 * h->count * sizeof(uint16_t) + h->text_size + h->phoneme_size;
+}
+
+size_t cmd_pack_build(cmd_pack_get_fn get, uint16_t count, uint8_t *buf, size_t len)
+{
+    cmd_pack_header_t h = {
+        .magic = CMD_PACK_MAGIC,
+        .version = CMD_PACK_VERSION,
+        .count = count,
+    };
+    for (uint16_t i = 0; i < count; i++) {
+        const sr_cmd_t *cmd = get(i);
+        if (NULL == cmd) {
+            return 0;
+        }
+        h.text_size += strlen(cmd->str) + 1;
+        h.phoneme_size += strlen(cmd->phoneme) + 1;
+    }
+    if (h.text_size > UINT16_MAX || h.phoneme_size > UINT16_MAX) {
+        ESP_LOGE(TAG, "Command set too large for a pack");
+        return 0;
+    }
+
+    size_t size = pack_size(&h);
+    if (NULL == buf) {
+        return size;
+    }
+    if (len < size) {
+        return 0;
+    }
+
+    cmd_pack_header_t *out = (cmd_pack_header_t *)buf;
+    memcpy(out, &h, sizeof(h));
+    uint16_t *text_off = (uint16_t *)pack_text_off(out);
+    uint16_t *phoneme_off = (uint16_t *)pack_phoneme_off(out);
+    char *text = (char *)pack_text_table(out);
+    char *phoneme = (char *)pack_phoneme_table(out);
+    uint16_t t = 0, p = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        const sr_cmd_t *cmd = get(i);
+        text_off[i] = t;
+        phoneme_off[i] = p;
+        strcpy(text + t, cmd->str);
+        strcpy(phoneme + p, cmd->phoneme);
+        t += strlen(cmd->str) + 1;
+        p += strlen(cmd->phoneme) + 1;
+    }
+    out->crc = esp_rom_crc32_le(0, buf + sizeof(h), size - sizeof(h));
+    return size;
+}
+
+esp_err_t cmd_pack_validate(const void *pack, size_t len)
+{
+    const cmd_pack_header_t *h = pack;
+    ESP_RETURN_ON_FALSE(NULL != pack && len >= sizeof(cmd_pack_header_t), ESP_ERR_INVALID_SIZE, TAG, "pack too short");
+    ESP_RETURN_ON_FALSE(CMD_PACK_MAGIC == h->magic, ESP_ERR_NOT_FOUND, TAG, "no pack");
+    ESP_RETURN_ON_FALSE(CMD_PACK_VERSION == h->version, ESP_ERR_NOT_SUPPORTED, TAG, "pack version %d not supported", h->version);
+    ESP_RETURN_ON_FALSE(h->text_size <= UINT16_MAX && h->phoneme_size <= UINT16_MAX && pack_size(h) <= len,
+                        ESP_ERR_INVALID_SIZE, TAG, "pack sizes are invalid");
+
+    size_t size = pack_size(h);
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)pack + sizeof(cmd_pack_header_t), size - sizeof(cmd_pack_header_t));
+    ESP_RETURN_ON_FALSE(crc == h->crc, ESP_ERR_INVALID_CRC, TAG, "pack crc mismatch");
+
+    /* Both tables end in NUL, so in-range offsets always give terminated strings */
+    if (h->count) {
+        ESP_RETURN_ON_FALSE(h->text_size && h->phoneme_size && '\0' == pack_text_table(h)[h->text_size - 1]
+                            && '\0' == pack_phoneme_table(h)[h->phoneme_size - 1], ESP_ERR_INVALID_STATE, TAG, "pack tables are not terminated");
+    }
+    for (uint16_t i = 0; i < h->count; i++) {
+        ESP_RETURN_ON_FALSE(pack_text_off(h)[i] < h->text_size && pack_phoneme_off(h)[i] < h->phoneme_size,
+                            ESP_ERR_INVALID_STATE, TAG, "pack offset %d out of range", i);
+    }
+    return ESP_OK;
+}
+
+uint16_t cmd_pack_count(const void *pack)
+{
+    return ((const cmd_pack_header_t *)pack)->count;
+}
+
+const char *cmd_pack_text(const void *pack, uint16_t i)
+{
+    const cmd_pack_header_t *h = pack;
+    return pack_text_table(h) + pack_text_off(h)[i];
+}
+
+const char *cmd_pack_phoneme(const void *pack, uint16_t i)
+{
+    const cmd_pack_header_t *h = pack;
+    return pack_phoneme_table(h) + pack_phoneme_off(h)[i];
+}
@@ -0,0 +1,65 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "app_sr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CMD_PACK_MAGIC (0x50444d43)     /**< "CMDP" */
+#define CMD_PACK_VERSION (1)
+
+/**
+ * @brief Command pack, a whole command set as one little endian binary image
+ *
+ *   header
+ *   uint16_t text_off[count]       offsets into the text table
+ *   uint16_t phoneme_off[count]    offsets into the phoneme table
+ *   text table                     NUL terminated strings
+ *   phoneme table                  NUL terminated strings
+ *
+ * `crc` is the standard CRC-32 (zlib.crc32) of everything after the header.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t text_size;
+    uint32_t phoneme_size;
+    uint32_t crc;
+} cmd_pack_header_t;
+
+typedef sr_cmd_t *(*cmd_pack_get_fn)(uint32_t id);
+
+/**
+ * @brief Serialize commands 0 .. count-1 as returned by `get`
+ *
+ * @param buf Output, may be NULL to only size the pack
+ * @return Size of the pack, 0 if `len` is too small or a command is missing
+ */
+size_t cmd_pack_build(cmd_pack_get_fn get, uint16_t count, uint8_t *buf, size_t len);
+
+/**
+ * @brief Check magic, version, sizes, CRC and string termination before anything is read from a pack
+ */
+esp_err_t cmd_pack_validate(const void *pack, size_t len);
+
+/**
+ * @brief Accessors, only valid on a pack that passed cmd_pack_validate()
+ */
+uint16_t cmd_pack_count(const void *pack);
+const char *cmd_pack_text(const void *pack, uint16_t i);
+const char *cmd_pack_phoneme(const void *pack, uint16_t i);
+
+#ifdef __cplusplus
+}
+#endif
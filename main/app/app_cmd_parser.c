@@ -0,0 +1,173 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "app_cmd_parser.h"
+
+static void copy_str(char *dst, size_t dst_len, const char *src, size_t src_len, bool *is_long)
+{
+    size_t n = src_len < dst_len - 1 ? src_len : dst_len - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    if (is_long) {
+        *is_long = src_len > n;
+    }
+}
+
+static void str_push(cmd_parser_t *p, char c)
+{
+    if (p->str_len < sizeof(p->str) - 1) {
+        p->str[p->str_len++] = c;
+    } else {
+        p->str_long = true;
+    }
+}
+
+static void on_string(cmd_parser_t *p)
+{
+    if (p->depth && '{' == p->stack[p->depth - 1] && p->expect_key) {
+        copy_str(p->key, sizeof(p->key), p->str, p->str_len, NULL);
+        return;
+    }
+
+    if (1 == p->depth && 0 == strcmp(p->key, "siteId")) {
+        copy_str(p->site_id, sizeof(p->site_id), p->str, p->str_len, NULL);
+    } else if (p->in_commands && 3 == p->depth) {
+        /* A string cut by the scratch buffer is long for the pair too */
+        size_t len = p->str_long ? sizeof(p->str) : p->str_len;
+        if (0 == strcmp(p->key, "text")) {
+            copy_str(p->pair.text, sizeof(p->pair.text), p->str, len, &p->pair.text_long);
+        } else if (0 == strcmp(p->key, "phonetic")) {
+            copy_str(p->pair.phonetic, sizeof(p->pair.phonetic), p->str, len, &p->pair.phonetic_long);
+        }
+    }
+}
+
+static void on_open(cmd_parser_t *p, char c)
+{
+    if (p->depth >= CMD_PARSER_DEPTH_MAX || (0 == p->depth && p->started)) {
+        p->error = true;
+        return;
+    }
+    if ('[' == c && 1 == p->depth && 0 == strcmp(p->key, "commands")) {
+        p->in_commands = true;
+    } else if ('{' == c && p->in_commands && 2 == p->depth) {
+        memset(&p->pair, 0, sizeof(p->pair));
+    }
+    p->stack[p->depth++] = c;
+    p->started = true;
+    p->expect_key = '{' == c;
+    p->key[0] = '\0';
+}
+
+static void on_close(cmd_parser_t *p, char c)
+{
+    char open = '}' == c ? '{' : '[';
+    if (0 == p->depth || open != p->stack[p->depth - 1]) {
+        p->error = true;
+        return;
+    }
+    p->depth--;
+    if (p->in_commands && 2 == p->depth && '}' == c) {
+        p->pair_cb(&p->pair, p->ctx);
+    } else if (p->in_commands && 1 == p->depth) {
+        p->in_commands = false;
+    }
+    /* The key of the enclosing level is done with once its value closes */
+    p->key[0] = '\0';
+    p->expect_key = false;
+}
+
+static int hex_val(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static void on_str_char(cmd_parser_t *p, char c)
+{
+    if (p->uni_left) {
+        int v = hex_val(c);
+        if (v < 0) {
+            p->error = true;
+            return;
+        }
+        p->uni = (p->uni << 4) | v;
+        if (0 == --p->uni_left) {
+            /* Phrases are ASCII, anything wider can't be spoken by the model anyway */
+            str_push(p, p->uni < 0x80 ? (char)p->uni : '?');
+        }
+    } else if (p->esc) {
+        p->esc = false;
+        switch (c) {
+        case 'n': str_push(p, '\n'); break;
+        case 't': str_push(p, '\t'); break;
+        case 'r': str_push(p, '\r'); break;
+        case 'b': str_push(p, '\b'); break;
+        case 'f': str_push(p, '\f'); break;
+        case 'u': p->uni_left = 4; p->uni = 0; break;
+        default: str_push(p, c); break;
+        }
+    } else if ('\\' == c) {
+        p->esc = true;
+    } else if ('"' == c) {
+        p->in_str = false;
+        on_string(p);
+    } else {
+        str_push(p, c);
+    }
+}
+
+void cmd_parser_init(cmd_parser_t *parser, cmd_parser_pair_cb_t pair_cb, void *ctx)
+{
+    memset(parser, 0, sizeof(cmd_parser_t));
+    parser->pair_cb = pair_cb;
+    parser->ctx = ctx;
+}
+
+void cmd_parser_feed(cmd_parser_t *parser, const char *data, size_t len)
+{
+    cmd_parser_t *p = parser;
+    for (size_t i = 0; i < len && !p->error; i++) {
+        char c = data[i];
+        if (p->in_str) {
+            on_str_char(p, c);
+            continue;
+        }
+        switch (c) {
+        case '"':
+            p->in_str = true;
+            p->str_len = 0;
+            p->str_long = false;
+            break;
+        case '{':
+        case '[':
+            on_open(p, c);
+            break;
+        case '}':
+        case ']':
+            on_close(p, c);
+            break;
+        case ':':
+            p->expect_key = false;
+            break;
+        case ',':
+            p->expect_key = p->depth && '{' == p->stack[p->depth - 1];
+            break;
+        default:
+            /* Whitespace, numbers and literals carry nothing we need */
+            break;
+        }
+    }
+}
+
+bool cmd_parser_done(const cmd_parser_t *parser)
+{
+    return parser->started && 0 == parser->depth && !parser->in_str && !parser->error;
+}
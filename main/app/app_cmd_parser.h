@@ -0,0 +1,76 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "app_sr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CMD_PARSER_SITE_LEN_MAX (32)
+#define CMD_PARSER_DEPTH_MAX (8)
+
+/**
+ * @brief Called once per object of the "commands" array
+ *
+ * Strings that didn't fit are truncated and flagged with `text_long` / `phonetic_long`,
+ * a missing key leaves its string empty.
+ */
+typedef struct {
+    char text[SR_CMD_STR_LEN_MAX];
+    char phonetic[SR_CMD_PHONEME_LEN_MAX];
+    bool text_long;
+    bool phonetic_long;
+} cmd_parser_pair_t;
+
+typedef void (*cmd_parser_pair_cb_t)(const cmd_parser_pair_t *pair, void *ctx);
+
+/**
+ * @brief Streaming scanner for {"siteId": "...", "commands": [{"text": "...", "phonetic": "..."}, ...]}
+ *
+ * Bytes can be fed in fragments of any size, as MQTT delivers a large
+ * message, so the whole payload never has to be held or built into a tree.
+ * Unknown keys are skipped, values other than strings are ignored.
+ */
+typedef struct {
+    cmd_parser_pair_cb_t pair_cb;
+    void *ctx;
+    char site_id[CMD_PARSER_SITE_LEN_MAX];
+    bool error;
+
+    /* Scanner state */
+    bool started;
+    uint8_t depth;
+    char stack[CMD_PARSER_DEPTH_MAX];   /**< '{' or '[' per level */
+    bool expect_key;
+    bool in_str;
+    bool esc;
+    uint8_t uni_left;                   /**< Hex digits of a \u escape still to come */
+    uint16_t uni;
+    char key[12];                       /**< Last key seen at the current level, truncated */
+    char str[SR_CMD_PHONEME_LEN_MAX > SR_CMD_STR_LEN_MAX ? SR_CMD_PHONEME_LEN_MAX : SR_CMD_STR_LEN_MAX];
+    size_t str_len;
+    bool str_long;
+    bool in_commands;
+    cmd_parser_pair_t pair;
+} cmd_parser_t;
+
+void cmd_parser_init(cmd_parser_t *parser, cmd_parser_pair_cb_t pair_cb, void *ctx);
+void cmd_parser_feed(cmd_parser_t *parser, const char *data, size_t len);
+
+/**
+ * @brief true if the whole document was seen and well nested
+ */
+bool cmd_parser_done(const cmd_parser_t *parser);
+
+#ifdef __cplusplus
+}
+#endif
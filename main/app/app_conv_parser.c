@@ -0,0 +1,196 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "app_conv_parser.h"
+
+/* Length of `s` without a multibyte sequence cut short at its end */
+static size_t utf8_trim(const char *s, size_t len)
+{
+    size_t i = len;
+    while (i > 0 && 0x80 == (s[i - 1] & 0xc0)) {
+        i--;
+    }
+    if (0 == i || !(s[i - 1] & 0x80)) {
+        return len;
+    }
+    unsigned char lead = s[i - 1];
+    size_t need = lead >= 0xf0 ? 4 : (lead >= 0xe0 ? 3 : 2);
+    return len - (i - 1) >= need ? len : i - 1;
+}
+
+static void copy_str(char *dst, size_t dst_len, const char *src, size_t src_len)
+{
+    size_t n = src_len < dst_len - 1 ? src_len : utf8_trim(src, dst_len - 1);
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+static void str_push(conv_parser_t *p, char c)
+{
+    if (p->str_len < sizeof(p->str) - 1) {
+        p->str[p->str_len++] = c;
+    }
+}
+
+static void str_push_utf8(conv_parser_t *p, uint16_t u)
+{
+    if (u < 0x80) {
+        str_push(p, u);
+    } else if (u < 0x800) {
+        str_push(p, 0xc0 | (u >> 6));
+        str_push(p, 0x80 | (u & 0x3f));
+    } else if (u >= 0xd800 && u < 0xe000) {
+        /* Surrogate pairs only encode what a small display can't draw */
+        str_push(p, '?');
+    } else {
+        str_push(p, 0xe0 | (u >> 12));
+        str_push(p, 0x80 | ((u >> 6) & 0x3f));
+        str_push(p, 0x80 | (u & 0x3f));
+    }
+}
+
+/* The current value sits at `key` in the reply */
+static bool at(const conv_parser_t *p, const char *k0, const char *k1, const char *k2)
+{
+    return 0 == strcmp(p->keys[0], k0) && (NULL == k1 || 0 == strcmp(p->keys[1], k1))
+           && (NULL == k2 || 0 == strcmp(p->keys[2], k2));
+}
+
+static void on_string(conv_parser_t *p)
+{
+    conv_reply_t *r = &p->reply;
+    size_t len = utf8_trim(p->str, p->str_len);
+    if (p->depth && '{' == p->stack[p->depth - 1] && p->expect_key) {
+        copy_str(p->keys[p->depth - 1], CONV_PARSER_KEY_LEN_MAX, p->str, len);
+        return;
+    }
+
+    if (2 == p->depth && at(p, "response", "response_type", NULL)) {
+        copy_str(r->response_type, sizeof(r->response_type), p->str, len);
+    } else if (4 == p->depth && at(p, "response", "speech", "plain") && 0 == strcmp(p->keys[3], "speech")) {
+        copy_str(r->speech, sizeof(r->speech), p->str, len);
+    } else if (5 == p->depth && (at(p, "response", "data", "targets") || at(p, "response", "data", "success"))
+               && '[' == p->stack[3] && 0 == strcmp(p->keys[4], "name")
+               && r->target_num < CONV_PARSER_TARGET_NUM_MAX) {
+        copy_str(r->targets[r->target_num++], CONV_PARSER_TARGET_LEN_MAX, p->str, len);
+    }
+}
+
+static void on_open(conv_parser_t *p, char c)
+{
+    if (p->depth >= CONV_PARSER_DEPTH_MAX || (0 == p->depth && p->started)) {
+        p->error = true;
+        return;
+    }
+    if ('{' == c && 4 == p->depth && '[' == p->stack[3] && at(p, "response", "data", "failed")
+            && p->reply.failed_num < UINT8_MAX) {
+        p->reply.failed_num++;
+    }
+    p->stack[p->depth] = c;
+    p->keys[p->depth][0] = '\0';
+    p->depth++;
+    p->started = true;
+    p->expect_key = '{' == c;
+}
+
+static void on_close(conv_parser_t *p, char c)
+{
+    char open = '}' == c ? '{' : '[';
+    if (0 == p->depth || open != p->stack[p->depth - 1]) {
+        p->error = true;
+        return;
+    }
+    p->depth--;
+    p->expect_key = false;
+}
+
+static int hex_val(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static void on_str_char(conv_parser_t *p, char c)
+{
+    if (p->uni_left) {
+        int v = hex_val(c);
+        if (v < 0) {
+            p->error = true;
+            return;
+        }
+        p->uni = (p->uni << 4) | v;
+        if (0 == --p->uni_left) {
+            str_push_utf8(p, p->uni);
+        }
+    } else if (p->esc) {
+        p->esc = false;
+        switch (c) {
+        case 'n': str_push(p, '\n'); break;
+        case 't': str_push(p, '\t'); break;
+        case 'r': str_push(p, '\r'); break;
+        case 'b': str_push(p, '\b'); break;
+        case 'f': str_push(p, '\f'); break;
+        case 'u': p->uni_left = 4; p->uni = 0; break;
+        default: str_push(p, c); break;
+        }
+    } else if ('\\' == c) {
+        p->esc = true;
+    } else if ('"' == c) {
+        p->in_str = false;
+        on_string(p);
+    } else {
+        str_push(p, c);
+    }
+}
+
+void conv_parser_init(conv_parser_t *parser)
+{
+    memset(parser, 0, sizeof(conv_parser_t));
+}
+
+void conv_parser_feed(conv_parser_t *parser, const char *data, size_t len)
+{
+    conv_parser_t *p = parser;
+    for (size_t i = 0; i < len && !p->error; i++) {
+        char c = data[i];
+        if (p->in_str) {
+            on_str_char(p, c);
+            continue;
+        }
+        switch (c) {
+        case '"':
+            p->in_str = true;
+            p->str_len = 0;
+            break;
+        case '{':
+        case '[':
+            on_open(p, c);
+            break;
+        case '}':
+        case ']':
+            on_close(p, c);
+            break;
+        case ':':
+            p->expect_key = false;
+            break;
+        case ',':
+            p->expect_key = p->depth && '{' == p->stack[p->depth - 1];
+            break;
+        default:
+            /* Whitespace, numbers and literals carry nothing we need */
+            break;
+        }
+    }
+}
+
+bool conv_parser_done(const conv_parser_t *parser)
+{
+    return parser->started && 0 == parser->depth && !parser->in_str && !parser->error;
+}
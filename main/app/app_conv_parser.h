@@ -0,0 +1,70 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONV_PARSER_TYPE_LEN_MAX (24)
+#define CONV_PARSER_SPEECH_LEN_MAX (128)
+#define CONV_PARSER_TARGET_NUM_MAX (4)
+#define CONV_PARSER_TARGET_LEN_MAX (48)
+#define CONV_PARSER_DEPTH_MAX (8)
+#define CONV_PARSER_KEY_LEN_MAX (16)
+
+/**
+ * @brief What a Home Assistant conversation reply says, strings are truncated to fit
+ */
+typedef struct {
+    char response_type[CONV_PARSER_TYPE_LEN_MAX];  /**< "action_done", "query_answer" or "error" */
+    char speech[CONV_PARSER_SPEECH_LEN_MAX];       /**< response.speech.plain.speech, UTF-8 */
+    char targets[CONV_PARSER_TARGET_NUM_MAX][CONV_PARSER_TARGET_LEN_MAX];
+    uint8_t target_num;                             /**< Names in response.data.targets and .success, the first few */
+    uint8_t failed_num;                             /**< Entries of response.data.failed */
+} conv_reply_t;
+
+/**
+ * @brief Streaming scanner for the reply of /api/conversation/process
+ *
+ * Fed straight from the HTTP body as it arrives, in pieces of any size, so
+ * the reply is never held whole and a long one is not cut off. Everything
+ * but the fields of conv_reply_t is skipped without being stored.
+ */
+typedef struct {
+    conv_reply_t reply;
+    bool error;
+
+    /* Scanner state */
+    bool started;
+    uint8_t depth;
+    char stack[CONV_PARSER_DEPTH_MAX];                          /**< '{' or '[' per level */
+    char keys[CONV_PARSER_DEPTH_MAX][CONV_PARSER_KEY_LEN_MAX];  /**< Key of the current member per object level, truncated */
+    bool expect_key;
+    bool in_str;
+    bool esc;
+    uint8_t uni_left;                                           /**< Hex digits of a \u escape still to come */
+    uint16_t uni;
+    char str[CONV_PARSER_SPEECH_LEN_MAX];
+    size_t str_len;
+} conv_parser_t;
+
+void conv_parser_init(conv_parser_t *parser);
+void conv_parser_feed(conv_parser_t *parser, const char *data, size_t len);
+
+/**
+ * @brief true if the whole document was seen and well nested
+ */
+bool conv_parser_done(const conv_parser_t *parser);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,11 +5,14 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
+#include <freertos/queue.h>
 
 #include "esp_log.h"
 #include "esp_event.h"
 #include "esp_err.h"
 #include "esp_check.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "esp_mn_models.h"
 #include "esp_mn_speech_commands.h"
 #include "nvs_flash.h"
@@ -17,18 +20,35 @@
 
 #include "app_hass.h"
 #include "app_sr.h"
+#include "app_sr_trace.h"
+#include "app_sr_reject.h"
+#include "app_sr_cmds.h"
+#include "app_cmd_parser.h"
+#include "app_cmd_pack.h"
+#include "app_cmd_bank.h"
+#include "app_json_writer.h"
+#include "app_conv_parser.h"
 #include "ui_net_config.h"
 
 #include "app_api_rest.h"
 #include "app_api_mqtt.h"
+#include "app_api_ws.h"
+#include "ui_sr.h"
 
 #include "cJSON.h"
 
-#define MAX_HTTP_RECV_BUFFER 512
-#define MAX_HTTP_OUTPUT_BUFFER 2048
 #define MAX_CMDS 200
+#define CMD_PACK_UPLOAD_MAX (64 * 1024)
+#define DISPATCH_QUEUE_LEN 4
+#define CMD_PAYLOAD_MAX (2 * SR_CMD_STR_LEN_MAX + 64)   /**< Room for a command with every char escaped */
+#define WS_CONV_TIMEOUT_MS 5000
+#define WS_FEEDBACK_WINDOW_MS 3000  /**< State changes this soon after a command are shown as its outcome */
 
 #define NAME_SPACE "sr_cmds"
+#define CMD_PACK_KEY "cmd_pack"
+#define THRESHOLDS_KEY "thr"
+#define GLOBAL_THRESHOLD_KEY "thr_g"
+#define FOLLOWUP_KEY "followup"
 
 #include "secrets.h"
 
@@ -36,140 +56,557 @@
 
 static const char *TAG = "app_hass";
 static bool hass_connected = false;
-static uint32_t keynum = 0;
 
 static void app_api_rest_test(void *pvParameters) {
 
-    char response[MAX_HTTP_OUTPUT_BUFFER] = {0};
-    app_api_rest_get("/api/", response);
+    /* The status says it all, /api/ only answers 200 to a valid token */
+    hass_connected = ESP_OK == app_api_rest_get("/api/", NULL, NULL);
+    ui_net_config_update_cb(hass_connected ? UI_NET_EVT_CLOUD_CONNECTED : UI_NET_EVT_WIFI_CONNECTED, NULL);
 
-    if (strcmp(response, "{\"message\":\"API running\"}")) {
-        ui_net_config_update_cb(UI_NET_EVT_CLOUD_CONNECTED, NULL);
-        hass_connected = true;
-    } else {
-        ui_net_config_update_cb(UI_NET_EVT_WIFI_CONNECTED, NULL);
-        hass_connected = false;
+    ESP_LOGI(TAG, "%s", hass_connected ? "Connected" : "Home Assistant API not reachable");
+
+    vTaskDelete(NULL);
+}
+
+#if NLU_MODE == NLU_HASS
+static void app_hass_conv_feed(const char *data, int len, void *ctx)
+{
+    conv_parser_feed(ctx, data, len);
+}
+
+/* An "error" response is a refused command even though the request succeeded */
+static esp_err_t app_hass_conv_reply(const conv_parser_t *parser)
+{
+    const conv_reply_t *reply = &parser->reply;
+    ESP_RETURN_ON_FALSE(conv_parser_done(parser), ESP_ERR_INVALID_RESPONSE, TAG, "Incomplete reply from Home Assistant");
+
+    ESP_LOGI(TAG, "Home Assistant: %s (%s)", reply->speech, reply->response_type);
+    for (int i = 0; i < reply->target_num; i++) {
+        ESP_LOGI(TAG, "Target: %s", reply->targets[i]);
+    }
+    if (reply->failed_num) {
+        ESP_LOGW(TAG, "%d targets failed", reply->failed_num);
     }
+    return 0 == strcmp(reply->response_type, "error") ? ESP_FAIL : ESP_OK;
+}
+#endif
 
-    ESP_LOGI(TAG, "Connected");
+#if NLU_MODE == NLU_WEBSOCKET
+static int64_t s_feedback_until_us = 0;
 
-    vTaskDelete(NULL);
+/* The conversation reply, an "error" response is a refused command even though the request succeeded */
+static void app_hass_conv_result(esp_err_t err, const cJSON *result, void *ctx)
+{
+    if (ESP_OK != err) {
+        return;
+    }
+    const cJSON *response = cJSON_GetObjectItemCaseSensitive(result, "response");
+    const cJSON *type = cJSON_GetObjectItemCaseSensitive(response, "response_type");
+    const cJSON *plain = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(response, "speech"), "plain");
+    const cJSON *speech = cJSON_GetObjectItemCaseSensitive(plain, "speech");
+    ESP_LOGI(TAG, "Home Assistant: %s (%s)", cJSON_IsString(speech) ? speech->valuestring : "",
+             cJSON_IsString(type) ? type->valuestring : "?");
+    if (cJSON_IsString(type) && 0 == strcmp(type->valuestring, "error")) {
+        *(esp_err_t *) ctx = ESP_FAIL;
+    }
 }
 
-void app_hass_send_cmd(char *cmd)
+/* Runs on the websocket client task for every state_changed event */
+static void app_hass_state_changed(const cJSON *event, void *ctx)
 {
+    char text[64];
+    const cJSON *data = cJSON_GetObjectItemCaseSensitive(event, "data");
+    const cJSON *entity_id = cJSON_GetObjectItemCaseSensitive(data, "entity_id");
+    const cJSON *new_state = cJSON_GetObjectItemCaseSensitive(data, "new_state");
+    const cJSON *state = cJSON_GetObjectItemCaseSensitive(new_state, "state");
+    if (!cJSON_IsString(entity_id) || !cJSON_IsString(state)) {
+        return;
+    }
+    ESP_LOGD(TAG, "%s -> %s", entity_id->valuestring, state->valuestring);
+
+    if (esp_timer_get_time() < s_feedback_until_us) {
+        const cJSON *attributes = cJSON_GetObjectItemCaseSensitive(new_state, "attributes");
+        const cJSON *name = cJSON_GetObjectItemCaseSensitive(attributes, "friendly_name");
+        snprintf(text, sizeof(text), "%s: %s", cJSON_IsString(name) ? name->valuestring : entity_id->valuestring,
+                 state->valuestring);
+        sr_anim_set_text(text);
+    }
+}
+#endif
+
+esp_err_t app_hass_send_cmd(char *cmd)
+{
+    esp_err_t ret = ESP_OK;
+    sr_trace_mark(SR_TRACE_SEND_START);
+#if NLU_MODE != NLU_RHASSPY
+    /* On the stack and escaped, nothing on the way out touches the heap */
+    char message[CMD_PAYLOAD_MAX];
+    json_writer_t w;
+    json_writer_init(&w, message, sizeof(message));
+    json_writer_object_begin(&w, NULL);
+#if NLU_MODE == NLU_WEBSOCKET
+    json_writer_string(&w, "type", "conversation/process");
+#endif
+    json_writer_string(&w, "text", cmd);
+    json_writer_object_end(&w);
+    ESP_RETURN_ON_FALSE(json_writer_finish(&w) > 0, ESP_ERR_INVALID_SIZE, TAG, "Command too long: %s", cmd);
+#endif
+
 #if NLU_MODE == NLU_RHASSPY
 
     ESP_LOGI(TAG, "Sending command to Rhasspy");
-    app_api_mqtt_send_cmd("hermes/nlu/query", cmd);
+    ret = app_api_mqtt_send_cmd("hermes/nlu/query", cmd);
 
 #elif NLU_MODE == NLU_HASS
 
     ESP_LOGI(TAG, "Sending command to Home Assistant");
-    char response[MAX_HTTP_OUTPUT_BUFFER] = {0};
-    char *message = malloc(strlen(cmd) + 100);
-    sprintf(message, "{\"text\": \"%s\"}", cmd);
-    app_api_rest_post("/api/conversation/process", response, message);
+    conv_parser_t parser;
+    conv_parser_init(&parser);
+    ret = app_api_rest_post(CONV_API_PATH, message, app_hass_conv_feed, &parser);
+    if (ESP_OK == ret) {
+        ret = app_hass_conv_reply(&parser);
+    }
+
+#elif NLU_MODE == NLU_WEBSOCKET
+
+    ESP_LOGI(TAG, "Sending command to Home Assistant over WebSocket");
+    /* The state changes usually arrive before the reply, so the window opens with the request */
+    esp_err_t conv = ESP_OK;
+    s_feedback_until_us = esp_timer_get_time() + WS_FEEDBACK_WINDOW_MS * 1000;
+    ret = app_api_ws_call(message, WS_CONV_TIMEOUT_MS, app_hass_conv_result, &conv);
+    sr_trace_mark(SR_TRACE_NET_DONE);
+    ret = ESP_OK == ret ? conv : ret;
+    if (ESP_OK != ret) {
+        s_feedback_until_us = 0;
+    }
 
 #endif
+    sr_trace_mark(SR_TRACE_SEND_FINISH);
+    return ret;
 }
 
-esp_err_t app_hass_write_cmd_to_nvs(char *cmd, char *phoneme)
+/* Command texts of a result, copied before the result leaves the SR handler task */
+typedef char app_hass_texts_t[SR_NBEST_NUM][SR_CMD_STR_LEN_MAX];
+
+static void app_hass_copy_texts(const sr_result_t *result, app_hass_texts_t texts)
+{
+    for (int i = 0; i < SR_NBEST_NUM; i++) {
+        /* The best hypothesis is command_id, whether the N-best list was filled or not */
+        int id = 0 == i ? result->command_id : result->command_ids[i];
+        const sr_cmd_t *cmd = 0 == i || i < result->num ? app_sr_get_cmd_from_id(id) : NULL;
+        snprintf(texts[i], SR_CMD_STR_LEN_MAX, "%s", cmd ? cmd->str : "");
+    }
+}
+
+#if NLU_MODE == NLU_RHASSPY
+/**
+ * @brief Format the hypotheses of a result as JSON, returns the length written
+ */
+static int app_hass_nbest_to_json(const sr_result_t *result, app_hass_texts_t texts, char *buf, size_t len)
+{
+    json_writer_t w;
+    json_writer_init(&w, buf, len);
+    json_writer_object_begin(&w, NULL);
+    json_writer_string(&w, "siteId", MQTT_SITE_ID);
+    json_writer_bool(&w, "ambiguous", sr_result_margin(result) < SR_NBEST_AMBIGUOUS_MARGIN);
+    json_writer_array_begin(&w, "hypotheses");
+    for (int i = 0; i < result->num; i++) {
+        json_writer_object_begin(&w, NULL);
+        json_writer_int(&w, "command_id", result->command_ids[i]);
+        json_writer_string(&w, "text", texts[i]);
+        json_writer_float(&w, "prob", result->probs[i]);
+        json_writer_object_end(&w);
+    }
+    json_writer_array_end(&w);
+    json_writer_object_end(&w);
+    return json_writer_finish(&w);
+}
+#endif
+
+static esp_err_t app_hass_send_texts(const sr_result_t *result, app_hass_texts_t texts)
+{
+    ESP_RETURN_ON_FALSE('\0' != texts[0][0], ESP_ERR_NOT_FOUND, TAG, "can't find cmd id:%d", result->command_id);
+
+    if (sr_result_margin(result) < SR_NBEST_AMBIGUOUS_MARGIN) {
+        ESP_LOGW(TAG, "Ambiguous result, margin %.3f", sr_result_margin(result));
+    }
+
+#if NLU_MODE == NLU_RHASSPY
+    char payload[SR_NBEST_NUM * (2 * SR_CMD_STR_LEN_MAX + 48) + 96];
+    int len = app_hass_nbest_to_json(result, texts, payload, sizeof(payload));
+    if (len > 0) {
+        app_api_mqtt_publish("esp-ha-speech/nbest/" MQTT_SITE_ID, payload, len);
+    }
+#endif
+
+    return app_hass_send_cmd(texts[0]);
+}
+
+esp_err_t app_hass_send_result(const sr_result_t *result)
+{
+    app_hass_texts_t texts;
+    app_hass_copy_texts(result, texts);
+    return app_hass_send_texts(result, texts);
+}
+
+typedef struct {
+    sr_result_t result;
+    app_hass_texts_t texts;     /**< The table can be replaced or renumbered before the item is sent */
+    int64_t deadline_us;
+    app_hass_dispatch_cb_t cb;
+    void *ctx;
+} dispatch_item_t;
+
+static QueueHandle_t g_dispatch_que = NULL;
+
+static void app_hass_dispatch_done(const dispatch_item_t *item, app_hass_dispatch_status_t status)
+{
+    if (item->cb) {
+        item->cb(item->result.command_id, status, item->ctx);
+    }
+}
+
+/* Sends one result at a time, so a slow or dead network only ever holds up this task */
+static void app_hass_dispatch_task(void *pvParam)
+{
+    dispatch_item_t item;
+    while (true) {
+        xQueueReceive(g_dispatch_que, &item, portMAX_DELAY);
+
+        int64_t late_us = esp_timer_get_time() - item.deadline_us;
+        if (late_us > 0) {
+            ESP_LOGW(TAG, "Dropping cmd id:%d, %lld ms past its deadline", item.result.command_id, late_us / 1000);
+            app_hass_dispatch_done(&item, APP_HASS_DISPATCH_EXPIRED);
+            continue;
+        }
+
+        esp_err_t ret = app_hass_send_texts(&item.result, item.texts);
+        app_hass_dispatch_done(&item, ESP_OK == ret ? APP_HASS_DISPATCH_OK : APP_HASS_DISPATCH_FAILED);
+    }
+}
+
+static esp_err_t app_hass_dispatch_start(void)
+{
+    if (g_dispatch_que) {
+        return ESP_OK;
+    }
+    g_dispatch_que = xQueueCreate(DISPATCH_QUEUE_LEN, sizeof(dispatch_item_t));
+    ESP_RETURN_ON_FALSE(NULL != g_dispatch_que, ESP_ERR_NO_MEM, TAG, "Failed create dispatch queue");
+    BaseType_t ret_val = xTaskCreatePinnedToCore(app_hass_dispatch_task, "Dispatch Task", 4 * 1024, NULL, 5, NULL, 0);
+    ESP_RETURN_ON_FALSE(pdPASS == ret_val, ESP_FAIL, TAG, "Failed create dispatch task");
+    return ESP_OK;
+}
+
+esp_err_t app_hass_dispatch(const sr_result_t *result, uint32_t deadline_ms, app_hass_dispatch_cb_t cb, void *ctx)
+{
+    ESP_RETURN_ON_FALSE(NULL != result, ESP_ERR_INVALID_ARG, TAG, "pointer of result is invaild");
+    ESP_RETURN_ON_FALSE(NULL != g_dispatch_que, ESP_ERR_INVALID_STATE, TAG, "Not connected, dropping cmd id:%d",
+                        result->command_id);
+
+    dispatch_item_t item = {
+        .result = *result,
+        .deadline_us = esp_timer_get_time() + (int64_t) deadline_ms * 1000,
+        .cb = cb,
+        .ctx = ctx,
+    };
+    app_hass_copy_texts(result, item.texts);
+
+    /* A full queue means the network is stuck, the oldest command is the least worth sending */
+    while (pdTRUE != xQueueSend(g_dispatch_que, &item, 0)) {
+        dispatch_item_t oldest;
+        if (pdTRUE == xQueueReceive(g_dispatch_que, &oldest, 0)) {
+            ESP_LOGW(TAG, "Dispatch queue full, dropping cmd id:%d", oldest.result.command_id);
+            app_hass_dispatch_done(&oldest, APP_HASS_DISPATCH_DROPPED);
+        }
+    }
+    return ESP_OK;
+}
+
+/* Thresholds are stored as permille, one u16 per command id in a single blob, 0 for none */
+static void app_hass_write_thresholds_to_nvs(void)
 {
-    ESP_LOGI(TAG, "Saving cmd %d to NVS", keynum);
-    ESP_RETURN_ON_FALSE(keynum<MAX_CMDS, ESP_FAIL, TAG, "Too many commands, only %d allowed", MAX_CMDS);
     nvs_handle_t my_handle = {0};
     esp_err_t err = nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle);
     if (err != ESP_OK) {
         ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
-    } else {
-        char cmd_key[10];
-        char phoneme_key[10];
-        sprintf(cmd_key, "cmd%d", keynum);
-        sprintf(phoneme_key, "pho%d", keynum);
-        err = nvs_set_str(my_handle, cmd_key, cmd);
-        err = nvs_set_str(my_handle, phoneme_key, phoneme);
-        ESP_LOGI(TAG, "Saving cmd %d to NVS", keynum);
-        err |= nvs_commit(my_handle);
+        return;
+    }
+    /* The rejection engine holds all of them, write the table as it is now */
+    uint16_t count = app_sr_get_cmd_num();
+    uint16_t *permille = heap_caps_calloc(count ? count : 1, sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == permille) {
+        nvs_close(my_handle);
+        ESP_LOGE(TAG, "memory for thresholds is not enough");
+        return;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        sr_reject_stat_t stat = {0};
+        sr_reject_get_stat(i, &stat);
+        permille[i] = (uint16_t)(stat.threshold * 1000 + 0.5f);
+    }
+    err = nvs_set_blob(my_handle, THRESHOLDS_KEY, permille, count * sizeof(uint16_t));
+    heap_caps_free(permille);
+    err |= nvs_commit(my_handle);
+    nvs_close(my_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save thresholds");
+    }
+}
+
+static void app_hass_write_global_threshold_to_nvs(float threshold)
+{
+    nvs_handle_t my_handle = {0};
+    esp_err_t err = nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+        return;
+    }
+    err = nvs_set_u16(my_handle, GLOBAL_THRESHOLD_KEY, (uint16_t)(threshold * 1000 + 0.5f));
+    err |= nvs_commit(my_handle);
+    nvs_close(my_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save global threshold");
+    }
+}
+
+static void app_hass_read_thresholds_from_nvs(void)
+{
+    nvs_handle_t my_handle = {0};
+    if (ESP_OK != nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle)) {
+        return;
+    }
+    uint16_t permille = 0;
+    if (ESP_OK == nvs_get_u16(my_handle, GLOBAL_THRESHOLD_KEY, &permille)) {
+        sr_reject_set_global(permille / 1000.0f);
+    }
+
+    size_t size = 0;
+    if (ESP_OK != nvs_get_blob(my_handle, THRESHOLDS_KEY, NULL, &size) || 0 == size) {
         nvs_close(my_handle);
-        keynum++;
+        return;
+    }
+    uint16_t *table = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (table && ESP_OK == nvs_get_blob(my_handle, THRESHOLDS_KEY, table, &size)) {
+        uint16_t count = app_sr_get_cmd_num();
+        for (uint16_t i = 0; i < size / sizeof(uint16_t) && i < count; i++) {
+            if (table[i]) {
+                sr_reject_set_threshold(i, table[i] / 1000.0f);
+            }
+        }
     }
-    return ESP_OK == err ? ESP_OK : ESP_FAIL;
+    heap_caps_free(table);
+    nvs_close(my_handle);
+}
+
+/**
+ * @brief Replace the live commands with those of a validated pack
+ *
+ * @param ref Reference the pack strings instead of copying them, the pack must stay mapped
+ * @return Error of the first command refused, the commands before it stay loaded
+ */
+static esp_err_t app_hass_apply_pack(const void *pack, bool ref)
+{
+    esp_err_t ret = ESP_OK;
+    uint16_t i = 0;
+    app_sr_remove_all_cmd();
+    esp_mn_commands_free();
+    esp_mn_commands_alloc();
+    sr_reject_reset();
+    for (; ESP_OK == ret && i < cmd_pack_count(pack); i++) {
+        sr_cmd_t cmd_info = {0};
+        cmd_info.cmd = SR_CMD;
+        cmd_info.lang = SR_LANG_EN;
+        cmd_info.str = cmd_pack_text(pack, i);
+        cmd_info.phoneme = cmd_pack_phoneme(pack, i);
+        ret = ref ? app_sr_add_cmd_ref(&cmd_info) : app_sr_add_cmd(&cmd_info);
+    }
+    app_sr_update_cmds();
+    ESP_RETURN_ON_ERROR(ret, TAG, "Cmd %d of the pack refused", i - 1);
+    return ESP_OK;
 }
 
-esp_err_t app_hass_write_cmds_to_nvs(void)
+/**
+ * @brief Store the live command table as one command pack, replacing the previous set at once
+ *
+ * With a command pack partition the commands then point at the flashed pack and their RAM copies are freed.
+ */
+static esp_err_t app_hass_write_cmds(void)
 {
-    ESP_LOGI(TAG, "Saving cmds to NVS");
-    // settings_check(&g_sys_param);
-    keynum = 0;
+    uint16_t count = app_sr_get_cmd_num();
+    size_t size = cmd_pack_build(app_sr_get_cmd_from_id, count, NULL, 0);
+    ESP_RETURN_ON_FALSE(size, ESP_FAIL, TAG, "Failed to build cmd pack");
+    uint8_t *pack = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != pack, ESP_ERR_NO_MEM, TAG, "memory for cmd pack is not enough");
+    cmd_pack_build(app_sr_get_cmd_from_id, count, pack, size);
+
     esp_err_t err = ESP_OK;
-    while (keynum < MAX_CMDS) {
-        sr_cmd_t *cmd_info = app_sr_get_cmd_from_id(keynum);
-        if (cmd_info == NULL) {
-            break;
+    if (cmd_bank_is_ready()) {
+        err = cmd_bank_write(pack, size);
+        const void *mapped = cmd_bank_active(NULL);
+        for (uint16_t i = 0; ESP_OK == err && i < count; i++) {
+            app_sr_share_cmd(i, cmd_pack_text(mapped, i), cmd_pack_phoneme(mapped, i));
+        }
+    } else {
+        nvs_handle_t my_handle = {0};
+        err = nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle);
+        if (ESP_OK == err) {
+            err = nvs_set_blob(my_handle, CMD_PACK_KEY, pack, size);
+            err |= nvs_commit(my_handle);
+            nvs_close(my_handle);
         }
-        err = app_hass_write_cmd_to_nvs(cmd_info->str, cmd_info->phoneme);
     }
-    return ESP_OK == err ? ESP_OK : ESP_FAIL;
+    heap_caps_free(pack);
+    ESP_RETURN_ON_FALSE(ESP_OK == err, ESP_FAIL, TAG, "Failed to save cmd pack");
+    ESP_LOGI(TAG, "Saved %d cmds, %d bytes", count, size);
+    return ESP_OK;
 }
 
-esp_err_t app_hass_read_cmds_from_nvs(void)
+/**
+ * @brief Replace the live commands with the pack stored in NVS, checked before anything is touched
+ *
+ * @return ESP_ERR_NVS_NOT_FOUND if no pack was ever stored
+ */
+static esp_err_t app_hass_read_cmds_from_nvs(void)
 {
     ESP_LOGI(TAG, "Reading cmds from NVS");
+    nvs_handle_t my_handle = {0};
+    esp_err_t ret = nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle);
+    ESP_RETURN_ON_ERROR(ret, TAG, "Error (%s) opening NVS handle", esp_err_to_name(ret));
+
+    size_t size = 0;
+    uint8_t *pack = NULL;
+    ret = nvs_get_blob(my_handle, CMD_PACK_KEY, NULL, &size);
+    if (ESP_OK != ret) {
+        goto err;
+    }
+    pack = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    ESP_GOTO_ON_FALSE(NULL != pack, ESP_ERR_NO_MEM, err, TAG, "memory for cmd pack is not enough");
+    ESP_GOTO_ON_ERROR(nvs_get_blob(my_handle, CMD_PACK_KEY, pack, &size), err, TAG, "Failed to read cmd pack");
+    ESP_GOTO_ON_ERROR(cmd_pack_validate(pack, size), err, TAG, "Stored cmd pack is invalid, keeping current cmds");
+
+    ESP_GOTO_ON_ERROR(app_hass_apply_pack(pack, false), err, TAG, "Stored cmd pack was refused");
+    app_hass_read_thresholds_from_nvs();
+    ESP_LOGI(TAG, "Loaded %d cmds from NVS", cmd_pack_count(pack));
+
+    /* Move it to the command pack partition, where it costs no RAM */
+    if (cmd_bank_is_ready() && ESP_OK == app_hass_write_cmds()) {
+        nvs_erase_key(my_handle, CMD_PACK_KEY);
+        nvs_commit(my_handle);
+    }
+
+err:
+    heap_caps_free(pack);
+    nvs_close(my_handle);
+    return ret;
+}
+
+/**
+ * @brief Load the active pack of the command pack partition in place, else the one in NVS
+ */
+static esp_err_t app_hass_read_cmds(void)
+{
+    size_t size = 0;
+    const void *pack = cmd_bank_active(&size);
+    if (NULL == pack) {
+        return app_hass_read_cmds_from_nvs();
+    }
+    int64_t start = esp_timer_get_time();
+    ESP_RETURN_ON_ERROR(app_hass_apply_pack(pack, true), TAG, "Flashed cmd pack was refused");
+    app_hass_read_thresholds_from_nvs();
+    ESP_LOGI(TAG, "Mapped %d cmds, %d bytes, in %lld ms", cmd_pack_count(pack), size, (esp_timer_get_time() - start) / 1000);
+    return ESP_OK;
+}
+
+/**
+ * @brief Move cmd%d/pho%d/thr%d keys written by older firmware into a pack, once
+ */
+static esp_err_t app_hass_import_legacy_cmds(void)
+{
     nvs_handle_t my_handle = {0};
     esp_err_t err = nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle);
-    keynum = 0;
-    if (err != ESP_OK) {
-        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
-    } else {
-        while (keynum < MAX_CMDS) {
-            char cmd[SR_CMD_STR_LEN_MAX];
-            char phoneme[SR_CMD_PHONEME_LEN_MAX];
-            size_t cmd_len = sizeof(cmd);
-            size_t phoneme_len = sizeof(phoneme);
-            char cmd_key[10];
-            char phoneme_key[10];
-            sprintf(cmd_key, "cmd%d", keynum);
-            sprintf(phoneme_key, "pho%d", keynum);
-            err = nvs_get_str(my_handle, cmd_key, cmd, &cmd_len);
-            err = nvs_get_str(my_handle, phoneme_key, phoneme, &phoneme_len);
-            if (err == ESP_OK) {
-                // add cmd to sr
-                ESP_LOGI(TAG, "Read cmd %d from NVS", keynum);
-                app_hass_add_cmd(cmd, phoneme, false);
+    ESP_RETURN_ON_ERROR(err, TAG, "Error (%s) opening NVS handle", esp_err_to_name(err));
+
+    size_t len = 0;
+    err = nvs_get_str(my_handle, "cmd0", NULL, &len);
+    if (ESP_OK != err) {
+        nvs_close(my_handle);
+        return err;
+    }
+
+    ESP_LOGW(TAG, "Importing cmds stored as separate keys");
+    app_sr_remove_all_cmd();
+    esp_mn_commands_free();
+    esp_mn_commands_alloc();
+    sr_reject_reset();
+    int loaded = 0;
+    for (int i = 0; i < MAX_CMDS; i++) {
+        char cmd[SR_CMD_STR_LEN_MAX];
+        char phoneme[SR_CMD_PHONEME_LEN_MAX];
+        size_t cmd_len = sizeof(cmd);
+        size_t phoneme_len = sizeof(phoneme);
+        char key[10];
+        sprintf(key, "cmd%d", i);
+        err = nvs_get_str(my_handle, key, cmd, &cmd_len);
+        sprintf(key, "pho%d", i);
+        err |= nvs_get_str(my_handle, key, phoneme, &phoneme_len);
+        if (err == ESP_OK) {
+            app_hass_add_cmd(cmd, phoneme, false);
+            uint16_t permille = 0;
+            sprintf(key, "thr%d", i);
+            if (ESP_OK == nvs_get_u16(my_handle, key, &permille)) {
+                sr_reject_set_threshold(loaded, permille / 1000.0f);
             }
-            keynum++;
+            loaded++;
         }
     }
+    nvs_close(my_handle);
     app_sr_update_cmds();
+
+    /* Only drop the old keys once the pack holding them is committed */
+    ESP_RETURN_ON_ERROR(app_hass_write_cmds(), TAG, "Failed to import cmds");
+    if (loaded) {
+        app_hass_write_thresholds_to_nvs();
+    }
+    ESP_RETURN_ON_ERROR(nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle), TAG, "Error opening NVS handle");
+    for (int i = 0; i < MAX_CMDS; i++) {
+        char key[10];
+        sprintf(key, "cmd%d", i);
+        nvs_erase_key(my_handle, key);
+        sprintf(key, "pho%d", i);
+        nvs_erase_key(my_handle, key);
+        sprintf(key, "thr%d", i);
+        nvs_erase_key(my_handle, key);
+    }
+    nvs_commit(my_handle);
     nvs_close(my_handle);
+    ESP_LOGI(TAG, "Imported %d cmds", loaded);
     return ESP_OK;
 }
 
-esp_err_t app_hass_rm_cmds_from_nvs(void)
+static void app_hass_read_settings_from_nvs(void)
+{
+    nvs_handle_t my_handle = {0};
+    if (ESP_OK != nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle)) {
+        return;
+    }
+    uint32_t followup_ms = 0;
+    if (ESP_OK == nvs_get_u32(my_handle, FOLLOWUP_KEY, &followup_ms)) {
+        app_sr_set_followup(followup_ms);
+    }
+    nvs_close(my_handle);
+}
+
+static esp_err_t app_hass_rm_cmds_from_nvs(void)
 {
     ESP_LOGI(TAG, "Removing cmds from NVS");
     nvs_handle_t my_handle = {0};
     esp_err_t err = nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
-    } else {
-        keynum = 0;
-        while (keynum < MAX_CMDS) {
-            char cmd_key[10];
-            char phoneme_key[10];
-            sprintf(cmd_key, "cmd%d", keynum);
-            sprintf(phoneme_key, "pho%d", keynum);
-            err = nvs_erase_key(my_handle, cmd_key);
-            err = nvs_erase_key(my_handle, phoneme_key);
-            keynum++;
-        }
-        ESP_LOGI(TAG, "Removed %d cmds from NVS", keynum);
-        err |= nvs_commit(my_handle);
-        nvs_close(my_handle);
-        keynum = 0;
-    }
-    return ESP_OK;
+    ESP_RETURN_ON_ERROR(err, TAG, "Error (%s) opening NVS handle", esp_err_to_name(err));
+    nvs_erase_key(my_handle, CMD_PACK_KEY);
+    nvs_erase_key(my_handle, THRESHOLDS_KEY);
+    err = nvs_commit(my_handle);
+    nvs_close(my_handle);
+    return err;
 }
 
 void app_hass_add_cmd(char *cmd, char *phoneme, bool commit)
@@ -178,8 +615,8 @@ void app_hass_add_cmd(char *cmd, char *phoneme, bool commit)
     cmd_info.cmd = SR_CMD;
     cmd_info.lang = SR_LANG_EN;
     cmd_info.id = 0;
-    memcpy(cmd_info.str, cmd, strlen(cmd));
-    memcpy(cmd_info.phoneme, phoneme, strlen(phoneme));
+    cmd_info.str = cmd;
+    cmd_info.phoneme = phoneme;
     app_sr_add_cmd(&cmd_info);
     ESP_LOGI(TAG, "Added cmd %d to sr", cmd_info.id);
     ESP_LOGI(TAG, "\tcmd: %d", cmd_info.cmd);
@@ -204,7 +641,7 @@ void app_hass_add_cmd_from_msg(cJSON *root) {
         // Add sr command to speech recognition
         app_hass_add_cmd(sr_txt->valuestring, sr_phn->valuestring, true);
 
-        app_hass_write_cmd_to_nvs(sr_txt->valuestring, sr_phn->valuestring);
+        app_hass_write_cmds();
         ESP_LOGI(TAG, "Added command: %s; %s", sr_txt->valuestring, sr_phn->valuestring);
         return;
     }
@@ -223,8 +660,12 @@ void app_hass_rm_all_cmd(cJSON *root) {
         esp_mn_commands_alloc();
         app_sr_update_cmds();
 
-        // remove commands from nvs
+        // remove commands from nvs, and the pack partition that would bring them back on boot
         app_hass_rm_cmds_from_nvs();
+        if (cmd_bank_is_ready() && ESP_OK != cmd_bank_erase()) {
+            ESP_LOGE(TAG, "Commands stay in the pack partition");
+        }
+        sr_reject_reset();
 
         ESP_LOGI(TAG, "Removed all commands");
         return;
@@ -232,25 +673,297 @@ void app_hass_rm_all_cmd(cJSON *root) {
 }
 
 
+/* Batch upload, one per message, fed by the MQTT client as the fragments arrive */
+typedef struct {
+    cmd_parser_t parser;
+    sr_cmd_store_t *staged;
+    bool replace;
+    uint16_t base;          /**< Commands already live that the batch adds to */
+    cJSON *rejected;
+} cmd_batch_t;
+
+static cmd_batch_t *s_batch = NULL;
+
+static void app_hass_batch_free(void)
+{
+    if (s_batch) {
+        sr_cmds_delete(s_batch->staged);
+        cJSON_Delete(s_batch->rejected);
+        heap_caps_free(s_batch);
+        s_batch = NULL;
+    }
+}
+
+static void app_hass_batch_pair(const cmd_parser_pair_t *pair, void *ctx)
+{
+    cmd_batch_t *batch = ctx;
+    const char *reason = NULL;
+    if ('\0' == pair->text[0] || '\0' == pair->phonetic[0]) {
+        reason = "missing";
+    } else if (pair->text_long || pair->phonetic_long) {
+        reason = "too_long";
+    } else if (sr_cmds_find_phoneme(batch->staged, pair->phonetic, NULL, 1) ||
+               (!batch->replace && app_sr_is_phoneme_exists(pair->phonetic))) {
+        reason = "duplicate";
+    } else if (batch->base + sr_cmds_count(batch->staged) >= MAX_CMDS) {
+        reason = "full";
+    }
+
+    if (NULL == reason) {
+        sr_cmd_t cmd_info = {0};
+        cmd_info.cmd = SR_CMD;
+        cmd_info.lang = SR_LANG_EN;
+        cmd_info.str = pair->text;
+        cmd_info.phoneme = pair->phonetic;
+        sr_cmds_append(batch->staged, &cmd_info);
+        return;
+    }
+
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "text", pair->text);
+    cJSON_AddStringToObject(item, "reason", reason);
+    cJSON_AddItemToArray(batch->rejected, item);
+}
+
+esp_err_t app_hass_cmds_begin(bool replace)
+{
+    if (s_batch) {
+        ESP_LOGW(TAG, "Previous cmd batch was cut short, dropped");
+        app_hass_batch_free();
+    }
+
+    s_batch = heap_caps_calloc(1, sizeof(cmd_batch_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != s_batch, ESP_ERR_NO_MEM, TAG, "memory for cmd batch is not enough");
+    s_batch->staged = sr_cmds_create(MAX_CMDS);
+    s_batch->rejected = cJSON_CreateArray();
+    if (NULL == s_batch->staged || NULL == s_batch->rejected) {
+        app_hass_batch_free();
+        ESP_LOGE(TAG, "memory for cmd batch is not enough");
+        return ESP_ERR_NO_MEM;
+    }
+    s_batch->replace = replace;
+    s_batch->base = replace ? 0 : app_sr_get_cmd_num();
+    cmd_parser_init(&s_batch->parser, app_hass_batch_pair, s_batch);
+    return ESP_OK;
+}
+
+void app_hass_cmds_feed(const char *data, size_t len)
+{
+    if (s_batch) {
+        cmd_parser_feed(&s_batch->parser, data, len);
+    }
+}
+
+void app_hass_cmds_end(void)
+{
+    if (NULL == s_batch) {
+        return;
+    }
+    cmd_batch_t *batch = s_batch;
+    if (0 != strcmp(batch->parser.site_id, MQTT_SITE_ID)) {
+        ESP_LOGI(TAG, "siteId does not match.");
+        app_hass_batch_free();
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    uint16_t accepted = sr_cmds_count(batch->staged);
+    bool ok = cmd_parser_done(&batch->parser);
+    if (!ok) {
+        ESP_LOGE(TAG, "Error parsing cmd batch, nothing applied");
+        accepted = 0;
+    } else {
+        if (batch->replace) {
+            app_sr_remove_all_cmd();
+            esp_mn_commands_free();
+            esp_mn_commands_alloc();
+            sr_reject_reset();
+        }
+        for (uint16_t i = 0; i < accepted; i++) {
+            app_sr_add_cmd(sr_cmds_get(batch->staged, i));
+        }
+        app_sr_update_cmds();
+        app_hass_write_cmds();
+        if (batch->replace) {
+            app_hass_write_thresholds_to_nvs();
+        }
+        ESP_LOGI(TAG, "%s %d cmds, rejected %d, in %lld ms", batch->replace ? "Set" : "Added", accepted,
+                 cJSON_GetArraySize(batch->rejected), (esp_timer_get_time() - start) / 1000);
+    }
+
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "siteId", MQTT_SITE_ID);
+    cJSON_AddBoolToObject(result, "ok", ok);
+    cJSON_AddNumberToObject(result, "accepted", accepted);
+    cJSON_AddNumberToObject(result, "total", app_sr_get_cmd_num());
+    cJSON_AddItemToObject(result, "rejected", batch->rejected);
+    batch->rejected = NULL;
+    char *payload = cJSON_PrintUnformatted(result);
+    if (payload) {
+        app_api_mqtt_publish("esp-ha-speech/cmds_result/" MQTT_SITE_ID, payload, strlen(payload));
+        cJSON_free(payload);
+    }
+    cJSON_Delete(result);
+    app_hass_batch_free();
+}
+
+/* Prebuilt pack upload, the whole pack is small enough to collect before checking it */
+static uint8_t *s_pack = NULL;
+static size_t s_pack_len = 0;
+
+esp_err_t app_hass_pack_begin(size_t len)
+{
+    heap_caps_free(s_pack);
+    s_pack = NULL;
+    ESP_RETURN_ON_FALSE(len >= sizeof(cmd_pack_header_t) && len <= CMD_PACK_UPLOAD_MAX, ESP_ERR_INVALID_SIZE, TAG,
+                        "Pack of %d bytes refused", len);
+    s_pack = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != s_pack, ESP_ERR_NO_MEM, TAG, "memory for cmd pack is not enough");
+    s_pack_len = len;
+    return ESP_OK;
+}
+
+void app_hass_pack_feed(const char *data, size_t len, size_t offset)
+{
+    if (s_pack && offset + len <= s_pack_len) {
+        memcpy(s_pack + offset, data, len);
+    }
+}
+
+/* Everything the recognizer would refuse or truncate is refused before the pack is loaded */
+static esp_err_t app_hass_check_pack(const void *pack, size_t len)
+{
+    ESP_RETURN_ON_ERROR(cmd_pack_validate(pack, len), TAG, "Invalid cmd pack");
+    uint16_t count = cmd_pack_count(pack);
+    ESP_RETURN_ON_FALSE(count <= MAX_CMDS, ESP_ERR_INVALID_SIZE, TAG, "Pack holds %d cmds, only %d allowed", count, MAX_CMDS);
+    for (uint16_t i = 0; i < count; i++) {
+        size_t str_len = strlen(cmd_pack_text(pack, i));
+        size_t pho_len = strlen(cmd_pack_phoneme(pack, i));
+        ESP_RETURN_ON_FALSE(str_len > 0 && str_len < SR_CMD_STR_LEN_MAX, ESP_ERR_INVALID_SIZE, TAG,
+                            "Text of cmd %d is %d chars, 1 - %d allowed", i, str_len, SR_CMD_STR_LEN_MAX - 1);
+        ESP_RETURN_ON_FALSE(pho_len > 0 && pho_len < SR_CMD_PHONEME_LEN_MAX, ESP_ERR_INVALID_SIZE, TAG,
+                            "Phoneme of cmd %d is %d chars, 1 - %d allowed", i, pho_len, SR_CMD_PHONEME_LEN_MAX - 1);
+    }
+    return ESP_OK;
+}
+
+void app_hass_pack_end(void)
+{
+    if (NULL == s_pack) {
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = app_hass_check_pack(s_pack, s_pack_len);
+    if (ESP_OK == ret) {
+        /**
+         * Load it before anything is stored, so a pack the recognizer refuses never
+         * reaches flash. Storing then moves the commands onto the flashed copy.
+         */
+        ret = app_hass_apply_pack(s_pack, false);
+        if (ESP_OK == ret) {
+            ret = app_hass_write_cmds();
+        }
+        if (ESP_OK != ret && ESP_OK != app_hass_read_cmds()) {
+            ESP_LOGE(TAG, "Previous cmds could not be restored");
+        }
+    }
+    if (ESP_OK == ret) {
+        /* Thresholds tuned for the old ids mean nothing for the new set */
+        app_hass_write_thresholds_to_nvs();
+        ESP_LOGI(TAG, "Set %d cmds from pack in %lld ms", app_sr_get_cmd_num(), (esp_timer_get_time() - start) / 1000);
+    }
+
+    char payload[160];
+    json_writer_t w;
+    json_writer_init(&w, payload, sizeof(payload));
+    json_writer_object_begin(&w, NULL);
+    json_writer_string(&w, "siteId", MQTT_SITE_ID);
+    json_writer_bool(&w, "ok", ESP_OK == ret);
+    if (ESP_OK != ret) {
+        json_writer_string(&w, "error", esp_err_to_name(ret));
+    }
+    json_writer_int(&w, "total", app_sr_get_cmd_num());
+    json_writer_object_end(&w);
+    int len = json_writer_finish(&w);
+    app_api_mqtt_publish("esp-ha-speech/cmds_result/" MQTT_SITE_ID, payload, len);
+
+    heap_caps_free(s_pack);
+    s_pack = NULL;
+}
+
+void app_hass_set_threshold_from_msg(cJSON *root)
+{
+    cJSON *thr = cJSON_GetObjectItemCaseSensitive(root, "threshold");
+    cJSON *id = cJSON_GetObjectItemCaseSensitive(root, "command_id");
+    if (!cJSON_IsNumber(thr) || thr->valuedouble < 0 || thr->valuedouble >= 1.0) {
+        ESP_LOGE(TAG, "Error parsing threshold");
+        return;
+    }
+
+    if (cJSON_IsNumber(id)) {
+        if (ESP_OK == sr_reject_set_threshold(id->valueint, thr->valuedouble)) {
+            app_hass_write_thresholds_to_nvs();
+        }
+    } else {
+        sr_reject_set_global(thr->valuedouble);
+        app_hass_write_global_threshold_to_nvs(thr->valuedouble);
+    }
+    ESP_LOGI(TAG, "Threshold of cmd %d set to %.3f", cJSON_IsNumber(id) ? id->valueint : -1, thr->valuedouble);
+}
+
+void app_hass_set_followup_from_msg(cJSON *root)
+{
+    cJSON *window = cJSON_GetObjectItemCaseSensitive(root, "window_ms");
+    if (!cJSON_IsNumber(window) || window->valueint < 0) {
+        ESP_LOGE(TAG, "Error parsing window_ms");
+        return;
+    }
+    app_sr_set_followup(window->valueint);
+
+    nvs_handle_t my_handle = {0};
+    esp_err_t err = nvs_open(NAME_SPACE, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+        return;
+    }
+    err = nvs_set_u32(my_handle, FOLLOWUP_KEY, window->valueint);
+    err |= nvs_commit(my_handle);
+    nvs_close(my_handle);
+}
+
+void app_hass_feedback_from_msg(cJSON *root)
+{
+    cJSON *id = cJSON_GetObjectItemCaseSensitive(root, "command_id");
+    cJSON *correct = cJSON_GetObjectItemCaseSensitive(root, "correct");
+    if (!cJSON_IsNumber(id) || !cJSON_IsBool(correct)) {
+        ESP_LOGE(TAG, "Error parsing feedback");
+        return;
+    }
+    sr_reject_feedback(id->valueint, cJSON_IsTrue(correct));
+}
+
 void app_hass_init(void) 
 {
-    // Load default speech commands or load them
-    nvs_handle_t nvs_handle = {0};
-    size_t required_size = 100;
-    esp_err_t ret = nvs_open(NAME_SPACE, NVS_READWRITE, &nvs_handle);
-    ret = nvs_get_str(nvs_handle, "cmd0", NULL, &required_size);
-    ESP_LOGW(TAG, "NVS ret = %d", ret);
-    nvs_close(nvs_handle);
+    sr_reject_set_persist_cb(app_hass_write_thresholds_to_nvs);
+
+    // Load stored speech commands, or keep the defaults
+    app_hass_read_settings_from_nvs();
+    if (ESP_ERR_NOT_FOUND == cmd_bank_init()) {
+        ESP_LOGW(TAG, "No command pack partition, cmds are kept in NVS");
+    }
+    esp_err_t ret = app_hass_read_cmds();
     if (ESP_ERR_NVS_NOT_FOUND == ret) {
-        ESP_LOGW(TAG, "Cmd NVS not found, creating new one");
-        // app_hass_write_cmds_to_nvs();
-    } else if (ESP_OK == ret) {
-        app_sr_remove_all_cmd();
-        esp_mn_commands_free();
-        esp_mn_commands_alloc();
-        app_hass_read_cmds_from_nvs();
-    } else {
-        ESP_LOGE(TAG, "Error opening NVS (%s)", esp_err_to_name(ret));
+        ret = app_hass_import_legacy_cmds();
+    }
+    if (ESP_ERR_NVS_NOT_FOUND == ret) {
+        ESP_LOGW(TAG, "Cmd NVS not found, using default cmds");
+    } else if (ESP_OK != ret) {
+        ESP_LOGE(TAG, "Error loading cmds (%s)", esp_err_to_name(ret));
+    }
+
+    if (ESP_OK != app_hass_dispatch_start()) {
+        ESP_LOGE(TAG, "Commands can't be dispatched");
     }
 
 #if NLU_MODE == NLU_RHASSPY
@@ -261,12 +974,27 @@ void app_hass_init(void)
 #elif NLU_MODE == NLU_HASS
 
     ESP_LOGI(TAG, "Starting up");
-    xTaskCreate(&app_api_rest_test, "rest_test_task", 8192, NULL, 5, NULL);
+    app_api_rest_start();
+    xTaskCreate(&app_api_rest_test, "rest_test_task", 4096, NULL, 5, NULL);
+
+#elif NLU_MODE == NLU_WEBSOCKET
+
+    ESP_LOGI(TAG, "Starting up");
+    app_api_ws_set_event_cb(app_hass_state_changed, NULL);
+    ESP_ERROR_CHECK(app_api_ws_start());
 
 #endif
 }
 
 bool app_hass_is_connected(void)
 {
+#if NLU_MODE == NLU_WEBSOCKET
+    return app_api_ws_is_connected();
+#elif NLU_MODE == NLU_HASS
+    /* Follows every request, not only the probe at startup */
+    app_api_rest_health_t health;
+    return ESP_OK == app_api_rest_get_health(&health) && health.connected;
+#else
     return hass_connected;
+#endif
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <esp_err.h>
 #include "cJSON.h"
+#include "app_sr.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,12 +10,86 @@ extern "C" {
 void app_hass_init();
 bool app_hass_is_connected(void);
 
-void app_hass_send_cmd(char *cmd);
+#define APP_HASS_DISPATCH_DEADLINE_MS (5000)
+
+typedef enum {
+    APP_HASS_DISPATCH_OK,
+    APP_HASS_DISPATCH_FAILED,       /**< Sent, but the NLU side didn't take it */
+    APP_HASS_DISPATCH_EXPIRED,      /**< Still queued when its deadline passed */
+    APP_HASS_DISPATCH_DROPPED,      /**< Pushed out of a full queue by a newer command */
+} app_hass_dispatch_status_t;
+
+/**
+ * @brief Outcome of app_hass_dispatch(), called from the dispatch task
+ */
+typedef void (*app_hass_dispatch_cb_t)(int command_id, app_hass_dispatch_status_t status, void *ctx);
+
+esp_err_t app_hass_send_cmd(char *cmd);
+
+/**
+ * @brief Dispatch the best hypothesis of a result, and publish the whole N-best list where the NLU side can use it
+ *
+ * @note Blocks on the network, see app_hass_dispatch(). The command texts are
+ *       copied first, so the table may change while it blocks.
+ */
+esp_err_t app_hass_send_result(const sr_result_t *result);
+
+/**
+ * @brief Queue a result for app_hass_send_result() on the dispatch task and return at once
+ *
+ * A result still queued `deadline_ms` from now is not sent anymore, a stale
+ * "turn on the light" is worse than none. When the queue is full the oldest
+ * result is dropped for this one. `cb`, if any, gets the outcome of each.
+ * The command texts are copied here, on the caller's task.
+ *
+ * @return ESP_ERR_INVALID_STATE before app_hass_init()
+ */
+esp_err_t app_hass_dispatch(const sr_result_t *result, uint32_t deadline_ms, app_hass_dispatch_cb_t cb, void *ctx);
 
 void app_hass_add_cmd(char *cmd, char *phoneme, bool commit);
 void app_hass_add_cmd_from_msg(cJSON *root);
 void app_hass_rm_all_cmd(cJSON *root);
 
+/**
+ * @brief Start a batch upload of {"siteId": ..., "commands": [{"text": ..., "phonetic": ...}, ...]}
+ *
+ * The payload is scanned as it is fed, nothing is applied until app_hass_cmds_end(),
+ * which adds the accepted commands with one grammar rebuild and one NVS commit and
+ * publishes the outcome to esp-ha-speech/cmds_result/<siteId>.
+ *
+ * @param replace Drop the current commands first (set_cmds) instead of adding to them (add_cmds)
+ */
+esp_err_t app_hass_cmds_begin(bool replace);
+void app_hass_cmds_feed(const char *data, size_t len);
+void app_hass_cmds_end(void);
+
+/**
+ * @brief Replace the command set with a prebuilt command pack of `len` bytes
+ *
+ * The fragments are collected, and app_hass_pack_end() validates the pack,
+ * loads and stores it and answers on esp-ha-speech/cmds_result/<siteId>. A pack
+ * with a string over its SR_CMD_*_LEN_MAX or a command the recognizer refuses
+ * leaves the stored set in place and is answered with "ok": false and "error".
+ */
+esp_err_t app_hass_pack_begin(size_t len);
+void app_hass_pack_feed(const char *data, size_t len, size_t offset);
+void app_hass_pack_end(void);
+
+/**
+ * @brief Set the global threshold, or the one of `command_id` when present, and persist it
+ */
+void app_hass_set_threshold_from_msg(cJSON *root);
+
+/**
+ * @brief Set and persist the follow-up window from {"window_ms": n}
+ */
+void app_hass_set_followup_from_msg(cJSON *root);
+
+/**
+ * @brief Tell the rejection engine whether the last dispatch of `command_id` was right
+ */
+void app_hass_feedback_from_msg(cJSON *root);
+
 #ifdef __cplusplus
 }
 #endif
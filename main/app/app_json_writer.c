@@ -0,0 +1,145 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include "app_json_writer.h"
+
+/* One byte stays free for the terminator */
+static void put(json_writer_t *w, const char *s, size_t n)
+{
+    if (w->overflow || w->len + n >= w->size) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+static void put_escaped(json_writer_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    put(w, "\"", 1);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        switch (c) {
+        case '"':  put(w, "\\\"", 2); break;
+        case '\\': put(w, "\\\\", 2); break;
+        case '\b': put(w, "\\b", 2); break;
+        case '\f': put(w, "\\f", 2); break;
+        case '\n': put(w, "\\n", 2); break;
+        case '\r': put(w, "\\r", 2); break;
+        case '\t': put(w, "\\t", 2); break;
+        default:
+            if (c < 0x20) {
+                char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                put(w, u, sizeof(u));
+            } else {
+                /* UTF-8 passes through as is */
+                put(w, (const char *) &c, 1);
+            }
+            break;
+        }
+    }
+    put(w, "\"", 1);
+}
+
+/* Separator and member name in front of a value */
+static void put_key(json_writer_t *w, const char *key)
+{
+    if (w->comma) {
+        put(w, ",", 1);
+    }
+    if (key) {
+        put_escaped(w, key);
+        put(w, ":", 1);
+    }
+    w->comma = true;
+}
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size)
+{
+    *w = (json_writer_t) {
+        .buf = buf,
+        .size = size,
+        .overflow = NULL == buf || 0 == size,
+    };
+}
+
+void json_writer_object_begin(json_writer_t *w, const char *key)
+{
+    put_key(w, key);
+    put(w, "{", 1);
+    w->comma = false;
+}
+
+void json_writer_object_end(json_writer_t *w)
+{
+    put(w, "}", 1);
+    w->comma = true;
+}
+
+void json_writer_array_begin(json_writer_t *w, const char *key)
+{
+    put_key(w, key);
+    put(w, "[", 1);
+    w->comma = false;
+}
+
+void json_writer_array_end(json_writer_t *w)
+{
+    put(w, "]", 1);
+    w->comma = true;
+}
+
+void json_writer_string(json_writer_t *w, const char *key, const char *val)
+{
+    put_key(w, key);
+    if (val) {
+        put_escaped(w, val);
+    } else {
+        put(w, "null", 4);
+    }
+}
+
+void json_writer_int(json_writer_t *w, const char *key, int64_t val)
+{
+    char num[24];
+    put_key(w, key);
+    put(w, num, snprintf(num, sizeof(num), "%" PRId64, val));
+}
+
+void json_writer_float(json_writer_t *w, const char *key, float val)
+{
+    char num[48];   /* Fits FLT_MAX with 3 decimals */
+    put_key(w, key);
+    if (!isfinite(val)) {
+        /* JSON has no NaN or infinity */
+        put(w, "null", 4);
+        return;
+    }
+    put(w, num, snprintf(num, sizeof(num), "%.3f", val));
+}
+
+void json_writer_bool(json_writer_t *w, const char *key, bool val)
+{
+    put_key(w, key);
+    put(w, val ? "true" : "false", val ? 4 : 5);
+}
+
+int json_writer_finish(json_writer_t *w)
+{
+    if (w->overflow) {
+        if (w->size) {
+            w->buf[0] = '\0';
+        }
+        return -1;
+    }
+    w->buf[w->len] = '\0';
+    return w->len;
+}
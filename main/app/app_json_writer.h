@@ -0,0 +1,61 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief JSON writer over a caller provided buffer, never allocates
+ *
+ * Strings are escaped as they are copied. Writes past the end of the buffer
+ * are dropped and remembered, so a sequence of calls is checked once with
+ * json_writer_finish(). `key` is the member name inside an object and NULL
+ * inside an array or for the outermost value.
+ *
+ *   json_writer_t w;
+ *   json_writer_init(&w, buf, sizeof(buf));
+ *   json_writer_object_begin(&w, NULL);
+ *   json_writer_string(&w, "text", cmd);
+ *   json_writer_object_end(&w);
+ *   int len = json_writer_finish(&w);
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    bool comma;         /**< The next value needs a separator */
+    bool overflow;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size);
+
+void json_writer_object_begin(json_writer_t *w, const char *key);
+void json_writer_object_end(json_writer_t *w);
+void json_writer_array_begin(json_writer_t *w, const char *key);
+void json_writer_array_end(json_writer_t *w);
+
+void json_writer_string(json_writer_t *w, const char *key, const char *val);
+void json_writer_int(json_writer_t *w, const char *key, int64_t val);
+void json_writer_float(json_writer_t *w, const char *key, float val);
+void json_writer_bool(json_writer_t *w, const char *key, bool val);
+
+/**
+ * @brief NUL terminate the output
+ *
+ * @return Length of the JSON text, -1 if it didn't fit the buffer
+ */
+int json_writer_finish(json_writer_t *w);
+
+#ifdef __cplusplus
+}
+#endif
@@ -14,6 +14,7 @@
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
 #include "esp_task_wdt.h"
+#include "esp_timer.h"
 #include "esp_check.h"
 #include "esp_err.h"
 #include "esp_log.h"
@@ -28,6 +29,13 @@
 #include "esp_afe_sr_iface.h"
 #include "esp_mn_iface.h"
 #include "app_sr_handler.h"
+#include "audio_ring.h"
+#include "app_sr_record.h"
+#include "app_sr_replay.h"
+#include "app_sr_trace.h"
+#include "app_sr_reject.h"
+#include "app_sr_ref.h"
+#include "app_sr_cmds.h"
 #include "model_path.h"
 #include "bsp_board.h"
 #include "settings.h"
@@ -41,36 +49,64 @@ typedef struct {
     const esp_afe_sr_iface_t *afe_handle;
     esp_afe_sr_data_t *afe_data;
     int16_t *afe_in_buffer;
+    int16_t *ref_buffer;
     int16_t *afe_out_buffer;
-    SLIST_HEAD(sr_cmd_list_t, sr_cmd_t) cmd_list;
-    uint8_t cmd_num;
+    audio_ring_t *preroll;
+    uint32_t wake_seq;
+    sr_cmd_store_t *cmds;
     TaskHandle_t feed_task;
     TaskHandle_t detect_task;
     TaskHandle_t handle_task;
     QueueHandle_t result_que;
     EventGroupHandle_t event_group;
+    volatile bool stop_req;
 
-    FILE *fp;
+    sr_record_t *raw_rec;
     bool b_record_en;
+    int64_t wake_time_ms;
+    uint32_t wake_segment;
+    uint32_t wake_offset;
+
+    sr_stats_t stats;
+    int feed_chunksize;
+    int fetch_chunksize;
+    esp_timer_handle_t stats_timer;
 } sr_data_t;
 
 static esp_afe_sr_iface_t *afe_handle = NULL;
 static srmodel_list_t *models = NULL;
 
 static sr_data_t *g_sr_data = NULL;
+static uint32_t g_followup_ms = SR_FOLLOWUP_MS_DEFAULT;
+static bsp_codec_config_t *g_sr_codec = NULL;
 
-#define I2S_CHANNEL_NUM     (2)
-#define NEED_DELETE BIT0
+static bsp_codec_config_t *sr_get_codec(void)
+{
+    return g_sr_codec ? g_sr_codec : bsp_board_get_codec_handle();
+}
+
+#define AFE_FEED_CHANNEL_NUM (3)
+#define AFE_FEED_SLOT_NUM   (2)
+#define AFE_FEED_LEAD_NUM   (AFE_FEED_CHANNEL_NUM - 1)
 #define FEED_DELETED BIT1
 #define DETECT_DELETED BIT2
+#define HANDLER_DELETED BIT3
+
+/**
+ * @brief Sleep for about one chunk after an I/O failure, or until app_sr_stop() wakes the task
+ */
+static void sr_task_backoff(int chunksize)
+{
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(chunksize * 1000 / SR_SAMPLE_RATE) + 1);
+}
 
 /**
  * @brief all default commands
  */
 static const sr_cmd_t g_default_cmd_info[] = {
     // English
-    {SR_CMD,  SR_LANG_EN, 0, "Turn On the Light",  "TkN nN jc LiT", {NULL}},
-    {SR_CMD, SR_LANG_EN, 0, "Turn Off the Light", "TkN eF jc LiT", {NULL}},
+    {SR_CMD, SR_LANG_EN, 0, "Turn On the Light",  "TkN nN jc LiT"},
+    {SR_CMD, SR_LANG_EN, 0, "Turn Off the Light", "TkN eF jc LiT"},
 };
 
 static void audio_feed_task(void *arg)
@@ -78,46 +114,105 @@ static void audio_feed_task(void *arg)
     size_t bytes_read = 0;
     esp_afe_sr_data_t *afe_data = (esp_afe_sr_data_t *) arg;
     int audio_chunksize = afe_handle->get_feed_chunksize(afe_data);
-    int feed_channel = 3;
-    ESP_LOGI(TAG, "audio_chunksize=%d, feed_channel=%d", audio_chunksize, feed_channel);
-
-    /* Allocate audio buffer and check for result */
-    int16_t *audio_buffer = heap_caps_malloc(audio_chunksize * sizeof(int16_t) * feed_channel, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
-    if (NULL == audio_buffer) {
-        esp_system_abort("No mem for audio buffer");
-    }
-    g_sr_data->afe_in_buffer = audio_buffer;
-
+    bsp_codec_config_t *codec_handle = sr_get_codec();
+    int rx_channel = codec_handle->i2s_rx_chan_num;
+    size_t slot_len = AFE_FEED_LEAD_NUM + audio_chunksize * AFE_FEED_CHANNEL_NUM;
+    int16_t *audio_buffer = g_sr_data->afe_in_buffer;
+    int16_t mic_tail[AFE_FEED_LEAD_NUM] = { 0 };
+    ESP_LOGI(TAG, "audio_chunksize=%d, rx_channel=%d, feed_channel=%d", audio_chunksize, rx_channel, AFE_FEED_CHANNEL_NUM);
+
+    size_t slot = 0;
     while (true) {
-        if (NEED_DELETE && xEventGroupGetBits(g_sr_data->event_group)) {
-            xEventGroupSetBits(g_sr_data->event_group, FEED_DELETED);
-            vTaskDelete(NULL);
+        int16_t *head = audio_buffer + slot * slot_len;
+        int16_t *frame = head + AFE_FEED_LEAD_NUM;
+        slot = (slot + 1) % AFE_FEED_SLOT_NUM;
+        size_t read_len = audio_chunksize * rx_channel * sizeof(int16_t);
+
+        if (g_sr_data->stop_req) {
+            /**
+             * The detect task blocks in fetch, so keep the AFE supplied with silence
+             * until it has left its loop, whatever state the audio source is in.
+             */
+            if (xEventGroupGetBits(g_sr_data->event_group) & DETECT_DELETED) {
+                break;
+            }
+            memset(frame, 0, audio_chunksize * AFE_FEED_CHANNEL_NUM * sizeof(int16_t));
+            afe_handle->feed(afe_data, frame);
+            sr_task_backoff(audio_chunksize);
+            continue;
         }
 
-        /* Read audio data from I2S bus */
-        bsp_codec_config_t *codec_handle = bsp_board_get_codec_handle();
-        codec_handle->i2s_read_fn((char *)audio_buffer, audio_chunksize * I2S_CHANNEL_NUM * sizeof(int16_t), &bytes_read, portMAX_DELAY);
+        /* Read audio data from I2S bus straight into the slot */
+        esp_err_t read_ret = codec_handle->i2s_read_fn((char *)frame, read_len, &bytes_read, portMAX_DELAY);
+        int64_t loop_start = esp_timer_get_time();
+        sr_trace_mark(SR_TRACE_I2S_READ);
+        if (ESP_OK != read_ret || bytes_read < read_len) {
+            g_sr_data->stats.i2s_short_reads++;
+            if (0 == bytes_read) {
+                sr_task_backoff(audio_chunksize);
+                continue;
+            }
+            memset((uint8_t *)frame + bytes_read, 0, read_len - bytes_read);
+        }
 
-        /* Save audio data to file if record enabled */
-        if (g_sr_data->b_record_en && (NULL != g_sr_data->fp)) {
-            fwrite(audio_buffer, 1, audio_chunksize * I2S_CHANNEL_NUM * sizeof(int16_t), g_sr_data->fp);
+        /* Hand audio data to the SD card writer if record enabled */
+        if (g_sr_data->b_record_en) {
+            sr_record_write(g_sr_data->raw_rec, frame, audio_chunksize * rx_channel * sizeof(int16_t));
         }
 
-        /* Channel Adjust */
-        for (int  i = audio_chunksize - 1; i >= 0; i--) {
-            audio_buffer[i * 3 + 2] = 0;
-            audio_buffer[i * 3 + 1] = audio_buffer[i * 2 + 1];
-            audio_buffer[i * 3 + 0] = audio_buffer[i * 2 + 0];
+        /**
+         * Channel Adjust, the AFE wants mic, mic, reference.
+         * A reference-first capture (R M M R M M ...) is fed from two samples before the
+         * chunk, with the previous chunk's last mic pair in front: every AFE frame then
+         * reads M M of frame n-1 and R of frame n, so the samples never move. The
+         * reference leads the mics by one sample (62.5 us), far below the echo delay.
+         */
+        int16_t *feed = frame;
+        if (codec_handle->i2s_rx_ref_first) {
+            memcpy(head, mic_tail, sizeof(mic_tail));
+            memcpy(mic_tail, frame + audio_chunksize * AFE_FEED_CHANNEL_NUM - AFE_FEED_LEAD_NUM, sizeof(mic_tail));
+            feed = head;
+        } else if (rx_channel < AFE_FEED_CHANNEL_NUM) {
+            int16_t *ref = g_sr_data->ref_buffer;
+            if (ref) {
+                sr_ref_read(ref, audio_chunksize);
+            }
+            for (int i = audio_chunksize - 1; i >= 0; i--) {
+                frame[i * 3 + 2] = ref ? ref[i] : 0;
+                frame[i * 3 + 1] = frame[i * 2 + 1];
+                frame[i * 3 + 0] = frame[i * 2 + 0];
+            }
         }
 
         /* Feed samples of an audio stream to the AFE_SR */
-        afe_handle->feed(afe_data, audio_buffer);
+        afe_handle->feed(afe_data, feed);
+        sr_trace_mark(SR_TRACE_AFE_FEED);
+        g_sr_data->stats.feed_chunks++;
+
+        uint32_t loop_us = esp_timer_get_time() - loop_start;
+        if (loop_us > g_sr_data->stats.feed_loop_max_us) {
+            g_sr_data->stats.feed_loop_max_us = loop_us;
+        }
+    }
+
+    xEventGroupSetBits(g_sr_data->event_group, FEED_DELETED);
+    vTaskDelete(NULL);
+}
+
+static void sr_send_result(const sr_result_t *result)
+{
+    if (pdTRUE != xQueueSend(g_sr_data->result_que, result, 0)) {
+        g_sr_data->stats.results_dropped++;
+        ESP_LOGW(TAG, "Result queue full, result dropped");
     }
 }
 
 static void audio_detect_task(void *arg)
 {
     bool detect_flag = false;
+    bool speech = false;
+    int64_t followup_end = 0;
+    int64_t loop_start = 0;
     esp_afe_sr_data_t *afe_data = arg;
     int afe_chunksize = afe_handle->get_fetch_chunksize(afe_data);
     //int nch = afe_handle->get_channel_num(afe_data);
@@ -126,97 +221,211 @@ static void audio_detect_task(void *arg)
     assert(mu_chunksize == afe_chunksize);
     ESP_LOGI(TAG, "------------detect start------------\n");
 
-    while (true) {
-        if (NEED_DELETE && xEventGroupGetBits(g_sr_data->event_group)) {
-            xEventGroupSetBits(g_sr_data->event_group, DETECT_DELETED);
-            vTaskDelete(g_sr_data->handle_task);
-            vTaskDelete(NULL);
+    while (!g_sr_data->stop_req) {
+        if (loop_start) {
+            uint32_t loop_us = esp_timer_get_time() - loop_start;
+            if (loop_us > g_sr_data->stats.detect_loop_max_us) {
+                g_sr_data->stats.detect_loop_max_us = loop_us;
+            }
         }
 
         afe_fetch_result_t* res = afe_handle->fetch(afe_data);
+        loop_start = esp_timer_get_time();
         if (!res || res->ret_value == ESP_FAIL) {
+            g_sr_data->stats.fetch_failures++;
+            sr_task_backoff(afe_chunksize);
+            loop_start = 0;
             continue;
         }
+        sr_trace_mark(SR_TRACE_AFE_FETCH);
+        g_sr_data->stats.fetch_chunks++;
+
+        /* Keep the post-AFE audio around, whether a wake word was heard or not */
+        audio_ring_push(g_sr_data->preroll, res->data);
 
         if (res->wakeup_state == WAKENET_DETECTED) {
+            sr_trace_mark(SR_TRACE_WAKE_DETECTED);
             ESP_LOGI(TAG, LOG_BOLD(LOG_COLOR_GREEN) "wakeword detected");
+            g_sr_data->wake_seq = audio_ring_head(g_sr_data->preroll) - 1;
+            if (g_sr_data->b_record_en) {
+                struct timeval tv;
+                gettimeofday(&tv, NULL);
+                g_sr_data->wake_time_ms = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+                sr_record_tell(g_sr_data->raw_rec, &g_sr_data->wake_segment, &g_sr_data->wake_offset);
+            }
             sr_result_t result = {
                 .wakenet_mode = WAKENET_DETECTED,
                 .state = ESP_MN_STATE_DETECTING,
                 .command_id = 0,
             };
-            xQueueSend(g_sr_data->result_que, &result, 0);
+            sr_send_result(&result);
         }
         else if (res->wakeup_state == WAKENET_CHANNEL_VERIFIED) {
+            sr_trace_mark(SR_TRACE_CHANNEL_VERIFIED);
             detect_flag = true;
             g_sr_data->afe_handle->disable_wakenet(afe_data);
             ESP_LOGI(TAG, LOG_BOLD(LOG_COLOR_GREEN) "AFE_FETCH_CHANNEL_VERIFIED, channel index: %d\n", res->trigger_channel_id);
         }
 
+        if (true == detect_flag && followup_end && loop_start >= followup_end) {
+            ESP_LOGI(TAG, "Follow-up window closed");
+            sr_result_t result = {
+                .wakenet_mode = WAKENET_NO_DETECT,
+                .state = ESP_MN_STATE_TIMEOUT,
+                .command_id = 0,
+            };
+            sr_send_result(&result);
+            g_sr_data->afe_handle->enable_wakenet(afe_data);
+            detect_flag = false;
+            followup_end = 0;
+        }
+
+        bool speech_onset = AFE_VAD_SPEECH == res->vad_state && !speech;
+        speech = AFE_VAD_SPEECH == res->vad_state;
+
         if (true == detect_flag) {
-            /* Save audio data to file if record enabled */
-            if (g_sr_data->b_record_en && (NULL != g_sr_data->fp)) {
-                fwrite(res->data, 1, afe_chunksize * sizeof(int16_t), g_sr_data->fp);
+#if SR_BARGE_IN && SR_AEC_ENABLE
+            /* The user starts talking over a prompt or music, stop it so the command isn't masked */
+            if (speech_onset && sr_barge_in()) {
+                g_sr_data->stats.barge_ins++;
             }
-
-            esp_mn_state_t mn_state = ESP_MN_STATE_DETECTING;
-            if (false == sr_echo_is_playing()) {
-                mn_state = g_sr_data->multinet->detect(g_sr_data->model_data, res->data);
-            } else {
+#endif
+#if SR_AEC_ENABLE
+            esp_mn_state_t mn_state = g_sr_data->multinet->detect(g_sr_data->model_data, res->data);
+#else
+            /* Without AEC our own prompts would be recognized */
+            if (sr_echo_is_playing()) {
                 continue;
             }
+            esp_mn_state_t mn_state = g_sr_data->multinet->detect(g_sr_data->model_data, res->data);
+#endif
 
             if (ESP_MN_STATE_DETECTING == mn_state) {
                 continue;
             }
 
             if (ESP_MN_STATE_TIMEOUT == mn_state) {
+                if (followup_end) {
+                    /* The follow-up window, not MultiNet, decides when the session ends */
+                    continue;
+                }
                 ESP_LOGW(TAG, "Time out");
                 sr_result_t result = {
                     .wakenet_mode = WAKENET_NO_DETECT,
                     .state = mn_state,
                     .command_id = 0,
                 };
-                xQueueSend(g_sr_data->result_que, &result, 0);
+                sr_send_result(&result);
                 g_sr_data->afe_handle->enable_wakenet(afe_data);
                 detect_flag = false;
                 continue;
             }
 
             if (ESP_MN_STATE_DETECTED == mn_state) {
+                sr_trace_mark(SR_TRACE_MN_DETECTED);
                 esp_mn_results_t *mn_result = g_sr_data->multinet->get_results(g_sr_data->model_data);
-                for (int i = 0; i < mn_result->num; i++) {
-                    printf("TOP %d, command_id: %d, phrase_id: %d, prob: %f\n",
-                        i + 1, mn_result->command_id[i], mn_result->phrase_id[i], mn_result->prob[i]);
-                }
-
-                int sr_command_id = mn_result->command_id[0];
-                ESP_LOGI(TAG, "Deteted command : %d", sr_command_id);
                 sr_result_t result = {
                     .wakenet_mode = WAKENET_NO_DETECT,
                     .state = mn_state,
-                    .command_id = sr_command_id,
+                    .num = mn_result->num < SR_NBEST_NUM ? mn_result->num : SR_NBEST_NUM,
                 };
-                xQueueSend(g_sr_data->result_que, &result, 0);
-#if !SR_CONTINUE_DET
-                g_sr_data->afe_handle->enable_wakenet(afe_data);
-                detect_flag = false;
-#endif
+                for (int i = 0; i < result.num; i++) {
+                    result.command_ids[i] = mn_result->command_id[i];
+                    result.phrase_ids[i] = mn_result->phrase_id[i];
+                    result.probs[i] = mn_result->prob[i];
+                    ESP_LOGD(TAG, "TOP %d, command_id: %d, phrase_id: %d, prob: %f",
+                             i + 1, mn_result->command_id[i], mn_result->phrase_id[i], mn_result->prob[i]);
+                }
+
+                int sr_command_id = mn_result->command_id[0];
+                result.command_id = sr_command_id;
+                ESP_LOGI(TAG, "Deteted command : %d, prob: %.3f, margin: %.3f", sr_command_id, result.probs[0], sr_result_margin(&result));
+
+                /* Below its threshold, keep listening for the rest of the window instead */
+                if (!sr_reject_check(&result, 0 != followup_end)) {
+                    g_sr_data->stats.results_rejected++;
+                    continue;
+                }
+                sr_trace_set_command(sr_command_id);
+                result.followup = g_followup_ms > 0;
+                sr_send_result(&result);
+                sr_trace_mark(SR_TRACE_RESULT_QUEUED);
+                if (result.followup) {
+                    followup_end = esp_timer_get_time() + g_followup_ms * 1000LL;
+                } else {
+                    g_sr_data->afe_handle->enable_wakenet(afe_data);
+                    detect_flag = false;
+                }
 
-                if (g_sr_data->b_record_en && (NULL != g_sr_data->fp)) {
-                    ESP_LOGI(TAG, "File saved");
-                    fclose(g_sr_data->fp);
-                    g_sr_data->fp = NULL;
+                if (g_sr_data->b_record_en) {
+                    sr_record_utt_t utt = {
+                        .ring = g_sr_data->preroll,
+                        .wake_time_ms = g_sr_data->wake_time_ms,
+                        .segment = g_sr_data->wake_segment,
+                        .offset = g_sr_data->wake_offset,
+                        .command_id = sr_command_id,
+                        .prob = mn_result->prob[0],
+                    };
+                    if (ESP_OK == app_sr_get_utterance(SR_CLIP_PRE_MS, &utt.span)) {
+                        sr_record_utterance(&utt);
+                    }
                 }
                 continue;
             }
             ESP_LOGE(TAG, "Exception unhandled");
         }
     }
-    /* Task never returns */
+
+    xEventGroupSetBits(g_sr_data->event_group, DETECT_DELETED);
+    vTaskDelete(NULL);
+}
+
+static void sr_handler_entry(void *arg)
+{
+    sr_handler_task(arg);
+    xEventGroupSetBits(g_sr_data->event_group, HANDLER_DELETED);
     vTaskDelete(NULL);
 }
 
+/**
+ * @brief Ask every task that was created to leave its loop and wait until all have
+ */
+static void sr_join_tasks(void)
+{
+    if (NULL == g_sr_data->event_group) {
+        return; /* No task can exist without it */
+    }
+
+    g_sr_data->stop_req = true;
+    EventBits_t wait_bits = 0;
+
+    /* Producers first, so nothing lands in the result queue after the handler is told to leave */
+    if (g_sr_data->detect_task) {
+        xTaskNotifyGive(g_sr_data->detect_task);
+        wait_bits |= DETECT_DELETED;
+    } else {
+        xEventGroupSetBits(g_sr_data->event_group, DETECT_DELETED);
+    }
+    if (g_sr_data->feed_task) {
+        xTaskNotifyGive(g_sr_data->feed_task);
+        wait_bits |= FEED_DELETED;
+    }
+    if (wait_bits) {
+        xEventGroupWaitBits(g_sr_data->event_group, wait_bits, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    g_sr_data->detect_task = NULL;
+    g_sr_data->feed_task = NULL;
+
+    if (g_sr_data->handle_task) {
+        /* Any result unblocks the handler, which then sees stop_req */
+        sr_result_t wake = { 0 };
+        xQueueReset(g_sr_data->result_que);
+        xQueueSend(g_sr_data->result_que, &wake, portMAX_DELAY);
+        xEventGroupWaitBits(g_sr_data->event_group, HANDLER_DELETED, pdFALSE, pdTRUE, portMAX_DELAY);
+        g_sr_data->handle_task = NULL;
+    }
+}
+
 esp_err_t app_sr_set_language(sr_language_t new_lang)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
@@ -238,7 +447,6 @@ esp_err_t app_sr_set_language(sr_language_t new_lang)
     esp_mn_commands_free();
 
     esp_mn_commands_alloc();
-    g_sr_data->cmd_num = 0;
 
     char *wn_name = esp_srmodel_filter(models, ESP_WN_PREFIX, (SR_LANG_EN == g_sr_data->lang ? "hiesp" : "hilexin"));
     g_sr_data->afe_handle->set_wakenet(g_sr_data->afe_data, wn_name);
@@ -255,7 +463,7 @@ esp_err_t app_sr_set_language(sr_language_t new_lang)
     // count command number
     for (size_t i = 0; i < sizeof(g_default_cmd_info) / sizeof(sr_cmd_t); i++) {
         if (g_default_cmd_info[i].lang == g_sr_data->lang) {
-            app_sr_add_cmd(&g_default_cmd_info[i]);
+            app_sr_add_cmd_ref(&g_default_cmd_info[i]);
             cmd_number++;
         }
     }
@@ -263,6 +471,76 @@ esp_err_t app_sr_set_language(sr_language_t new_lang)
     return app_sr_update_cmds();/* Reset command list */
 }
 
+void app_sr_set_followup(uint32_t window_ms)
+{
+    ESP_LOGI(TAG, "Follow-up window %u ms", window_ms);
+    g_followup_ms = window_ms;
+}
+
+uint32_t app_sr_get_followup(void)
+{
+    return g_followup_ms;
+}
+
+esp_err_t app_sr_get_stats(sr_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
+    ESP_RETURN_ON_FALSE(NULL != stats, ESP_ERR_INVALID_ARG, TAG, "pointer of stats is invaild");
+
+    sr_stats_t *s = &g_sr_data->stats;
+    bsp_codec_config_t *codec = sr_get_codec();
+    if (codec->i2s_rx_overflow_fn) {
+        s->i2s_overflows = codec->i2s_rx_overflow_fn();
+    }
+
+    /* Wrapping arithmetic keeps the difference right as long as the backlog is small */
+    s->afe_backlog = s->feed_chunks * (uint32_t)g_sr_data->feed_chunksize - s->fetch_chunks * (uint32_t)g_sr_data->fetch_chunksize;
+    if ((int32_t)s->afe_backlog < 0) {
+        s->afe_backlog = 0;
+    }
+    if (s->afe_backlog > s->afe_backlog_max) {
+        s->afe_backlog_max = s->afe_backlog;
+    }
+
+    memcpy(stats, s, sizeof(sr_stats_t));
+    return ESP_OK;
+}
+
+static void sr_stats_report(void *arg)
+{
+    sr_stats_t stats;
+    if (ESP_OK != app_sr_get_stats(&stats)) {
+        return;
+    }
+    ESP_LOGI(TAG, "feed=%u fetch=%u short_read=%u overflow=%u fetch_fail=%u result_drop=%u result_reject=%u "
+             "barge_in=%u backlog=%u/%u feed_max=%uus detect_max=%uus",
+             stats.feed_chunks, stats.fetch_chunks, stats.i2s_short_reads, stats.i2s_overflows,
+             stats.fetch_failures, stats.results_dropped, stats.results_rejected, stats.barge_ins, stats.afe_backlog, stats.afe_backlog_max,
+             stats.feed_loop_max_us, stats.detect_loop_max_us);
+
+    if (g_sr_data->raw_rec) {
+        sr_record_stats_t rec;
+        sr_record_get_stats(g_sr_data->raw_rec, &rec);
+        ESP_LOGI(TAG, "record blocks=%u dropped=%u/%u frames write_max=%uus clips=%u clips_dropped=%u",
+                 rec.blocks_written, rec.blocks_dropped, rec.frames_dropped, rec.write_max_us,
+                 rec.clips_written, rec.clips_dropped);
+    }
+#if SR_RUN_REPLAY
+    sr_replay_stats_t replay;
+    if (ESP_OK == app_sr_replay_get_stats(&replay)) {
+        ESP_LOGI(TAG, "replay chunks=%u bytes=%llu read_max=%lldus%s", replay.chunks, replay.bytes,
+                 replay.read_max_us, replay.eof ? " eof" : "");
+    }
+#endif
+}
+
+esp_err_t app_sr_set_codec(bsp_codec_config_t *codec)
+{
+    ESP_RETURN_ON_FALSE(NULL == g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR already running");
+    g_sr_codec = codec;
+    return ESP_OK;
+}
+
 esp_err_t app_sr_start(bool record_en)
 {
     esp_err_t ret = ESP_OK;
@@ -277,38 +555,59 @@ esp_err_t app_sr_start(bool record_en)
     g_sr_data->event_group = xEventGroupCreate();
     ESP_GOTO_ON_FALSE(NULL != g_sr_data->event_group, ESP_ERR_NO_MEM, err, TAG, "Failed create event_group");
 
-    SLIST_INIT(&g_sr_data->cmd_list);
+    g_sr_data->cmds = sr_cmds_create(ESP_MN_MAX_PHRASE_NUM);
+    ESP_GOTO_ON_FALSE(NULL != g_sr_data->cmds, ESP_ERR_NO_MEM, err, TAG, "Failed create command table");
 
-    /* Create file if record to SD card enabled*/
+    /* Create the segmented writer if record to SD card enabled */
     g_sr_data->b_record_en = record_en;
     if (record_en) {
-        char file_name[32];
-        for (size_t i = 0; i < 100; i++) {
-            sprintf(file_name, "/sdcard/Record_%02d.pcm", i);
-            g_sr_data->fp = fopen(file_name, "r");
-            fclose(g_sr_data->fp);
-            if (NULL == g_sr_data->fp) {
-                break;
-            }
-        }
-        g_sr_data->fp = fopen(file_name, "w");
-        ESP_GOTO_ON_FALSE(NULL != g_sr_data->fp, ESP_FAIL, err, TAG, "Failed create record file");
-        ESP_LOGI(TAG, "File created at %s", file_name);
+        ret = sr_record_init();
+        ESP_GOTO_ON_FALSE(ESP_OK == ret, ret, err, TAG, "Failed init recording");
+        sr_record_config_t record_config = {
+            .name = "raw",
+            .channels = sr_get_codec()->i2s_rx_chan_num,
+            .sample_rate = SR_SAMPLE_RATE,
+            .segment_ms = SR_RECORD_SEGMENT_MS,
+        };
+        g_sr_data->raw_rec = sr_record_create(&record_config);
+        ESP_GOTO_ON_FALSE(NULL != g_sr_data->raw_rec, ESP_ERR_NO_MEM, err, TAG, "Failed create raw recorder");
     }
 
     BaseType_t ret_val;
 
-    models = esp_srmodel_init("model");
+    /* The model list only maps the partition, keep it for the lifetime of the app */
+    if (NULL == models) {
+        models = esp_srmodel_init("model");
+        ESP_GOTO_ON_FALSE(NULL != models, ESP_FAIL, err, TAG, "Failed init models");
+    }
     afe_handle = (esp_afe_sr_iface_t *)&ESP_AFE_SR_HANDLE;
     afe_config_t afe_config = AFE_CONFIG_DEFAULT();
 
     afe_config.wakenet_model_name = esp_srmodel_filter(models, ESP_WN_PREFIX, NULL);
-    afe_config.aec_init = false;
+    afe_config.aec_init = SR_AEC_ENABLE;
 
     esp_afe_sr_data_t *afe_data = afe_handle->create_from_config(&afe_config);
+    ESP_GOTO_ON_FALSE(NULL != afe_data, ESP_FAIL, err, TAG, "Failed create AFE");
     g_sr_data->afe_handle = afe_handle;
     g_sr_data->afe_data = afe_data;
 
+    /* AFE-shaped frame slots for the feed task, owned by the engine rather than the task */
+    size_t slot_len = AFE_FEED_LEAD_NUM + afe_handle->get_feed_chunksize(afe_data) * AFE_FEED_CHANNEL_NUM;
+    g_sr_data->afe_in_buffer = heap_caps_malloc(slot_len * sizeof(int16_t) * AFE_FEED_SLOT_NUM, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ESP_GOTO_ON_FALSE(NULL != g_sr_data->afe_in_buffer, ESP_ERR_NO_MEM, err, TAG, "Failed create audio buffer");
+
+    /* Boards without a loopback lane get the playback reference from the TX tap */
+    if (SR_AEC_ENABLE && sr_get_codec()->i2s_rx_chan_num < AFE_FEED_CHANNEL_NUM && sr_ref_is_software()) {
+        g_sr_data->ref_buffer = heap_caps_malloc(afe_handle->get_feed_chunksize(afe_data) * sizeof(int16_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        ESP_GOTO_ON_FALSE(NULL != g_sr_data->ref_buffer, ESP_ERR_NO_MEM, err, TAG, "Failed create reference buffer");
+    }
+
+    int fetch_chunksize = afe_handle->get_fetch_chunksize(afe_data);
+    g_sr_data->fetch_chunksize = fetch_chunksize;
+    g_sr_data->feed_chunksize = afe_handle->get_feed_chunksize(afe_data);
+    g_sr_data->preroll = audio_ring_create(fetch_chunksize, SR_PREROLL_MS * SR_SAMPLE_RATE / 1000 / fetch_chunksize);
+    ESP_GOTO_ON_FALSE(NULL != g_sr_data->preroll, ESP_ERR_NO_MEM, err, TAG, "Failed create pre-roll ring");
+
     sys_param_t *param = settings_get_parameter();
     g_sr_data->lang = SR_LANG_MAX;
     ret = app_sr_set_language(param->sr_lang);
@@ -320,9 +619,19 @@ esp_err_t app_sr_start(bool record_en)
     ret_val = xTaskCreatePinnedToCore(&audio_detect_task, "Detect Task", 8 * 1024, (void*)afe_data, 5, &g_sr_data->detect_task, 1);
     ESP_GOTO_ON_FALSE(pdPASS == ret_val, ESP_FAIL, err, TAG,  "Failed create audio detect task");
 
-    ret_val = xTaskCreatePinnedToCore(&sr_handler_task, "SR Handler Task", 6 * 1024, NULL, configMAX_PRIORITIES - 1, &g_sr_data->handle_task, 0);
+    ret_val = xTaskCreatePinnedToCore(&sr_handler_entry, "SR Handler Task", 6 * 1024, NULL, configMAX_PRIORITIES - 1, &g_sr_data->handle_task, 0);
     ESP_GOTO_ON_FALSE(pdPASS == ret_val, ESP_FAIL, err, TAG,  "Failed create audio handler task");
 
+#if SR_STATS_REPORT_MS
+    const esp_timer_create_args_t stats_timer_args = {
+        .callback = sr_stats_report,
+        .name = "sr_stats",
+    };
+    ret = esp_timer_create(&stats_timer_args, &g_sr_data->stats_timer);
+    ESP_GOTO_ON_FALSE(ESP_OK == ret, ret, err, TAG, "Failed create stats timer");
+    esp_timer_start_periodic(g_sr_data->stats_timer, SR_STATS_REPORT_MS * 1000ULL);
+#endif
+
     return ESP_OK;
 err:
     app_sr_stop();
@@ -333,12 +642,14 @@ esp_err_t app_sr_stop(void)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
 
-    /**
-     * Waiting for all task stoped
-     * TODO: A task creation failure cannot be handled correctly now
-     * */
-    xEventGroupSetBits(g_sr_data->event_group, NEED_DELETE);
-    xEventGroupWaitBits(g_sr_data->event_group, NEED_DELETE | FEED_DELETED | DETECT_DELETED, 1, 1, portMAX_DELAY);
+    if (g_sr_data->stats_timer) {
+        esp_timer_stop(g_sr_data->stats_timer);
+        esp_timer_delete(g_sr_data->stats_timer);
+        g_sr_data->stats_timer = NULL;
+    }
+
+    /* Everything below is owned by the tasks until they are joined */
+    sr_join_tasks();
 
     if (g_sr_data->result_que) {
         vQueueDelete(g_sr_data->result_que);
@@ -350,9 +661,10 @@ esp_err_t app_sr_stop(void)
         g_sr_data->event_group = NULL;
     }
 
-    if (g_sr_data->fp) {
-        fclose(g_sr_data->fp);
-        g_sr_data->fp = NULL;
+    sr_record_delete(g_sr_data->raw_rec);
+    g_sr_data->raw_rec = NULL;
+    if (g_sr_data->b_record_en) {
+        sr_record_deinit();
     }
 
     if (g_sr_data->model_data) {
@@ -363,11 +675,8 @@ esp_err_t app_sr_stop(void)
         g_sr_data->afe_handle->destroy(g_sr_data->afe_data);
     }
 
-    sr_cmd_t *it;
-    while (!SLIST_EMPTY(&g_sr_data->cmd_list)) {
-        it = SLIST_FIRST(&g_sr_data->cmd_list);
-        SLIST_REMOVE_HEAD(&g_sr_data->cmd_list, next);
-        heap_caps_free(it);
+    if (g_sr_data->cmds) {
+        sr_cmds_delete(g_sr_data->cmds);
     }
 
     if (g_sr_data->afe_in_buffer) {
@@ -378,98 +687,139 @@ esp_err_t app_sr_stop(void)
         heap_caps_free(g_sr_data->afe_out_buffer);
     }
 
+    if (g_sr_data->ref_buffer) {
+        heap_caps_free(g_sr_data->ref_buffer);
+    }
+
+    audio_ring_delete(g_sr_data->preroll);
+
     heap_caps_free(g_sr_data);
     g_sr_data = NULL;
     return ESP_OK;
 }
 
+esp_err_t app_sr_restart(void)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
+
+    int64_t start = esp_timer_get_time();
+    bool record_en = g_sr_data->b_record_en;
+    sr_language_t lang = g_sr_data->lang;
+
+    /* Take the command table out so app_sr_stop() doesn't free it */
+    sr_cmd_store_t *cmds = g_sr_data->cmds;
+    g_sr_data->cmds = NULL;
+
+    app_sr_stop();
+    esp_err_t ret = app_sr_start(record_en);
+
+    if (ESP_OK == ret && lang == g_sr_data->lang) {
+        /* Put the saved table back in place of the defaults that start just added,
+         * strings it only references stay where they are */
+        sr_cmds_delete(g_sr_data->cmds);
+        g_sr_data->cmds = cmds;
+        cmds = NULL;
+        esp_mn_commands_free();
+        esp_mn_commands_alloc();
+        for (uint16_t i = 0; i < sr_cmds_count(g_sr_data->cmds); i++) {
+            esp_mn_commands_add(i, (char *)sr_cmds_get(g_sr_data->cmds, i)->phoneme);
+        }
+        ret = app_sr_update_cmds();
+    }
+    if (cmds) {
+        sr_cmds_delete(cmds);
+    }
+    ESP_LOGI(TAG, "SR restarted in %lld ms", (esp_timer_get_time() - start) / 1000);
+    return ret;
+}
+
 esp_err_t app_sr_get_result(sr_result_t *result, TickType_t xTicksToWait)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
 
-    xQueueReceive(g_sr_data->result_que, result, xTicksToWait);
-    return ESP_OK;
+    if (pdTRUE != xQueueReceive(g_sr_data->result_que, result, xTicksToWait)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    return g_sr_data->stop_req ? ESP_ERR_INVALID_STATE : ESP_OK;
 }
 
-esp_err_t app_sr_add_cmd(const sr_cmd_t *cmd)
+audio_ring_t *app_sr_get_preroll(void)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_sr_data, NULL, TAG, "SR is not running");
+    return g_sr_data->preroll;
+}
+
+esp_err_t app_sr_get_utterance(uint32_t pre_ms, audio_ring_span_t *span)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
+    ESP_RETURN_ON_FALSE(NULL != span, ESP_ERR_INVALID_ARG, TAG, "pointer of span is invaild");
+
+    audio_ring_t *ring = g_sr_data->preroll;
+    uint32_t head = audio_ring_head(ring);
+    uint32_t pre_frames = pre_ms * SR_SAMPLE_RATE / 1000 / audio_ring_frame_len(ring);
+    uint32_t first = g_sr_data->wake_seq - pre_frames;
+
+    /* Clamp to what is still in the ring */
+    if ((uint32_t)(head - first) >= audio_ring_capacity(ring)) {
+        first = head - (audio_ring_capacity(ring) - 1);
+    }
+    return audio_ring_window(ring, first, head - first, span);
+}
+
+static esp_err_t sr_add_cmd(const sr_cmd_t *cmd, bool copy)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
     ESP_RETURN_ON_FALSE(NULL != cmd, ESP_ERR_INVALID_ARG, TAG, "pointer of cmd is invaild");
     ESP_RETURN_ON_FALSE(cmd->lang == g_sr_data->lang, ESP_ERR_INVALID_ARG, TAG, "cmd lang error");
-    ESP_RETURN_ON_FALSE(ESP_MN_MAX_PHRASE_NUM >= g_sr_data->cmd_num, ESP_ERR_INVALID_STATE, TAG, "cmd is full");
-
-    sr_cmd_t *item = (sr_cmd_t *)heap_caps_calloc(1, sizeof(sr_cmd_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    ESP_RETURN_ON_FALSE(NULL != item, ESP_ERR_NO_MEM, TAG, "memory for sr cmd is not enough");
-    memcpy(item, cmd, sizeof(sr_cmd_t));
-    item->next.sle_next = NULL;
-#if 1 // insert after
-    sr_cmd_t *last = SLIST_FIRST(&g_sr_data->cmd_list);
-    if (last == NULL) {
-        SLIST_INSERT_HEAD(&g_sr_data->cmd_list, item, next);
-    } else {
-        sr_cmd_t *it;
-        while ((it = SLIST_NEXT(last, next)) != NULL) {
-            last = it;
-        }
-        SLIST_INSERT_AFTER(last, item, next);
-    }
-#else  // insert head
-    SLIST_INSERT_HEAD(&g_sr_data->cmd_list, it, next);
-#endif
-    esp_mn_commands_add(g_sr_data->cmd_num, (char *)cmd->phoneme);
-    g_sr_data->cmd_num++;
+
+    uint16_t id = sr_cmds_count(g_sr_data->cmds);
+    esp_err_t ret = copy ? sr_cmds_append(g_sr_data->cmds, cmd) : sr_cmds_append_ref(g_sr_data->cmds, cmd);
+    ESP_RETURN_ON_ERROR(ret, TAG, "cmd is full");
+    esp_mn_commands_add(id, (char *)cmd->phoneme);
     return ESP_OK;
 }
 
+esp_err_t app_sr_add_cmd(const sr_cmd_t *cmd)
+{
+    return sr_add_cmd(cmd, true);
+}
+
+esp_err_t app_sr_add_cmd_ref(const sr_cmd_t *cmd)
+{
+    return sr_add_cmd(cmd, false);
+}
+
+esp_err_t app_sr_share_cmd(uint32_t id, const char *str, const char *phoneme)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
+    return sr_cmds_share(g_sr_data->cmds, id, str, phoneme);
+}
+
 esp_err_t app_sr_modify_cmd(uint32_t id, const sr_cmd_t *cmd)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
     ESP_RETURN_ON_FALSE(NULL != cmd, ESP_ERR_INVALID_ARG, TAG, "pointer of cmd is invaild");
-    ESP_RETURN_ON_FALSE(id < g_sr_data->cmd_num, ESP_ERR_INVALID_ARG, TAG, "cmd id out of range");
+    ESP_RETURN_ON_FALSE(id < sr_cmds_count(g_sr_data->cmds), ESP_ERR_INVALID_ARG, TAG, "cmd id out of range");
     ESP_RETURN_ON_FALSE(cmd->lang == g_sr_data->lang, ESP_ERR_INVALID_ARG, TAG, "cmd lang error");
 
-    sr_cmd_t *it;
-    SLIST_FOREACH(it, &g_sr_data->cmd_list, next) {
-        if (it->id == id) {
-            ESP_LOGI(TAG, "modify cmd [%d] from %s to %s", id, it->str, cmd->str);
-            esp_mn_commands_modify(it->phoneme, (char *)cmd->phoneme);
-            memcpy(it, cmd, sizeof(sr_cmd_t));
-            break;
-        }
-    }
-    ESP_RETURN_ON_FALSE(NULL != it, ESP_ERR_NOT_FOUND, TAG, "can't find cmd id:%d", cmd->id);
-    return ESP_OK;
+    sr_cmd_t *it = sr_cmds_get(g_sr_data->cmds, id);
+    ESP_LOGI(TAG, "modify cmd [%d] from %s to %s", id, it->str, cmd->str);
+    esp_mn_commands_modify(it->phoneme, (char *)cmd->phoneme);
+    return sr_cmds_replace(g_sr_data->cmds, id, cmd);
 }
 
 esp_err_t app_sr_remove_cmd(uint32_t id)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
-    ESP_RETURN_ON_FALSE(id < g_sr_data->cmd_num, ESP_ERR_INVALID_ARG, TAG, "cmd id out of range");
-    sr_cmd_t *it;
-    SLIST_FOREACH(it, &g_sr_data->cmd_list, next) {
-        if (it->id == id) {
-            ESP_LOGI(TAG, "remove cmd id [%d]", it->id);
-            SLIST_REMOVE(&g_sr_data->cmd_list, it, sr_cmd_t, next);
-            heap_caps_free(it);
-            g_sr_data->cmd_num--;
-            break;
-        }
-    }
-    ESP_RETURN_ON_FALSE(NULL != it, ESP_ERR_NOT_FOUND, TAG, "can't find cmd id:%d", id);
-    return ESP_OK;
+    ESP_RETURN_ON_FALSE(id < sr_cmds_count(g_sr_data->cmds), ESP_ERR_INVALID_ARG, TAG, "cmd id out of range");
+    ESP_LOGI(TAG, "remove cmd id [%d]", id);
+    return sr_cmds_remove(g_sr_data->cmds, id);
 }
 
 esp_err_t app_sr_remove_all_cmd(void)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
-    sr_cmd_t *it;
-    while (!SLIST_EMPTY(&g_sr_data->cmd_list)) {
-        it = SLIST_FIRST(&g_sr_data->cmd_list);
-        SLIST_REMOVE_HEAD(&g_sr_data->cmd_list, next);
-        heap_caps_free(it);
-    }
-    SLIST_INIT(&g_sr_data->cmd_list);
-    g_sr_data->cmd_num = 0;
+    sr_cmds_clear(g_sr_data->cmds);
     return ESP_OK;
 }
 
@@ -477,12 +827,7 @@ esp_err_t app_sr_update_cmds(void)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, ESP_ERR_INVALID_STATE, TAG, "SR is not running");
 
-    uint32_t count = 0;
-    sr_cmd_t *it;
-    SLIST_FOREACH(it, &g_sr_data->cmd_list, next) {
-        it->id = count++;
-    }
-
+    /* Ids already equal positions in the table */
     esp_mn_error_t *err_id = esp_mn_commands_update(g_sr_data->multinet, g_sr_data->model_data);
     if(err_id){
         for (int i = 0; i < err_id->num; i++) {
@@ -499,15 +844,14 @@ uint8_t app_sr_search_cmd_from_user_cmd(sr_user_cmd_t user_cmd, uint8_t *id_list
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, 0, TAG, "SR is not running");
 
     uint8_t cmd_num = 0;
-    sr_cmd_t *it;
-    SLIST_FOREACH(it, &g_sr_data->cmd_list, next) {
+    uint16_t count = sr_cmds_count(g_sr_data->cmds);
+    for (uint16_t i = 0; i < count && cmd_num < max_len; i++) {
+        const sr_cmd_t *it = sr_cmds_get(g_sr_data->cmds, i);
         if (user_cmd == it->cmd) {
             if (id_list) {
                 id_list[cmd_num] = it->id;
             }
-            if (++cmd_num >= max_len) {
-                break;
-            }
+            cmd_num++;
         }
     }
     return cmd_num;
@@ -516,46 +860,31 @@ uint8_t app_sr_search_cmd_from_user_cmd(sr_user_cmd_t user_cmd, uint8_t *id_list
 uint8_t app_sr_search_cmd_from_phoneme(const char *phoneme, uint8_t *id_list, uint16_t max_len)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, 0, TAG, "SR is not running");
+    return sr_cmds_find_phoneme(g_sr_data->cmds, phoneme, id_list, max_len);
+}
 
-    uint8_t cmd_num = 0;
-    sr_cmd_t *it;
-    SLIST_FOREACH(it, &g_sr_data->cmd_list, next) {
-        if (0 == strcmp(phoneme, it->phoneme)) {
-            if (id_list) {
-                id_list[cmd_num] = it->id;
-            }
-            if (++cmd_num >= max_len) {
-                break;
-            }
-        }
-    }
-    return cmd_num;
+uint8_t app_sr_search_cmd_from_text(const char *text, uint8_t *id_list, uint16_t max_len)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_sr_data, 0, TAG, "SR is not running");
+    return sr_cmds_find_text(g_sr_data->cmds, text, id_list, max_len);
 }
 
 bool app_sr_is_phoneme_exists(const char *phoneme)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, false, TAG, "SR is not running");
+    return 0 != sr_cmds_find_phoneme(g_sr_data->cmds, phoneme, NULL, 1);
+}
 
-    sr_cmd_t *it;
-    SLIST_FOREACH(it, &g_sr_data->cmd_list, next) {
-        if (0 == strcmp(phoneme, it->phoneme)) {
-            return true;
-        }
-    }
-    return false;
+uint16_t app_sr_get_cmd_num(void)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_sr_data, 0, TAG, "SR is not running");
+    return sr_cmds_count(g_sr_data->cmds);
 }
 
 sr_cmd_t *app_sr_get_cmd_from_id(uint32_t id)
 {
     ESP_RETURN_ON_FALSE(NULL != g_sr_data, NULL, TAG, "SR is not running");
-    ESP_RETURN_ON_FALSE(id < g_sr_data->cmd_num, NULL, TAG, "cmd id out of range");
-
-    sr_cmd_t *it;
-    SLIST_FOREACH(it, &g_sr_data->cmd_list, next) {
-        if (id == it->id) {
-            return it;
-        }
-    }
-    ESP_RETURN_ON_FALSE(NULL != it, NULL, TAG, "can't find cmd id:%d", id);
-    return NULL;
-}
\ No newline at end of file
+    sr_cmd_t *cmd = sr_cmds_get(g_sr_data->cmds, id);
+    ESP_RETURN_ON_FALSE(NULL != cmd, NULL, TAG, "cmd id out of range");
+    return cmd;
+}
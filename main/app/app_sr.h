@@ -7,35 +7,77 @@
 #pragma once
 
 #include <stdbool.h>
-#include <sys/queue.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_err.h"
 #include "esp_afe_sr_models.h"
 #include "esp_mn_models.h"
+#include "bsp_board.h"
+#include "audio_ring.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define SR_CONTINUE_DET 1
 #define SR_RUN_TEST 0 /**< Just for sr experiment in laboratory >*/
+#define SR_RUN_REPLAY 0 /**< Feed the recognizer from SR_REPLAY_FILE instead of the microphones >*/
+#define SR_REPLAY_FILE "/sdcard/rec/raw00000.wav"
+
+#define SR_SAMPLE_RATE 16000
+#define SR_AEC_ENABLE 1 /**< Cancel our own playback using the reference lane >*/
+#define SR_BARGE_IN 1 /**< Speech while a prompt plays cuts the prompt, needs SR_AEC_ENABLE >*/
+#define SR_PREROLL_MS 4000 /**< Post-AFE audio kept in PSRAM at all times >*/
+#define SR_RECORD_SEGMENT_MS (10 * 60 * 1000) /**< Length of one continuous recording file >*/
+#define SR_CLIP_PRE_MS 500 /**< Audio before the wake word kept in utterance clips >*/
+#define SR_STATS_REPORT_MS (60 * 1000) /**< Period of the statistics log, 0 to disable >*/
 #if SR_RUN_TEST
-#ifdef SR_CONTINUE_DET
-#undef SR_CONTINUE_DET
-#define SR_CONTINUE_DET 0
-#endif
+#define SR_FOLLOWUP_MS_DEFAULT 0
+#else
+#define SR_FOLLOWUP_MS_DEFAULT 6000 /**< Follow-up window after a command, 0 to go back to the wake word at once >*/
 #endif
 
 #define SR_CMD_STR_LEN_MAX 64
 #define SR_CMD_PHONEME_LEN_MAX 64
+#define SR_NBEST_NUM 3 /**< Hypotheses carried in sr_result_t, at most ESP_MN_RESULT_MAX_NUM >*/
+#define SR_NBEST_AMBIGUOUS_MARGIN 0.1f /**< Top-2 probability gap below which a result is ambiguous >*/
 
 typedef struct {
     wakenet_state_t wakenet_mode;
     esp_mn_state_t state;
-    int command_id;
+    int command_id;                     /**< Best hypothesis, same as command_ids[0] */
+    bool followup;                      /**< A follow-up window opened after this command */
+    int num;                            /**< Valid entries in the arrays below, best first */
+    int command_ids[SR_NBEST_NUM];
+    int phrase_ids[SR_NBEST_NUM];
+    float probs[SR_NBEST_NUM];
 } sr_result_t;
 
+/**
+ * @brief Probability gap between the two best hypotheses, 1.0 if there is only one
+ */
+static inline float sr_result_margin(const sr_result_t *result)
+{
+    return result->num > 1 ? result->probs[0] - result->probs[1] : 1.0f;
+}
+
+/**
+ * @brief Health counters of the capture and recognition pipeline
+ */
+typedef struct {
+    uint32_t feed_chunks;           /**< Chunks read from I2S and fed to the AFE */
+    uint32_t fetch_chunks;          /**< Chunks fetched from the AFE */
+    uint32_t i2s_short_reads;       /**< Reads that failed or returned less than a chunk */
+    uint32_t i2s_overflows;         /**< RX DMA buffers lost before being read */
+    uint32_t fetch_failures;        /**< Fetches that returned no data */
+    uint32_t results_dropped;       /**< Results lost because the result queue was full */
+    uint32_t results_rejected;      /**< Detections below their confidence threshold */
+    uint32_t barge_ins;             /**< Prompts cut short because the user spoke over them */
+    uint32_t afe_backlog;           /**< Samples fed but not fetched yet */
+    uint32_t afe_backlog_max;
+    uint32_t feed_loop_max_us;      /**< Slowest feed iteration, I2S wait excluded */
+    uint32_t detect_loop_max_us;    /**< Slowest detect iteration, AFE wait excluded */
+} sr_stats_t;
+
 /**
  * @brief User defined command list
  *
@@ -54,22 +96,87 @@ typedef struct sr_cmd_t {
     sr_user_cmd_t cmd;
     sr_language_t lang;
     uint32_t id;
-    char str[SR_CMD_STR_LEN_MAX];
-    char phoneme[SR_CMD_PHONEME_LEN_MAX];
-    SLIST_ENTRY(sr_cmd_t) next;
+    const char *str;        /**< At most SR_CMD_STR_LEN_MAX - 1 chars */
+    const char *phoneme;    /**< At most SR_CMD_PHONEME_LEN_MAX - 1 chars */
 } sr_cmd_t;
 
+/**
+ * @brief Use another capture source than the board codec, NULL restores the board codec
+ *
+ * @note Must be called while SR is stopped
+ */
+esp_err_t app_sr_set_codec(bsp_codec_config_t *codec);
 esp_err_t app_sr_start(bool record_en);
+
+/**
+ * @brief Stop all SR tasks and release everything but the loaded model list
+ *
+ * @note Safe to call on a partially started engine
+ */
 esp_err_t app_sr_stop(void);
+
+/**
+ * @brief Recreate the AFE and MultiNet instances with the current settings
+ *
+ * The model partition stays mapped and the command list is carried over,
+ * so new AFE or model parameters apply without a reboot.
+ *
+ * @note The engine is freed and recreated. Call it from the task that owns
+ *       command changes, and don't keep pointers returned by app_sr_* across it.
+ */
+esp_err_t app_sr_restart(void);
+
+/**
+ * @brief Wait for the next SR result
+ *
+ * @return ESP_ERR_TIMEOUT if nothing arrived, ESP_ERR_INVALID_STATE once SR is stopping
+ */
 esp_err_t app_sr_get_result(sr_result_t *result, TickType_t xTicksToWait);
+esp_err_t app_sr_get_stats(sr_stats_t *stats);
 esp_err_t app_sr_set_language(sr_language_t new_lang);
+
+/**
+ * @brief Set how long MultiNet keeps listening after a command without a new wake word
+ *
+ * The window restarts with every accepted command, the wake word comes back
+ * when it ends and an ESP_MN_STATE_TIMEOUT result closes the session.
+ * Kept across app_sr_restart(), 0 disables follow-up.
+ */
+void app_sr_set_followup(uint32_t window_ms);
+uint32_t app_sr_get_followup(void);
+
+/**
+ * @brief Get the pre-roll ring that always holds the last SR_PREROLL_MS of post-AFE audio
+ */
+audio_ring_t *app_sr_get_preroll(void);
+
+/**
+ * @brief Get a zero-copy window from `pre_ms` before the last wake word up to now
+ *
+ * @note Check `audio_ring_is_valid(ring, span->first)` after consuming the data
+ */
+esp_err_t app_sr_get_utterance(uint32_t pre_ms, audio_ring_span_t *span);
 esp_err_t app_sr_add_cmd(const sr_cmd_t *cmd);
+
+/**
+ * @brief Add a command without copying its strings, they must stay valid until the command is removed
+ *
+ * Used for literals and for the memory-mapped command pack.
+ */
+esp_err_t app_sr_add_cmd_ref(const sr_cmd_t *cmd);
+
+/**
+ * @brief Let command `id` use identical strings that outlive it, freeing its copy
+ */
+esp_err_t app_sr_share_cmd(uint32_t id, const char *str, const char *phoneme);
 esp_err_t app_sr_modify_cmd(uint32_t id, const sr_cmd_t *cmd);
 esp_err_t app_sr_remove_cmd(uint32_t id);
 esp_err_t app_sr_remove_all_cmd(void);
 sr_cmd_t *app_sr_get_cmd_from_id(uint32_t id);
+uint16_t app_sr_get_cmd_num(void);
 uint8_t app_sr_search_cmd_from_user_cmd(sr_user_cmd_t user_cmd, uint8_t *id_list, uint16_t max_len);
 uint8_t app_sr_search_cmd_from_phoneme(const char *phoneme, uint8_t *id_list, uint16_t max_len);
+uint8_t app_sr_search_cmd_from_text(const char *text, uint8_t *id_list, uint16_t max_len);
 bool app_sr_is_phoneme_exists(const char *phoneme);
 esp_err_t app_sr_update_cmds(void);
 
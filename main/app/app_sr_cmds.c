@@ -0,0 +1,238 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "app_sr_cmds.h"
+
+static const char *TAG = "sr_cmds";
+
+/* Slots hold position + 1, 0 marks an empty slot */
+#define SLOT_EMPTY (0)
+
+struct sr_cmd_store_t {
+    uint16_t count;
+    uint16_t capacity;
+    uint32_t hash_mask;     /**< Index size - 1, a power of two at least twice the capacity */
+    sr_cmd_t *cmds;
+    char **own;             /**< Per position, the copy holding its strings, NULL when only referenced */
+    uint16_t *pho_index;
+    uint16_t *txt_index;
+};
+
+/* FNV-1a */
+static uint32_t str_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (uint8_t) * s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void index_insert(uint16_t *index, uint32_t mask, const char *key, uint16_t pos)
+{
+    uint32_t i = str_hash(key) & mask;
+    while (SLOT_EMPTY != index[i]) {
+        i = (i + 1) & mask;
+    }
+    index[i] = pos + 1;
+}
+
+static void index_rebuild(sr_cmd_store_t *store)
+{
+    memset(store->pho_index, 0, (store->hash_mask + 1) * sizeof(uint16_t));
+    memset(store->txt_index, 0, (store->hash_mask + 1) * sizeof(uint16_t));
+    for (uint16_t i = 0; i < store->count; i++) {
+        store->cmds[i].id = i;
+        index_insert(store->pho_index, store->hash_mask, store->cmds[i].phoneme, i);
+        index_insert(store->txt_index, store->hash_mask, store->cmds[i].str, i);
+    }
+}
+
+static uint8_t index_find(const sr_cmd_store_t *store, const uint16_t *index, size_t key_offset,
+                          const char *key, uint8_t *id_list, uint16_t max_len)
+{
+    uint8_t found[UINT8_MAX];
+    uint8_t num = 0;
+    uint32_t i = str_hash(key) & store->hash_mask;
+    while (SLOT_EMPTY != index[i] && num < UINT8_MAX) {
+        const sr_cmd_t *cmd = &store->cmds[index[i] - 1];
+        if (0 == strcmp(key, *(const char *const *)((const char *)cmd + key_offset))) {
+            found[num++] = cmd->id;
+        }
+        i = (i + 1) & store->hash_mask;
+    }
+
+    /* Probe order isn't id order, callers expect the lowest ids first */
+    for (int a = 1; a < num; a++) {
+        uint8_t v = found[a];
+        int b = a - 1;
+        for (; b >= 0 && found[b] > v; b--) {
+            found[b + 1] = found[b];
+        }
+        found[b + 1] = v;
+    }
+
+    num = num < max_len ? num : max_len;
+    if (id_list) {
+        memcpy(id_list, found, num);
+    }
+    return num;
+}
+
+sr_cmd_store_t *sr_cmds_create(uint16_t capacity)
+{
+    uint32_t hash_size = 1;
+    while (hash_size < 2 * (uint32_t)capacity) {
+        hash_size <<= 1;
+    }
+
+    size_t size = sizeof(sr_cmd_store_t) + capacity * (sizeof(sr_cmd_t) + sizeof(char *)) + 2 * hash_size * sizeof(uint16_t);
+    sr_cmd_store_t *store = heap_caps_calloc(1, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != store, NULL, TAG, "memory for sr cmd is not enough");
+
+    store->capacity = capacity;
+    store->hash_mask = hash_size - 1;
+    store->cmds = (sr_cmd_t *)(store + 1);
+    store->own = (char **)(store->cmds + capacity);
+    store->pho_index = (uint16_t *)(store->own + capacity);
+    store->txt_index = store->pho_index + hash_size;
+    return store;
+}
+
+void sr_cmds_delete(sr_cmd_store_t *store)
+{
+    sr_cmds_clear(store);
+    heap_caps_free(store);
+}
+
+uint16_t sr_cmds_count(const sr_cmd_store_t *store)
+{
+    return store->count;
+}
+
+uint16_t sr_cmds_capacity(const sr_cmd_store_t *store)
+{
+    return store->capacity;
+}
+
+sr_cmd_t *sr_cmds_get(sr_cmd_store_t *store, uint32_t id)
+{
+    return id < store->count ? &store->cmds[id] : NULL;
+}
+
+/**
+ * @brief Copy the strings of a command into one allocation, truncated to the table limits
+ */
+static char *cmd_dup(sr_cmd_t *cmd)
+{
+    size_t str_len = strnlen(cmd->str, SR_CMD_STR_LEN_MAX - 1);
+    size_t pho_len = strnlen(cmd->phoneme, SR_CMD_PHONEME_LEN_MAX - 1);
+    char *buf = heap_caps_malloc(str_len + pho_len + 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != buf, NULL, TAG, "memory for cmd string is not enough");
+    memcpy(buf, cmd->str, str_len);
+    buf[str_len] = '\0';
+    memcpy(buf + str_len + 1, cmd->phoneme, pho_len);
+    buf[str_len + 1 + pho_len] = '\0';
+    cmd->str = buf;
+    cmd->phoneme = buf + str_len + 1;
+    return buf;
+}
+
+static esp_err_t cmds_append(sr_cmd_store_t *store, const sr_cmd_t *cmd, bool copy)
+{
+    ESP_RETURN_ON_FALSE(store->count < store->capacity, ESP_ERR_NO_MEM, TAG, "cmd is full");
+
+    uint16_t pos = store->count;
+    memcpy(&store->cmds[pos], cmd, sizeof(sr_cmd_t));
+    store->own[pos] = NULL;
+    if (copy) {
+        store->own[pos] = cmd_dup(&store->cmds[pos]);
+        ESP_RETURN_ON_FALSE(NULL != store->own[pos], ESP_ERR_NO_MEM, TAG, "cmd is not added");
+    }
+    store->cmds[pos].id = pos;
+    store->count++;
+    index_insert(store->pho_index, store->hash_mask, store->cmds[pos].phoneme, pos);
+    index_insert(store->txt_index, store->hash_mask, store->cmds[pos].str, pos);
+    return ESP_OK;
+}
+
+esp_err_t sr_cmds_append(sr_cmd_store_t *store, const sr_cmd_t *cmd)
+{
+    return cmds_append(store, cmd, true);
+}
+
+esp_err_t sr_cmds_append_ref(sr_cmd_store_t *store, const sr_cmd_t *cmd)
+{
+    return cmds_append(store, cmd, false);
+}
+
+esp_err_t sr_cmds_replace(sr_cmd_store_t *store, uint32_t id, const sr_cmd_t *cmd)
+{
+    ESP_RETURN_ON_FALSE(id < store->count, ESP_ERR_NOT_FOUND, TAG, "can't find cmd id:%d", id);
+
+    sr_cmd_t copy = *cmd;
+    char *own = cmd_dup(&copy);
+    ESP_RETURN_ON_FALSE(NULL != own, ESP_ERR_NO_MEM, TAG, "cmd is not replaced");
+    heap_caps_free(store->own[id]);
+    store->own[id] = own;
+    store->cmds[id] = copy;
+    /* Open addressing can't delete in place, edits are rare enough to rebuild */
+    index_rebuild(store);
+    return ESP_OK;
+}
+
+esp_err_t sr_cmds_remove(sr_cmd_store_t *store, uint32_t id)
+{
+    ESP_RETURN_ON_FALSE(id < store->count, ESP_ERR_NOT_FOUND, TAG, "can't find cmd id:%d", id);
+
+    heap_caps_free(store->own[id]);
+    memmove(&store->cmds[id], &store->cmds[id + 1], (store->count - id - 1) * sizeof(sr_cmd_t));
+    memmove(&store->own[id], &store->own[id + 1], (store->count - id - 1) * sizeof(char *));
+    store->count--;
+    index_rebuild(store);
+    return ESP_OK;
+}
+
+esp_err_t sr_cmds_share(sr_cmd_store_t *store, uint32_t id, const char *str, const char *phoneme)
+{
+    ESP_RETURN_ON_FALSE(id < store->count, ESP_ERR_NOT_FOUND, TAG, "can't find cmd id:%d", id);
+    sr_cmd_t *cmd = &store->cmds[id];
+    ESP_RETURN_ON_FALSE(0 == strcmp(cmd->str, str) && 0 == strcmp(cmd->phoneme, phoneme),
+                        ESP_ERR_INVALID_ARG, TAG, "cmd %d doesn't match the shared strings", id);
+
+    /* Same content hashes the same, the indexes stay valid */
+    cmd->str = str;
+    cmd->phoneme = phoneme;
+    heap_caps_free(store->own[id]);
+    store->own[id] = NULL;
+    return ESP_OK;
+}
+
+void sr_cmds_clear(sr_cmd_store_t *store)
+{
+    for (uint16_t i = 0; i < store->count; i++) {
+        heap_caps_free(store->own[i]);
+        store->own[i] = NULL;
+    }
+    store->count = 0;
+    index_rebuild(store);
+}
+
+uint8_t sr_cmds_find_phoneme(const sr_cmd_store_t *store, const char *phoneme, uint8_t *id_list, uint16_t max_len)
+{
+    return index_find(store, store->pho_index, offsetof(sr_cmd_t, phoneme), phoneme, id_list, max_len);
+}
+
+uint8_t sr_cmds_find_text(const sr_cmd_store_t *store, const char *text, uint8_t *id_list, uint16_t max_len)
+{
+    return index_find(store, store->txt_index, offsetof(sr_cmd_t, str), text, id_list, max_len);
+}
@@ -0,0 +1,75 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "app_sr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Command table indexed by id, with hash indexes on phoneme and text
+ *
+ * Commands live in one contiguous block, so the id of a command is its
+ * position. Removing a command shifts the ones after it down by one.
+ * Strings are either copied into the table or only referenced, see
+ * sr_cmds_append_ref().
+ */
+typedef struct sr_cmd_store_t sr_cmd_store_t;
+
+/**
+ * @brief Allocate a store for up to `capacity` commands as a single PSRAM block, copied strings live outside it
+ */
+sr_cmd_store_t *sr_cmds_create(uint16_t capacity);
+void sr_cmds_delete(sr_cmd_store_t *store);
+
+uint16_t sr_cmds_count(const sr_cmd_store_t *store);
+uint16_t sr_cmds_capacity(const sr_cmd_store_t *store);
+
+/**
+ * @brief Get a command by id, NULL when out of range
+ */
+sr_cmd_t *sr_cmds_get(sr_cmd_store_t *store, uint32_t id);
+
+/**
+ * @brief Copy a command and its strings to the end of the table, its id is set to its position
+ */
+esp_err_t sr_cmds_append(sr_cmd_store_t *store, const sr_cmd_t *cmd);
+
+/**
+ * @brief Like sr_cmds_append(), but only the pointers to the strings are kept
+ *
+ * The strings must outlive the command, as literals and mapped flash do.
+ */
+esp_err_t sr_cmds_append_ref(sr_cmd_store_t *store, const sr_cmd_t *cmd);
+/**
+ * @brief Point a command at identical strings held elsewhere and drop its own copy
+ */
+esp_err_t sr_cmds_share(sr_cmd_store_t *store, uint32_t id, const char *str, const char *phoneme);
+esp_err_t sr_cmds_replace(sr_cmd_store_t *store, uint32_t id, const sr_cmd_t *cmd);
+esp_err_t sr_cmds_remove(sr_cmd_store_t *store, uint32_t id);
+void sr_cmds_clear(sr_cmd_store_t *store);
+
+/**
+ * @brief Collect the ids of all commands with this phoneme string
+ *
+ * @param id_list Output, may be NULL to only count
+ * @return Number of ids found, at most `max_len`
+ */
+uint8_t sr_cmds_find_phoneme(const sr_cmd_store_t *store, const char *phoneme, uint8_t *id_list, uint16_t max_len);
+
+/**
+ * @brief Collect the ids of all commands with this text
+ */
+uint8_t sr_cmds_find_text(const sr_cmd_store_t *store, const char *text, uint8_t *id_list, uint16_t max_len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,12 +19,18 @@
 #include "bsp/esp-bsp.h"
 #include "ui_sr.h"
 #include "app_sr_handler.h"
+#include "app_sr_trace.h"
+#include "app_sr_ref.h"
 #include "settings.h"
 
 
 static const char *TAG = "sr_handler";
 
-static bool b_audio_playing = false;
+#define ECHO_WRITE_SLICE (1024) /**< Bytes per write, bounds how late a cancel takes effect */
+
+static volatile bool b_audio_playing = false;
+static volatile bool b_audio_cancel = false;
+static volatile bool b_media_barged = false;
 
 extern file_iterator_instance_t* file_iterator;
 
@@ -44,8 +50,6 @@ static audio_data_t g_audio_data[AUDIO_MAX];
 
 static esp_err_t sr_echo_play(audio_segment_t audio)
 {
-    bsp_audio_poweramp_enable(false); // turn off the speaker to avoid play some noise
-
     typedef struct {
         // The "RIFF" chunk descriptor
         uint8_t ChunkID[4];
@@ -80,21 +84,35 @@ static esp_err_t sr_echo_play(audio_segment_t audio)
     size_t len = g_audio_data[audio].len - sizeof(wav_header_t);
     len = len & 0xfffffffc;
     ESP_LOGD(TAG, "frame_rate=%d, ch=%d, width=%d", wav_head->SampleRate, wav_head->NumChannels, wav_head->BitsPerSample);
-    codec_handle->i2s_reconfig_clk_fn(wav_head->SampleRate, wav_head->BitsPerSample, I2S_SLOT_MODE_STEREO);
 
-    //i2s_zero_dma_buffer(I2S_NUM_0);
+    /* Only a format change glitches the output, so only then mute the speaker while it settles */
+    bool reconfig = !sr_ref_clk_is(wav_head->SampleRate, wav_head->BitsPerSample, I2S_SLOT_MODE_STEREO);
+    if (reconfig) {
+        bsp_audio_poweramp_enable(false); // turn off the speaker to avoid play some noise
+        sr_ref_reconfig_clk(wav_head->SampleRate, wav_head->BitsPerSample, I2S_SLOT_MODE_STEREO);
+    }
+
     sys_param_t *param = settings_get_parameter();
     codec_handle->volume_set_fn(param->volume, NULL);
     codec_handle->mute_set_fn(false);
     ESP_LOGD(TAG, "bsp_codec_set_voice_volume=%d", param->volume);
 
-    vTaskDelay(pdMS_TO_TICKS(50));
+    if (reconfig) {
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
     bsp_audio_poweramp_enable(true);
 
-    size_t bytes_written = 0;
+    /* Written slice by slice so sr_echo_cancel() is honoured within one DMA buffer */
+    b_audio_cancel = false;
     b_audio_playing = true;
-    codec_handle->i2s_write_fn((char *)p, len, &bytes_written, portMAX_DELAY);
-    vTaskDelay(pdMS_TO_TICKS(20));
+    for (size_t off = 0; off < len && !b_audio_cancel; off += ECHO_WRITE_SLICE) {
+        size_t slice = len - off < ECHO_WRITE_SLICE ? len - off : ECHO_WRITE_SLICE;
+        size_t bytes_written = 0;
+        sr_ref_write((char *)p + off, slice, &bytes_written, portMAX_DELAY);
+    }
+    if (b_audio_cancel) {
+        ESP_LOGI(TAG, "Prompt cut by barge-in");
+    }
     b_audio_playing = false;
     return ESP_OK;
 }
@@ -104,6 +122,34 @@ bool sr_echo_is_playing(void)
     return b_audio_playing;
 }
 
+void sr_echo_cancel(void)
+{
+    if (b_audio_playing) {
+        b_audio_cancel = true;
+    }
+}
+
+bool sr_barge_in(void)
+{
+    bool cut = b_audio_playing;
+    sr_echo_cancel();
+    if (AUDIO_PLAYER_STATE_PLAYING == audio_player_get_state()) {
+        audio_player_pause();
+        b_media_barged = true;
+        cut = true;
+    }
+    return cut;
+}
+
+/* Resume the music once the dialog is over, if the wake word or a barge-in paused it */
+static void sr_media_resume(audio_player_state_t last_player_state)
+{
+    if (AUDIO_PLAYER_STATE_PLAYING == last_player_state || b_media_barged) {
+        audio_player_resume();
+    }
+    b_media_barged = false;
+}
+
 sr_language_t sr_detect_language()
 {
     static sr_language_t sr_current_lang = SR_LANG_MAX;
@@ -146,13 +192,32 @@ err:
     }
     return sr_current_lang;
 }
+/* Runs on the dispatch task, so it only logs and updates the label, which takes the display lock */
+static void sr_dispatch_done(int command_id, app_hass_dispatch_status_t status, void *ctx)
+{
+    static const char *status_str[] = {"ok", "failed", "expired", "dropped"};
+    if (APP_HASS_DISPATCH_OK == status) {
+        ESP_LOGI(TAG, "cmd id:%d delivered", command_id);
+        return;
+    }
+
+    ESP_LOGW(TAG, "cmd id:%d not delivered, %s", command_id, status_str[status]);
+    if (SR_LANG_EN == (sr_language_t)(intptr_t) ctx) {
+        sr_anim_set_text("Not delivered");
+    } else {
+        sr_anim_set_text("发送失败");
+    }
+}
+
 void sr_handler_task(void *pvParam)
 {
     sr_language_t sr_current_lang;
     audio_player_state_t last_player_state = AUDIO_PLAYER_STATE_IDLE;
     while (true) {
         sr_result_t result;
-        app_sr_get_result(&result, portMAX_DELAY);
+        if (ESP_ERR_INVALID_STATE == app_sr_get_result(&result, portMAX_DELAY)) {
+            break;
+        }
         char audio_file[48] = {0};
 
         sr_current_lang = sr_detect_language();
@@ -167,9 +232,7 @@ void sr_handler_task(void *pvParam)
             sr_echo_play(AUDIO_END);
 #endif
             sr_anim_stop();
-            if (AUDIO_PLAYER_STATE_PLAYING == last_player_state) {
-                audio_player_resume();
-            }
+            sr_media_resume(last_player_state);
             continue;
         }
 
@@ -190,18 +253,21 @@ void sr_handler_task(void *pvParam)
         }
 
         if (ESP_MN_STATE_DETECTED & result.state) {
+            sr_trace_mark(SR_TRACE_HANDLER_DEQUEUE);
             const sr_cmd_t *cmd = app_sr_get_cmd_from_id(result.command_id);
             ESP_LOGI(TAG, "command:%s, act:%d", cmd->str, cmd->cmd);
             sr_anim_set_text((char *) cmd->str);
-#if !SR_CONTINUE_DET
-            sr_anim_stop();
-            if (PLAYER_STATE_PLAYING == last_player_state) {
-                app_player_play();
+            if (!result.followup) {
+                sr_anim_stop();
+                sr_media_resume(last_player_state);
+            }
+
+            /* Sent by the dispatch task, the echo and the next detection don't wait on the network */
+            if (ESP_OK != app_hass_dispatch(&result, APP_HASS_DISPATCH_DEADLINE_MS, sr_dispatch_done,
+                                            (void *)(intptr_t) sr_current_lang)) {
+                sr_dispatch_done(result.command_id, APP_HASS_DISPATCH_FAILED, (void *)(intptr_t) sr_current_lang);
             }
-#endif
 
-            app_hass_send_cmd((char *) cmd->str);
-            
 #if !SR_RUN_TEST
             if (SR_LANG_EN == sr_current_lang) {
                 strncpy(audio_file, "/spiffs/echo_en_ok.wav", sizeof(audio_file));
@@ -212,5 +278,4 @@ void sr_handler_task(void *pvParam)
 #endif
         }
     }
-    vTaskDelete(NULL);
 }
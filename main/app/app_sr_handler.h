@@ -15,6 +15,21 @@ extern "C" {
 
 bool sr_echo_is_playing(void);
 
+/**
+ * @brief Stop the prompt being played, safe to call from any task
+ */
+void sr_echo_cancel(void);
+
+/**
+ * @brief Stop the prompt and pause the music because the user started talking, safe to call from any task
+ *
+ * @return true if anything was playing. Paused music is resumed when the dialog ends.
+ */
+bool sr_barge_in(void);
+
+/**
+ * @brief Consume SR results, returns once app_sr_get_result() reports that SR is stopping
+ */
 void sr_handler_task(void *pvParam);
 
 #ifdef __cplusplus
@@ -0,0 +1,537 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "app_sr_record.h"
+
+static const char *TAG = "sr_record";
+
+#define RECORD_MSG_CLOSE (-1)
+#define RECORD_MSG_EXIT  (-2)
+
+#define INDEX_PATH       SR_RECORD_DIR "/index.bin"
+#define CLIP_PREFIX      "utt"
+#define CLIP_SAMPLE_RATE (16000)
+
+typedef struct {
+    uint8_t riff[4];
+    uint32_t riff_size;
+    uint8_t wave[4];
+    uint8_t fmt[4];
+    uint32_t fmt_size;
+    uint16_t audio_format;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+    uint8_t data[4];
+    uint32_t data_size;
+} wav_header_t;
+
+typedef struct {
+    int block;
+    size_t len;
+    uint32_t segment;           /**< Segment number relative to `first_segment` */
+    int64_t time_ms;            /**< Wall clock when the producer started filling the block */
+} record_msg_t;
+
+struct sr_record {
+    sr_record_config_t config;
+    char name[4];
+    uint32_t segment_bytes;
+    uint32_t frame_bytes;
+    uint32_t block_bytes;       /**< Whole frames, so a dropped block never splits one */
+    uint32_t first_segment;
+
+    /* Producer side */
+    int fill_block;             /**< Block being filled by the producer, -1 if none */
+    size_t fill_len;
+    uint32_t fill_segment;
+    int64_t fill_time_ms;
+    volatile uint32_t seg_count;
+    volatile uint32_t seg_bytes;
+
+    /* Writer side */
+    FILE *fp;
+    uint32_t fp_segment;
+    uint32_t fp_bytes;
+
+    uint8_t *blocks;
+    QueueHandle_t full_que;
+    QueueHandle_t free_que;
+    SemaphoreHandle_t exit_sem;
+    sr_record_stats_t stats;
+};
+
+typedef struct {
+    FILE *index_fp;
+    sr_index_header_t header;
+    SemaphoreHandle_t lock;
+    QueueHandle_t clip_que;
+    SemaphoreHandle_t clip_exit_sem;
+    uint32_t clips_written;
+    uint32_t clips_dropped;
+} sr_record_ctx_t;
+
+static sr_record_ctx_t *g_ctx = NULL;
+
+static void wav_header_fill(wav_header_t *h, uint16_t channels, uint32_t sample_rate, uint32_t data_size)
+{
+    memcpy(h->riff, "RIFF", 4);
+    h->riff_size = data_size + sizeof(wav_header_t) - 8;
+    memcpy(h->wave, "WAVE", 4);
+    memcpy(h->fmt, "fmt ", 4);
+    h->fmt_size = 16;
+    h->audio_format = 1;
+    h->channels = channels;
+    h->sample_rate = sample_rate;
+    h->bits_per_sample = 16;
+    h->block_align = channels * sizeof(int16_t);
+    h->byte_rate = sample_rate * h->block_align;
+    memcpy(h->data, "data", 4);
+    h->data_size = data_size;
+}
+
+static int64_t wall_time_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Caller holds g_ctx->lock */
+static void index_sync_header(void)
+{
+    fseek(g_ctx->index_fp, 0, SEEK_SET);
+    fwrite(&g_ctx->header, sizeof(sr_index_header_t), 1, g_ctx->index_fp);
+    fseek(g_ctx->index_fp, 0, SEEK_END);
+}
+
+static void index_append(const sr_index_record_t *record)
+{
+    xSemaphoreTake(g_ctx->lock, portMAX_DELAY);
+    if (SR_INDEX_SEGMENT == record->type && record->id >= g_ctx->header.next_segment) {
+        g_ctx->header.next_segment = record->id + 1;
+    } else if (SR_INDEX_UTTERANCE == record->type && record->id >= g_ctx->header.next_utterance) {
+        g_ctx->header.next_utterance = record->id + 1;
+    }
+    fwrite(record, sizeof(sr_index_record_t), 1, g_ctx->index_fp);
+    index_sync_header();
+    fflush(g_ctx->index_fp);
+    xSemaphoreGive(g_ctx->lock);
+}
+
+/* Patch the sizes in the WAV header once the length of the data is known */
+static void wav_file_finish(FILE *fp, uint16_t channels, uint32_t sample_rate, uint32_t data_size)
+{
+    wav_header_t header;
+    wav_header_fill(&header, channels, sample_rate, data_size);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(wav_header_t), 1, fp);
+    fclose(fp);
+}
+
+static void record_segment_close(sr_record_t *rec)
+{
+    if (rec->fp) {
+        wav_file_finish(rec->fp, rec->config.channels, rec->config.sample_rate, rec->fp_bytes);
+        rec->fp = NULL;
+        ESP_LOGI(TAG, "%s%05u.wav saved, %u blocks written, %u dropped (%u frames), write max %uus",
+                 rec->name, rec->first_segment + rec->fp_segment, rec->stats.blocks_written,
+                 rec->stats.blocks_dropped, rec->stats.frames_dropped, rec->stats.write_max_us);
+    }
+}
+
+static void record_segment_open(sr_record_t *rec, uint32_t segment, int64_t time_ms)
+{
+    char file_name[48];
+    uint32_t id = rec->first_segment + segment;
+    sprintf(file_name, SR_RECORD_DIR "/%s%05u.wav", rec->name, id);
+
+    rec->fp = fopen(file_name, "w");
+    if (NULL == rec->fp) {
+        ESP_LOGE(TAG, "Failed create %s", file_name);
+        return;
+    }
+    /* Blocks already match the allocation unit, skip newlib's small buffer */
+    setvbuf(rec->fp, NULL, _IONBF, 0);
+
+    wav_header_t header;
+    wav_header_fill(&header, rec->config.channels, rec->config.sample_rate, 0);
+    fwrite(&header, sizeof(wav_header_t), 1, rec->fp);
+    rec->fp_segment = segment;
+    rec->fp_bytes = 0;
+
+    sr_index_record_t record = {
+        .type = SR_INDEX_SEGMENT,
+        .channels = rec->config.channels,
+        .id = id,
+        .time_ms = time_ms,     /* The writer may run seconds behind the audio */
+    };
+    index_append(&record);
+    ESP_LOGI(TAG, "File created at %s", file_name);
+}
+
+static void sr_record_task(void *arg)
+{
+    sr_record_t *rec = arg;
+    record_msg_t msg;
+    bool opened = false;
+
+    while (true) {
+        xQueueReceive(rec->full_que, &msg, portMAX_DELAY);
+
+        if (msg.block >= 0) {
+            if (!opened || msg.segment != rec->fp_segment) {
+                record_segment_close(rec);
+                record_segment_open(rec, msg.segment, msg.time_ms);
+                opened = true;
+            }
+            if (rec->fp) {
+                int64_t start = esp_timer_get_time();
+                fwrite(rec->blocks + msg.block * SR_RECORD_BLOCK_SIZE, 1, msg.len, rec->fp);
+                uint32_t cost = esp_timer_get_time() - start;
+                if (cost > rec->stats.write_max_us) {
+                    rec->stats.write_max_us = cost;
+                }
+                rec->fp_bytes += msg.len;
+                rec->stats.blocks_written++;
+            }
+            xQueueSend(rec->free_que, &msg.block, portMAX_DELAY);
+            continue;
+        }
+
+        record_segment_close(rec);
+
+        if (RECORD_MSG_EXIT == msg.block) {
+            break;
+        }
+    }
+
+    xSemaphoreGive(rec->exit_sem);
+    vTaskDelete(NULL);
+}
+
+sr_record_t *sr_record_create(const sr_record_config_t *config)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_ctx, NULL, TAG, "Recording not initialized");
+
+    sr_record_t *rec = heap_caps_calloc(1, sizeof(sr_record_t), MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != rec, NULL, TAG, "No mem for recorder");
+
+    memcpy(&rec->config, config, sizeof(sr_record_config_t));
+    strncpy(rec->name, config->name, sizeof(rec->name) - 1);
+
+    /* Blocks and segments always hold whole frames, segments whole blocks */
+    rec->frame_bytes = config->channels * sizeof(int16_t);
+    rec->block_bytes = SR_RECORD_BLOCK_SIZE / rec->frame_bytes * rec->frame_bytes;
+    uint32_t bytes = config->segment_ms / 1000 * config->sample_rate * config->channels * sizeof(int16_t);
+    rec->segment_bytes = (bytes + rec->block_bytes - 1) / rec->block_bytes * rec->block_bytes;
+    if (0 == rec->segment_bytes) {
+        rec->segment_bytes = rec->block_bytes;
+    }
+
+    xSemaphoreTake(g_ctx->lock, portMAX_DELAY);
+    rec->first_segment = g_ctx->header.next_segment;
+    xSemaphoreGive(g_ctx->lock);
+
+    rec->blocks = heap_caps_malloc(SR_RECORD_BLOCK_SIZE * SR_RECORD_BLOCK_NUM, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    rec->full_que = xQueueCreate(SR_RECORD_BLOCK_NUM + 1, sizeof(record_msg_t));
+    rec->free_que = xQueueCreate(SR_RECORD_BLOCK_NUM, sizeof(int));
+    rec->exit_sem = xSemaphoreCreateBinary();
+    if (NULL == rec->blocks || NULL == rec->full_que || NULL == rec->free_que || NULL == rec->exit_sem) {
+        ESP_LOGE(TAG, "No mem for recorder");
+        goto err;
+    }
+
+    for (int i = 0; i < SR_RECORD_BLOCK_NUM; i++) {
+        xQueueSend(rec->free_que, &i, 0);
+    }
+    rec->fill_block = -1;
+
+    if (pdPASS != xTaskCreatePinnedToCore(sr_record_task, rec->name, 3 * 1024, rec, 1, NULL, 0)) {
+        ESP_LOGE(TAG, "Failed create record task");
+        goto err;
+    }
+    return rec;
+
+err:
+    if (rec->blocks) {
+        heap_caps_free(rec->blocks);
+    }
+    if (rec->full_que) {
+        vQueueDelete(rec->full_que);
+    }
+    if (rec->free_que) {
+        vQueueDelete(rec->free_que);
+    }
+    if (rec->exit_sem) {
+        vSemaphoreDelete(rec->exit_sem);
+    }
+    heap_caps_free(rec);
+    return NULL;
+}
+
+static void sr_record_submit(sr_record_t *rec)
+{
+    record_msg_t msg = {
+        .block = rec->fill_block,
+        .len = rec->fill_len,
+        .segment = rec->fill_segment,
+        .time_ms = rec->fill_time_ms,
+    };
+    xQueueSend(rec->full_que, &msg, 0);
+    rec->fill_block = -1;
+    rec->fill_len = 0;
+}
+
+static void sr_record_finish(sr_record_t *rec)
+{
+    if (rec->fill_block >= 0) {
+        sr_record_submit(rec);
+    }
+    record_msg_t msg = { .block = RECORD_MSG_CLOSE };
+    xQueueSend(rec->full_que, &msg, portMAX_DELAY);
+}
+
+void sr_record_write(sr_record_t *rec, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len) {
+        if (rec->fill_block < 0) {
+            if (pdTRUE != xQueueReceive(rec->free_que, &rec->fill_block, 0)) {
+                rec->fill_block = -1;
+                /* Writes are whole frames and blocks end on a frame, so this is one too */
+                rec->stats.blocks_dropped++;
+                rec->stats.frames_dropped += len / rec->frame_bytes;
+                return;
+            }
+            rec->fill_segment = rec->seg_count;
+            rec->fill_time_ms = wall_time_ms();
+        }
+
+        size_t n = rec->block_bytes - rec->fill_len;
+        n = n < len ? n : len;
+        memcpy(rec->blocks + rec->fill_block * SR_RECORD_BLOCK_SIZE + rec->fill_len, p, n);
+        rec->fill_len += n;
+        p += n;
+        len -= n;
+
+        if (rec->seg_bytes + n >= rec->segment_bytes) {
+            rec->seg_count++;
+            rec->seg_bytes = 0;
+        } else {
+            rec->seg_bytes += n;
+        }
+
+        if (rec->block_bytes == rec->fill_len) {
+            sr_record_submit(rec);
+        }
+    }
+}
+
+void sr_record_tell(sr_record_t *rec, uint32_t *segment, uint32_t *offset)
+{
+    /* Read from another task, may be off by one write */
+    *segment = rec->first_segment + rec->seg_count;
+    *offset = sizeof(wav_header_t) + rec->seg_bytes;
+}
+
+void sr_record_delete(sr_record_t *rec)
+{
+    if (NULL == rec) {
+        return;
+    }
+
+    /* Producers are gone by now, so the partial block can be flushed from here */
+    sr_record_finish(rec);
+    record_msg_t msg = { .block = RECORD_MSG_EXIT };
+    xQueueSend(rec->full_que, &msg, portMAX_DELAY);
+    xSemaphoreTake(rec->exit_sem, portMAX_DELAY);
+
+    vQueueDelete(rec->full_que);
+    vQueueDelete(rec->free_que);
+    vSemaphoreDelete(rec->exit_sem);
+    heap_caps_free(rec->blocks);
+    heap_caps_free(rec);
+}
+
+void sr_record_get_stats(sr_record_t *rec, sr_record_stats_t *stats)
+{
+    memcpy(stats, &rec->stats, sizeof(sr_record_stats_t));
+    if (g_ctx) {
+        stats->clips_written = g_ctx->clips_written;
+        stats->clips_dropped = g_ctx->clips_dropped;
+    }
+}
+
+esp_err_t sr_record_utterance(const sr_record_utt_t *utt)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_ctx, ESP_ERR_INVALID_STATE, TAG, "Recording not initialized");
+    if (pdTRUE != xQueueSend(g_ctx->clip_que, utt, 0)) {
+        g_ctx->clips_dropped++;
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+static void sr_clip_task(void *arg)
+{
+    sr_record_utt_t utt;
+    char file_name[48];
+
+    while (true) {
+        xQueueReceive(g_ctx->clip_que, &utt, portMAX_DELAY);
+        if (NULL == utt.ring) {
+            break;
+        }
+
+        xSemaphoreTake(g_ctx->lock, portMAX_DELAY);
+        uint32_t id = g_ctx->header.next_utterance++;
+        xSemaphoreGive(g_ctx->lock);
+
+        sprintf(file_name, SR_RECORD_DIR "/" CLIP_PREFIX "%05u.wav", id);
+        FILE *fp = fopen(file_name, "w");
+        if (NULL == fp) {
+            ESP_LOGE(TAG, "Failed create %s", file_name);
+            g_ctx->clips_dropped++;
+            continue;
+        }
+
+        uint32_t data_size = (utt.span.len[0] + utt.span.len[1]) * sizeof(int16_t);
+        wav_header_t header;
+        wav_header_fill(&header, 1, CLIP_SAMPLE_RATE, data_size);
+        fwrite(&header, sizeof(wav_header_t), 1, fp);
+        fwrite(utt.span.data[0], sizeof(int16_t), utt.span.len[0], fp);
+        fwrite(utt.span.data[1], sizeof(int16_t), utt.span.len[1], fp);
+        fclose(fp);
+
+        /* The ring kept running meanwhile, the clip is only good if its start survived */
+        if (!audio_ring_is_valid(utt.ring, utt.span.first)) {
+            ESP_LOGW(TAG, "Audio of %s overwritten while saving", file_name);
+            remove(file_name);
+            g_ctx->clips_dropped++;
+            continue;
+        }
+
+        sr_index_record_t record = {
+            .type = SR_INDEX_UTTERANCE,
+            .channels = 1,
+            .command_id = utt.command_id,
+            .id = id,
+            .segment = utt.segment,
+            .offset = utt.offset,
+            .time_ms = utt.wake_time_ms,
+            .prob = utt.prob,
+        };
+        index_append(&record);
+        g_ctx->clips_written++;
+        ESP_LOGI(TAG, "Clip saved at %s", file_name);
+    }
+
+    xSemaphoreGive(g_ctx->clip_exit_sem);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t index_load(void)
+{
+    g_ctx->index_fp = fopen(INDEX_PATH, "r+");
+    if (g_ctx->index_fp) {
+        size_t n = fread(&g_ctx->header, sizeof(sr_index_header_t), 1, g_ctx->index_fp);
+        if (1 == n && SR_INDEX_MAGIC == g_ctx->header.magic &&
+                SR_INDEX_VERSION == g_ctx->header.version &&
+                sizeof(sr_index_record_t) == g_ctx->header.record_size) {
+            fseek(g_ctx->index_fp, 0, SEEK_END);
+            ESP_LOGI(TAG, "Index loaded, next segment %u, next utterance %u",
+                     g_ctx->header.next_segment, g_ctx->header.next_utterance);
+            return ESP_OK;
+        }
+        ESP_LOGW(TAG, "Index invalid, starting a new one");
+        fclose(g_ctx->index_fp);
+    }
+
+    g_ctx->index_fp = fopen(INDEX_PATH, "w+");
+    ESP_RETURN_ON_FALSE(NULL != g_ctx->index_fp, ESP_FAIL, TAG, "Failed create %s", INDEX_PATH);
+    g_ctx->header = (sr_index_header_t) {
+        .magic = SR_INDEX_MAGIC,
+        .version = SR_INDEX_VERSION,
+        .record_size = sizeof(sr_index_record_t),
+    };
+    index_sync_header();
+    fflush(g_ctx->index_fp);
+    return ESP_OK;
+}
+
+esp_err_t sr_record_init(void)
+{
+    esp_err_t ret = ESP_OK;
+    ESP_RETURN_ON_FALSE(NULL == g_ctx, ESP_ERR_INVALID_STATE, TAG, "Recording already initialized");
+
+    g_ctx = heap_caps_calloc(1, sizeof(sr_record_ctx_t), MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != g_ctx, ESP_ERR_NO_MEM, TAG, "No mem for recording");
+
+    mkdir(SR_RECORD_DIR, 0775);
+
+    g_ctx->lock = xSemaphoreCreateMutex();
+    g_ctx->clip_que = xQueueCreate(SR_RECORD_CLIP_NUM, sizeof(sr_record_utt_t));
+    g_ctx->clip_exit_sem = xSemaphoreCreateBinary();
+    ESP_GOTO_ON_FALSE(g_ctx->lock && g_ctx->clip_que && g_ctx->clip_exit_sem, ESP_ERR_NO_MEM, err, TAG, "No mem for recording");
+
+    ret = index_load();
+    ESP_GOTO_ON_FALSE(ESP_OK == ret, ret, err, TAG, "Failed load index");
+
+    ESP_GOTO_ON_FALSE(pdPASS == xTaskCreatePinnedToCore(sr_clip_task, "Record Clip", 3 * 1024, NULL, 1, NULL, 0),
+                      ESP_FAIL, err, TAG, "Failed create clip task");
+    return ESP_OK;
+
+err:
+    if (g_ctx->index_fp) {
+        fclose(g_ctx->index_fp);
+    }
+    if (g_ctx->lock) {
+        vSemaphoreDelete(g_ctx->lock);
+    }
+    if (g_ctx->clip_que) {
+        vQueueDelete(g_ctx->clip_que);
+    }
+    if (g_ctx->clip_exit_sem) {
+        vSemaphoreDelete(g_ctx->clip_exit_sem);
+    }
+    heap_caps_free(g_ctx);
+    g_ctx = NULL;
+    return ret;
+}
+
+void sr_record_deinit(void)
+{
+    if (NULL == g_ctx) {
+        return;
+    }
+
+    sr_record_utt_t exit_msg = { .ring = NULL };
+    xQueueSend(g_ctx->clip_que, &exit_msg, portMAX_DELAY);
+    xSemaphoreTake(g_ctx->clip_exit_sem, portMAX_DELAY);
+
+    fclose(g_ctx->index_fp);
+    vSemaphoreDelete(g_ctx->lock);
+    vQueueDelete(g_ctx->clip_que);
+    vSemaphoreDelete(g_ctx->clip_exit_sem);
+    heap_caps_free(g_ctx);
+    g_ctx = NULL;
+}
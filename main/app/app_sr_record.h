@@ -0,0 +1,134 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_RECORD_DIR        "/sdcard/rec"
+#define SR_RECORD_BLOCK_SIZE (16 * 1024) /**< Matches the SD card FAT allocation unit, filled up to the last whole frame */
+#define SR_RECORD_BLOCK_NUM  (6)
+#define SR_RECORD_CLIP_NUM   (2)         /**< Utterance clips waiting to be written */
+
+#define SR_INDEX_MAGIC       (0x58495253) /**< "SRIX" */
+#define SR_INDEX_VERSION     (1)
+
+/**
+ * @brief Header at the start of SR_RECORD_DIR/index.bin, followed by `sr_index_record_t` entries
+ *
+ * Boot only reads this header to know the next free file numbers.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t next_segment;
+    uint32_t next_utterance;
+} sr_index_header_t;
+
+typedef enum {
+    SR_INDEX_SEGMENT = 1,   /**< A continuous recording segment was started */
+    SR_INDEX_UTTERANCE,     /**< A command was recognized */
+} sr_index_type_t;
+
+typedef struct {
+    uint8_t type;           /**< sr_index_type_t */
+    uint8_t channels;
+    int16_t command_id;     /**< Utterance only */
+    uint32_t id;            /**< Segment or utterance number, also used in the file name */
+    uint32_t segment;       /**< Utterance only, segment that holds the wake word */
+    uint32_t offset;        /**< Utterance only, byte offset of the wake word in that segment */
+    int64_t time_ms;        /**< Wall clock of segment start or wake word */
+    float prob;             /**< Utterance only, probability of the best hypothesis */
+    uint32_t reserved;
+} sr_index_record_t;
+
+typedef struct sr_record sr_record_t;
+
+typedef struct {
+    const char *name;       /**< Up to 3 chars, prefix of the segment files and writer task name */
+    uint8_t channels;
+    uint32_t sample_rate;
+    uint32_t segment_ms;    /**< Rotate to a new file after this much audio */
+} sr_record_config_t;
+
+typedef struct {
+    uint32_t blocks_written;    /**< Blocks handed to the file system */
+    uint32_t blocks_dropped;    /**< Writes that lost data because no block was free */
+    uint32_t frames_dropped;    /**< Frames lost because no block was free, always whole */
+    uint32_t write_max_us;      /**< Slowest block write */
+    uint32_t clips_written;     /**< Utterance clips saved */
+    uint32_t clips_dropped;     /**< Utterance clips lost, queue full or audio overwritten */
+} sr_record_stats_t;
+
+/**
+ * @brief An utterance to save as its own WAV clip and index entry
+ */
+typedef struct {
+    const audio_ring_t *ring;   /**< Post-AFE audio source */
+    audio_ring_span_t span;     /**< Window of the ring holding the utterance */
+    int64_t wake_time_ms;
+    uint32_t segment;           /**< From `sr_record_tell` at wake time */
+    uint32_t offset;
+    int16_t command_id;
+    float prob;
+} sr_record_utt_t;
+
+/**
+ * @brief Mount the recording directory and load the index
+ *
+ * @note Only the index header is read, no matter how many files exist
+ */
+esp_err_t sr_record_init(void);
+
+/**
+ * @brief Wait for pending clips and release the index
+ */
+void sr_record_deinit(void);
+
+/**
+ * @brief Create a segmented WAV recorder writing from its own low priority task
+ *
+ * @return Recorder handle, NULL on failure
+ */
+sr_record_t *sr_record_create(const sr_record_config_t *config);
+
+/**
+ * @brief Queue data for writing, never blocks
+ *
+ * @note Data is dropped and counted when the writer can't keep up
+ */
+void sr_record_write(sr_record_t *rec, const void *data, size_t len);
+
+/**
+ * @brief Get the segment and byte offset the next written byte will land at
+ */
+void sr_record_tell(sr_record_t *rec, uint32_t *segment, uint32_t *offset);
+
+/**
+ * @brief Flush pending blocks, close the file, wait for the writer task and free the recorder
+ *
+ * @note The producer must not write anymore
+ */
+void sr_record_delete(sr_record_t *rec);
+
+void sr_record_get_stats(sr_record_t *rec, sr_record_stats_t *stats);
+
+/**
+ * @brief Queue an utterance clip, never blocks
+ */
+esp_err_t sr_record_utterance(const sr_record_utt_t *utt);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,189 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "bsp_board.h"
+#include "app_sr.h"
+#include "app_sr_ref.h"
+
+static const char *TAG = "sr_ref";
+
+#define REF_RING_MASK (SR_REF_RING_SAMPLES - 1)
+#define REF_OUT_BATCH (128)
+#define REF_WRITE_SLICE (1024)  /**< Bytes, a multiple of every frame size */
+
+static bool g_soft = false;
+static uint32_t g_delay = 0;   /**< TX DMA queue in reference samples, for the current playback rate */
+static int16_t *g_ring = NULL;
+static atomic_uint_least32_t g_wr = 0;
+static atomic_uint_least32_t g_rd = 0;
+
+/* Playback format and resampler state, only touched by the writer */
+static uint32_t g_rate = 0;
+static uint32_t g_bits = 16;
+static uint32_t g_ch = 2;
+static uint32_t g_step = 1 << 16;
+static uint32_t g_frac = 0;
+static int16_t g_prev = 0;
+
+_Static_assert((SR_REF_RING_SAMPLES & REF_RING_MASK) == 0, "SR_REF_RING_SAMPLES must be a power of two");
+
+/* The TX DMA queue drains at the playback rate, the ring counts at SR_SAMPLE_RATE */
+static void ref_set_delay(uint32_t rate)
+{
+    uint32_t frames = bsp_board_get_codec_handle()->i2s_tx_dma_frames;
+    uint32_t delay = (uint64_t)frames * SR_SAMPLE_RATE / rate;
+    g_delay = delay < SR_REF_RING_SAMPLES / 2 ? delay : SR_REF_RING_SAMPLES / 2;
+    ESP_LOGD(TAG, "Reference delay %u samples, %u TX DMA frames at %u Hz", g_delay, frames, rate);
+}
+
+esp_err_t sr_ref_init(void)
+{
+    g_soft = bsp_board_get_codec_handle()->i2s_rx_chan_num < 3;
+    if (!g_soft || g_ring) {
+        return ESP_OK;
+    }
+
+    g_ring = heap_caps_calloc(SR_REF_RING_SAMPLES, sizeof(int16_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != g_ring, ESP_ERR_NO_MEM, TAG, "memory for reference ring is not enough");
+    ref_set_delay(g_rate ? g_rate : SR_SAMPLE_RATE);
+    ESP_LOGI(TAG, "Software playback reference, %d ms ring, %u samples delay, leads by up to %u ms", SR_REF_RING_SAMPLES * 1000 / SR_SAMPLE_RATE,
+             g_delay, bsp_board_get_codec_handle()->i2s_rx_dma_frames * 1000 / SR_SAMPLE_RATE);
+    return ESP_OK;
+}
+
+bool sr_ref_is_software(void)
+{
+    return g_soft;
+}
+
+static void ref_push(const int16_t *src, size_t len)
+{
+    uint32_t rd = atomic_load_explicit(&g_rd, memory_order_acquire);
+    uint32_t wr = atomic_load_explicit(&g_wr, memory_order_relaxed);
+
+    /* Idle or underrun: restart one delay ahead of the reader, silence in between */
+    if (wr - rd < g_delay) {
+        uint32_t pos = wr;
+        for (; pos != rd + g_delay; pos++) {
+            g_ring[pos & REF_RING_MASK] = 0;
+        }
+        wr = pos;
+    }
+
+    size_t space = SR_REF_RING_SAMPLES - (wr - rd);
+    len = len < space ? len : space;
+    size_t first = SR_REF_RING_SAMPLES - (wr & REF_RING_MASK);
+    first = len < first ? len : first;
+    memcpy(&g_ring[wr & REF_RING_MASK], src, first * sizeof(int16_t));
+    memcpy(g_ring, src + first, (len - first) * sizeof(int16_t));
+    atomic_store_explicit(&g_wr, wr + len, memory_order_release);
+}
+
+void sr_ref_read(int16_t *dst, size_t len)
+{
+    if (!g_soft || NULL == g_ring) {
+        memset(dst, 0, len * sizeof(int16_t));
+        return;
+    }
+
+    uint32_t rd = atomic_load_explicit(&g_rd, memory_order_relaxed);
+    uint32_t avail = atomic_load_explicit(&g_wr, memory_order_acquire) - rd;
+    size_t n = avail < len ? avail : len;
+
+    size_t first = SR_REF_RING_SAMPLES - (rd & REF_RING_MASK);
+    first = n < first ? n : first;
+    memcpy(dst, &g_ring[rd & REF_RING_MASK], first * sizeof(int16_t));
+    memcpy(dst + first, g_ring, (n - first) * sizeof(int16_t));
+    memset(dst + n, 0, (len - n) * sizeof(int16_t));
+    /* Never run ahead of the writer: while idle the distance would keep growing
+     * and wrap after ~37 h. The writer restarts one delay ahead of wherever the
+     * reader stands, so the alignment is the same either way. */
+    atomic_store_explicit(&g_rd, rd + n, memory_order_release);
+}
+
+bool sr_ref_clk_is(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    return rate == g_rate && bits_cfg == g_bits && ch == g_ch;
+}
+
+esp_err_t sr_ref_reconfig_clk(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    if (sr_ref_clk_is(rate, bits_cfg, ch)) {
+        return ESP_OK;
+    }
+    g_rate = rate;
+    g_bits = bits_cfg;
+    g_ch = ch;
+    g_step = ((uint64_t)rate << 16) / SR_SAMPLE_RATE;
+    g_frac = 0;
+    g_prev = 0;
+    ref_set_delay(rate);
+    return bsp_board_get_codec_handle()->i2s_reconfig_clk_fn(rate, bits_cfg, ch);
+}
+
+/**
+ * @brief Downmix to mono and resample to SR_SAMPLE_RATE with linear interpolation
+ */
+static void ref_convert(const uint8_t *src, size_t len)
+{
+    int16_t out[REF_OUT_BATCH];
+    size_t out_len = 0;
+    size_t frame_bytes = g_bits / 8 * g_ch;
+
+    for (size_t i = 0; i + frame_bytes <= len; i += frame_bytes) {
+        int32_t sum = 0;
+        for (uint32_t c = 0; c < g_ch; c++) {
+            /* Wider samples keep their top 16 bits */
+            const uint8_t *s = src + i + c * g_bits / 8 + (g_bits / 8 - 2);
+            sum += (int16_t)(s[0] | (s[1] << 8));
+        }
+        int16_t x = sum / (int32_t)g_ch;
+
+        while (g_frac < (1 << 16)) {
+            out[out_len++] = g_prev + (((int32_t)(x - g_prev) * (int32_t)g_frac) >> 16);
+            if (REF_OUT_BATCH == out_len) {
+                ref_push(out, out_len);
+                out_len = 0;
+            }
+            g_frac += g_step;
+        }
+        g_frac -= 1 << 16;
+        g_prev = x;
+    }
+    if (out_len) {
+        ref_push(out, out_len);
+    }
+}
+
+esp_err_t sr_ref_write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    bsp_i2s_write_fn write_fn = bsp_board_get_codec_handle()->i2s_write_fn;
+    if (!g_soft || NULL == g_ring || g_bits < 16) {
+        return write_fn(audio_buffer, len, bytes_written, timeout_ms);
+    }
+
+    /* Slice the write so the copy follows the DMA pace instead of landing all at once */
+    esp_err_t ret = ESP_OK;
+    size_t done = 0;
+    while (done < len) {
+        size_t slice = len - done < REF_WRITE_SLICE ? len - done : REF_WRITE_SLICE;
+        size_t written = 0;
+        ret = write_fn((uint8_t *)audio_buffer + done, slice, &written, timeout_ms);
+        ref_convert((uint8_t *)audio_buffer + done, written);
+        done += written;
+        if (ESP_OK != ret || written < slice) {
+            break;
+        }
+    }
+    *bytes_written = done;
+    return ret;
+}
@@ -0,0 +1,66 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/i2s_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_REF_RING_SAMPLES (8192)  /**< 512 ms of 16 kHz mono reference */
+
+/**
+ * @brief Software playback reference for boards whose ADC has no loopback lane
+ *
+ * Everything played goes through sr_ref_write(), which forwards it to the
+ * board codec and, when the board needs it, downmixes and resamples a copy
+ * to 16 kHz mono. The feed task pulls one chunk per microphone chunk with
+ * sr_ref_read(), so the reference stays locked to the capture clock.
+ *
+ * A copy is taken when the write returns, so it is played after the board's
+ * full TX DMA queue, `i2s_tx_dma_frames` at the playback rate, and the ring
+ * hands it out that much later. The RX DMA buffering, up to
+ * `i2s_rx_dma_frames`, is left out, so the reference leads the echo by up
+ * to one RX buffer rather than ever trailing it.
+ */
+esp_err_t sr_ref_init(void);
+
+/**
+ * @brief true if the board's capture frames don't carry a hardware reference lane
+ */
+bool sr_ref_is_software(void);
+
+/**
+ * @brief Drop-in for `i2s_reconfig_clk_fn`, remembers the playback format
+ *
+ * @note Leaves the channel running when the format doesn't change
+ */
+esp_err_t sr_ref_reconfig_clk(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch);
+
+/**
+ * @brief true if TX already runs with this format, so no reconfiguration glitch is coming
+ */
+bool sr_ref_clk_is(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch);
+
+/**
+ * @brief Drop-in for `i2s_write_fn`, tees the written audio into the reference ring
+ */
+esp_err_t sr_ref_write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+
+/**
+ * @brief Take `len` reference samples aligned with the capture chunk just read, zeros when nothing plays
+ */
+void sr_ref_read(int16_t *dst, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,232 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "app_sr_reject.h"
+
+static const char *TAG = "sr_reject";
+
+static portMUX_TYPE g_lock = portMUX_INITIALIZER_UNLOCKED;
+static float g_global = SR_REJECT_GLOBAL_DEFAULT;
+static sr_reject_stat_t g_stats[SR_REJECT_CMD_MAX];
+static int g_last_cmd = -1;
+static int64_t g_last_us = 0;
+static sr_reject_persist_cb_t g_persist_cb = NULL;
+static TaskHandle_t g_persist_task = NULL;
+static bool g_dirty = false;
+
+static inline float effective_threshold(const sr_reject_stat_t *s)
+{
+    return s->threshold > 0 ? s->threshold : g_global;
+}
+
+/**
+ * @brief Nudge the threshold of one command by its contradiction rate, must hold g_lock
+ *
+ * @return true if the threshold changed
+ */
+static bool tune_locked(sr_reject_stat_t *s)
+{
+    if (s->accepted < SR_REJECT_TUNE_MIN) {
+        return false;
+    }
+
+    float old = effective_threshold(s);
+    float rate = (float)s->contradicted / s->accepted;
+    float thr = old;
+    if (rate > SR_REJECT_TARGET_RATE) {
+        thr += SR_REJECT_TUNE_STEP;
+    } else if (rate < SR_REJECT_TARGET_RATE / 2) {
+        thr -= SR_REJECT_TUNE_STEP / 2;
+    }
+    thr = thr > SR_REJECT_THRESHOLD_MAX ? SR_REJECT_THRESHOLD_MAX : thr;
+    thr = thr < g_global ? g_global : thr;
+
+    /* Decay so the rate follows the room rather than the whole history */
+    if (s->accepted >= 64) {
+        s->accepted /= 2;
+        s->contradicted /= 2;
+    }
+
+    if (thr == old) {
+        return false;
+    }
+    s->threshold = thr;
+    return true;
+}
+
+void sr_reject_set_global(float threshold)
+{
+    portENTER_CRITICAL(&g_lock);
+    g_global = threshold;
+    portEXIT_CRITICAL(&g_lock);
+}
+
+float sr_reject_get_global(void)
+{
+    return g_global;
+}
+
+esp_err_t sr_reject_set_threshold(int command_id, float threshold)
+{
+    ESP_RETURN_ON_FALSE(command_id >= 0 && command_id < SR_REJECT_CMD_MAX, ESP_ERR_INVALID_ARG, TAG, "cmd id out of range");
+    ESP_RETURN_ON_FALSE(threshold >= 0 && threshold < 1.0f, ESP_ERR_INVALID_ARG, TAG, "threshold out of range");
+
+    portENTER_CRITICAL(&g_lock);
+    g_stats[command_id].threshold = threshold;
+    portEXIT_CRITICAL(&g_lock);
+    return ESP_OK;
+}
+
+float sr_reject_get_threshold(int command_id)
+{
+    if (command_id < 0 || command_id >= SR_REJECT_CMD_MAX) {
+        return g_global;
+    }
+    return effective_threshold(&g_stats[command_id]);
+}
+
+esp_err_t sr_reject_get_stat(int command_id, sr_reject_stat_t *stat)
+{
+    ESP_RETURN_ON_FALSE(command_id >= 0 && command_id < SR_REJECT_CMD_MAX, ESP_ERR_INVALID_ARG, TAG, "cmd id out of range");
+    ESP_RETURN_ON_FALSE(NULL != stat, ESP_ERR_INVALID_ARG, TAG, "pointer of stat is invaild");
+
+    portENTER_CRITICAL(&g_lock);
+    memcpy(stat, &g_stats[command_id], sizeof(sr_reject_stat_t));
+    portEXIT_CRITICAL(&g_lock);
+    return ESP_OK;
+}
+
+/* Cheap enough for the detection task, the write happens later on the persist task */
+static void mark_dirty(void)
+{
+    portENTER_CRITICAL(&g_lock);
+    g_dirty = true;
+    portEXIT_CRITICAL(&g_lock);
+    if (g_persist_task) {
+        xTaskNotifyGive(g_persist_task);
+    }
+}
+
+static void sr_reject_persist_task(void *arg)
+{
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        /* Let more changes pile up, they all go out in the one write */
+        vTaskDelay(pdMS_TO_TICKS(SR_REJECT_PERSIST_DELAY_MS));
+        ulTaskNotifyTake(pdTRUE, 0);
+
+        portENTER_CRITICAL(&g_lock);
+        bool dirty = g_dirty;
+        g_dirty = false;
+        portEXIT_CRITICAL(&g_lock);
+        if (dirty && g_persist_cb) {
+            ESP_LOGI(TAG, "Saving tuned thresholds");
+            g_persist_cb();
+        }
+    }
+}
+
+esp_err_t sr_reject_set_persist_cb(sr_reject_persist_cb_t cb)
+{
+    g_persist_cb = cb;
+    if (g_persist_task) {
+        return ESP_OK;
+    }
+    BaseType_t ret_val = xTaskCreatePinnedToCore(sr_reject_persist_task, "Reject Persist", 4 * 1024, NULL,
+                                                 tskIDLE_PRIORITY + 1, &g_persist_task, 0);
+    ESP_RETURN_ON_FALSE(pdPASS == ret_val, ESP_FAIL, TAG, "Failed create persist task");
+    return ESP_OK;
+}
+
+void sr_reject_reset(void)
+{
+    portENTER_CRITICAL(&g_lock);
+    memset(g_stats, 0, sizeof(g_stats));
+    g_last_cmd = -1;
+    portEXIT_CRITICAL(&g_lock);
+}
+
+bool sr_reject_check(const sr_result_t *result, bool in_followup)
+{
+    int id = result->command_id;
+    if (id < 0 || id >= SR_REJECT_CMD_MAX) {
+        return result->probs[0] >= g_global;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int tuned_id = -1;
+    float tuned_thr = 0;
+    bool accept;
+
+    portENTER_CRITICAL(&g_lock);
+    sr_reject_stat_t *s = &g_stats[id];
+    float thr = effective_threshold(s);
+    accept = result->probs[0] >= thr;
+    if (!accept) {
+        s->rejected++;
+    } else {
+        /* The user saying something else right away means the last dispatch was wrong */
+        if (!in_followup && g_last_cmd >= 0 && g_last_cmd != id
+                && (now - g_last_us) < SR_REJECT_CONTRADICT_MS * 1000LL) {
+            sr_reject_stat_t *last = &g_stats[g_last_cmd];
+            last->contradicted++;
+            if (tune_locked(last)) {
+                tuned_id = g_last_cmd;
+                tuned_thr = last->threshold;
+            }
+        }
+        s->accepted++;
+        g_last_cmd = id;
+        g_last_us = now;
+        /* Let a command that keeps being right win back some sensitivity */
+        if (tuned_id < 0 && 0 == s->accepted % SR_REJECT_TUNE_MIN && tune_locked(s)) {
+            tuned_id = id;
+            tuned_thr = s->threshold;
+        }
+    }
+    portEXIT_CRITICAL(&g_lock);
+
+    if (!accept) {
+        ESP_LOGW(TAG, "Rejected cmd %d, prob %.3f < %.3f", id, result->probs[0], thr);
+    }
+    if (tuned_id >= 0) {
+        ESP_LOGI(TAG, "Threshold of cmd %d tuned to %.3f", tuned_id, tuned_thr);
+        mark_dirty();
+    }
+    return accept;
+}
+
+void sr_reject_feedback(int command_id, bool correct)
+{
+    if (command_id < 0 || command_id >= SR_REJECT_CMD_MAX) {
+        return;
+    }
+
+    bool tuned;
+    float thr;
+    portENTER_CRITICAL(&g_lock);
+    sr_reject_stat_t *s = &g_stats[command_id];
+    if (!correct) {
+        s->contradicted++;
+        if (g_last_cmd == command_id) {
+            g_last_cmd = -1; /* Already counted, don't let the next command count it again */
+        }
+    }
+    tuned = tune_locked(s);
+    thr = s->threshold;
+    portEXIT_CRITICAL(&g_lock);
+
+    if (tuned) {
+        ESP_LOGI(TAG, "Threshold of cmd %d tuned to %.3f", command_id, thr);
+        mark_dirty();
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "app_sr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_REJECT_CMD_MAX (200)
+#define SR_REJECT_GLOBAL_DEFAULT (0.25f)    /**< Minimum probability any command needs */
+#define SR_REJECT_THRESHOLD_MAX (0.9f)      /**< Auto-tuning never raises a threshold above this */
+#define SR_REJECT_CONTRADICT_MS (8000)      /**< A different command this soon after one counts as a correction */
+#define SR_REJECT_TUNE_MIN (10)             /**< Accepted results needed before a threshold is tuned */
+#define SR_REJECT_TARGET_RATE (0.05f)       /**< Contradiction rate the tuning aims for */
+#define SR_REJECT_TUNE_STEP (0.02f)
+#define SR_REJECT_PERSIST_DELAY_MS (30000)  /**< Tuning changes are collected this long before they are saved */
+
+typedef struct {
+    float threshold;        /**< 0 means the global threshold applies */
+    uint16_t accepted;      /**< Decayed counts, halved once accepted reaches 64 */
+    uint16_t contradicted;
+    uint32_t rejected;
+} sr_reject_stat_t;
+
+/**
+ * @brief Saves the whole threshold table, see sr_reject_set_persist_cb()
+ */
+typedef void (*sr_reject_persist_cb_t)(void);
+
+void sr_reject_set_global(float threshold);
+float sr_reject_get_global(void);
+
+/**
+ * @brief Set a per-command threshold, 0 falls back to the global one
+ */
+esp_err_t sr_reject_set_threshold(int command_id, float threshold);
+float sr_reject_get_threshold(int command_id);
+esp_err_t sr_reject_get_stat(int command_id, sr_reject_stat_t *stat);
+
+/**
+ * @brief Have tuned thresholds saved by `cb`
+ *
+ * Tuning happens on the detection task, which must never wait on flash, so it
+ * only marks the table dirty. A low priority task calls `cb` once the table
+ * has been dirty for SR_REJECT_PERSIST_DELAY_MS, so a burst of changes costs
+ * one write.
+ */
+esp_err_t sr_reject_set_persist_cb(sr_reject_persist_cb_t cb);
+
+/**
+ * @brief Forget all per-command state, call when command ids are reassigned
+ */
+void sr_reject_reset(void);
+
+/**
+ * @brief Decide whether a detected result is dispatched
+ *
+ * Accepting a different command shortly after the previous one marks the
+ * previous one as contradicted, which drives the threshold tuning. Inside a
+ * follow-up session different commands are expected to chain, so there only
+ * explicit feedback counts.
+ *
+ * @param in_followup The result was heard in a follow-up window
+ * @return true to dispatch, false to drop the result
+ */
+bool sr_reject_check(const sr_result_t *result, bool in_followup);
+
+/**
+ * @brief Explicit feedback about the last dispatch of a command
+ */
+void sr_reject_feedback(int command_id, bool correct);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,203 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "bsp_board.h"
+#include "app_sr.h"
+#include "app_sr_replay.h"
+#include "app_sr_trace.h"
+
+static const char *TAG = "sr_replay";
+
+#define REPLAY_SAMPLE_RATE (16000)
+#define REPLAY_BURST_LEAD_MS (256)
+
+typedef struct {
+    FILE *fp;
+    bool realtime;
+    uint8_t chan_num;
+    bsp_codec_config_t codec;
+    sr_replay_stats_t stats;
+} sr_replay_t;
+
+static sr_replay_t *g_replay = NULL;
+
+static void replay_report(void)
+{
+    sr_replay_stats_t *s = &g_replay->stats;
+    int64_t elapsed_us = s->last_us - s->start_us;
+    uint32_t audio_ms = s->bytes / (g_replay->chan_num * sizeof(int16_t)) * 1000 / REPLAY_SAMPLE_RATE;
+    ESP_LOGI(TAG, "chunks=%u, audio=%ums, elapsed=%lldms, speed=%.2fx, read max=%lldus",
+             s->chunks, audio_ms, elapsed_us / 1000,
+             elapsed_us ? (float)audio_ms * 1000 / elapsed_us : 0.0f, s->read_max_us);
+}
+
+static esp_err_t replay_read(void *audio_buffer, size_t len, size_t *bytes_read, uint32_t timeout_ms)
+{
+    sr_replay_stats_t *s = &g_replay->stats;
+
+    if (s->eof) {
+        /* Behave like a silent microphone once the recording is exhausted */
+        memset(audio_buffer, 0, len);
+        *bytes_read = len;
+        vTaskDelay(pdMS_TO_TICKS(len * 1000 / (g_replay->chan_num * sizeof(int16_t) * REPLAY_SAMPLE_RATE)));
+        return ESP_OK;
+    }
+
+    int64_t start = esp_timer_get_time();
+    if (0 == s->chunks) {
+        s->start_us = start;
+    }
+
+    size_t n = fread(audio_buffer, 1, len, g_replay->fp);
+    if (n < len) {
+        memset((uint8_t *)audio_buffer + n, 0, len - n);
+        s->eof = true;
+    }
+    *bytes_read = len;
+
+    int64_t now = esp_timer_get_time();
+    if (now - start > s->read_max_us) {
+        s->read_max_us = now - start;
+    }
+    s->chunks++;
+    s->bytes += n;
+    s->last_us = now;
+
+    if (s->eof) {
+        ESP_LOGI(TAG, "Replay finished");
+        replay_report();
+        /* Commands still in flight show up in the per-utterance log only */
+        sr_trace_dump();
+        sr_trace_dump_summary();
+    }
+
+    if (!g_replay->realtime) {
+        /**
+         * The AFE drops input once its ring is full, so a burst may only run ahead of
+         * the detect task by a bounded amount for the result to be the same every run.
+         */
+        sr_stats_t sr_stats;
+        while (ESP_OK == app_sr_get_stats(&sr_stats) && sr_stats.afe_backlog > REPLAY_BURST_LEAD_MS * REPLAY_SAMPLE_RATE / 1000) {
+            vTaskDelay(1);
+        }
+    } else {
+        int64_t due_us = s->start_us + (int64_t)(s->bytes / (g_replay->chan_num * sizeof(int16_t))) * 1000000 / REPLAY_SAMPLE_RATE;
+        if (due_us > now) {
+            vTaskDelay(pdMS_TO_TICKS((due_us - now) / 1000));
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Walk the RIFF chunks up to the start of the sample data, taking the channel
+ * number from the fmt chunk. The data size is not checked, a segment cut short
+ * by a reset still has its header sizes at zero.
+ */
+static esp_err_t replay_parse_wav(FILE *fp, uint8_t *chan_num)
+{
+    uint8_t riff[12];
+    ESP_RETURN_ON_FALSE(1 == fread(riff, sizeof(riff), 1, fp), ESP_ERR_INVALID_SIZE, TAG, "Truncated WAV header");
+    ESP_RETURN_ON_FALSE(0 == memcmp(riff + 8, "WAVE", 4), ESP_ERR_INVALID_ARG, TAG, "RIFF file is not a WAVE");
+
+    bool fmt_found = false;
+    while (true) {
+        struct {
+            char id[4];
+            uint32_t size;
+        } chunk;
+        ESP_RETURN_ON_FALSE(1 == fread(&chunk, sizeof(chunk), 1, fp), ESP_ERR_INVALID_SIZE, TAG, "No data chunk in WAV");
+
+        if (0 == memcmp(chunk.id, "data", 4)) {
+            ESP_RETURN_ON_FALSE(fmt_found, ESP_ERR_INVALID_ARG, TAG, "No fmt chunk before the data");
+            return ESP_OK;
+        }
+
+        if (0 == memcmp(chunk.id, "fmt ", 4)) {
+            struct {
+                uint16_t format;
+                uint16_t channels;
+                uint32_t sample_rate;
+                uint32_t byte_rate;
+                uint16_t block_align;
+                uint16_t bits_per_sample;
+            } fmt;
+            ESP_RETURN_ON_FALSE(chunk.size >= sizeof(fmt) && 1 == fread(&fmt, sizeof(fmt), 1, fp),
+                                ESP_ERR_INVALID_SIZE, TAG, "Truncated fmt chunk");
+            ESP_RETURN_ON_FALSE(1 == fmt.format && 16 == fmt.bits_per_sample, ESP_ERR_INVALID_ARG, TAG,
+                                "WAV is not 16-bit PCM (format %u, %u bit)", fmt.format, fmt.bits_per_sample);
+            ESP_RETURN_ON_FALSE(REPLAY_SAMPLE_RATE == fmt.sample_rate, ESP_ERR_INVALID_ARG, TAG,
+                                "WAV sample rate %u, %u expected", fmt.sample_rate, REPLAY_SAMPLE_RATE);
+            ESP_RETURN_ON_FALSE(0 == *chan_num || fmt.channels == *chan_num, ESP_ERR_INVALID_ARG, TAG,
+                                "WAV has %u channels, %u expected", fmt.channels, *chan_num);
+            *chan_num = fmt.channels;
+            chunk.size -= sizeof(fmt);
+            fmt_found = true;
+        }
+
+        /* Chunks are padded to an even size */
+        ESP_RETURN_ON_FALSE(0 == fseek(fp, chunk.size + (chunk.size & 1), SEEK_CUR), ESP_ERR_INVALID_SIZE, TAG, "Truncated WAV chunk");
+    }
+}
+
+esp_err_t app_sr_replay_start(const char *path, uint8_t chan_num, bool realtime)
+{
+    esp_err_t ret = ESP_OK;
+    ESP_RETURN_ON_FALSE(NULL == g_replay, ESP_ERR_INVALID_STATE, TAG, "Replay already started");
+
+    g_replay = heap_caps_calloc(1, sizeof(sr_replay_t), MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(NULL != g_replay, ESP_ERR_NO_MEM, TAG, "No mem for replay");
+
+    g_replay->fp = fopen(path, "rb");
+    ESP_GOTO_ON_FALSE(NULL != g_replay->fp, ESP_ERR_NOT_FOUND, err, TAG, "Open file %s failed", path);
+
+    /* Segments written by the recorder are WAV, anything else is taken as raw PCM */
+    char riff[4] = {0};
+    fread(riff, 1, sizeof(riff), g_replay->fp);
+    rewind(g_replay->fp);
+    if (0 == memcmp(riff, "RIFF", sizeof(riff))) {
+        ESP_GOTO_ON_ERROR(replay_parse_wav(g_replay->fp, &chan_num), err, TAG, "Invalid WAV %s", path);
+    } else {
+        ESP_GOTO_ON_FALSE(0 != chan_num, ESP_ERR_INVALID_ARG, err, TAG, "Raw PCM needs a channel number");
+    }
+    ESP_GOTO_ON_FALSE(2 == chan_num || 3 == chan_num, ESP_ERR_INVALID_ARG, err, TAG, "Unsupported channel number %d", chan_num);
+
+    g_replay->realtime = realtime;
+    g_replay->chan_num = chan_num;
+
+    /* Keep the board's output path, only the capture is faked */
+    memcpy(&g_replay->codec, bsp_board_get_codec_handle(), sizeof(bsp_codec_config_t));
+    g_replay->codec.i2s_read_fn = replay_read;
+    g_replay->codec.i2s_rx_chan_num = chan_num;
+    /* Recordings hold the frames as captured, in the board's channel order */
+    g_replay->codec.i2s_rx_ref_first &= 3 == chan_num;
+
+    ESP_LOGI(TAG, "Replaying %s, %d ch, %s", path, chan_num, realtime ? "realtime" : "burst");
+    return app_sr_set_codec(&g_replay->codec);
+
+err:
+    if (g_replay->fp) {
+        fclose(g_replay->fp);
+    }
+    heap_caps_free(g_replay);
+    g_replay = NULL;
+    return ret;
+}
+
+esp_err_t app_sr_replay_get_stats(sr_replay_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(NULL != g_replay, ESP_ERR_INVALID_STATE, TAG, "Replay not started");
+    memcpy(stats, &g_replay->stats, sizeof(sr_replay_stats_t));
+    return ESP_OK;
+}
@@ -0,0 +1,58 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t chunks;        /**< Number of reads served from the file */
+    uint64_t bytes;         /**< Number of bytes served from the file */
+    int64_t start_us;       /**< Time of the first read */
+    int64_t last_us;        /**< Time of the latest read */
+    int64_t read_max_us;    /**< Slowest single read, file access included */
+    bool eof;               /**< Whole file has been served */
+} sr_replay_stats_t;
+
+/**
+ * @brief Replace the I2S capture of the speech recognition with a recorded PCM file
+ *
+ * Runs on the target, there is no host build of the pipeline. When the file
+ * runs out the per-utterance stage latencies are printed, see `sr_trace_dump`.
+ *
+ * @note Must be called before `app_sr_start`. Playback, volume and clock functions
+ *       are still forwarded to the board codec.
+ *
+ * @param path Interleaved int16 PCM, raw or a WAV segment written by `app_sr_start(true)`
+ * @param chan_num Number of channels in the file, 2 or 3. 0 takes it from the WAV header.
+ * @param realtime Pace reads like the I2S DMA would, otherwise feed as fast as the
+ *                 recognizer keeps up without losing input
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_ARG: WAV is not 16 kHz 16-bit PCM or its channel number does not match
+ *    - Others: Fail
+ */
+esp_err_t app_sr_replay_start(const char *path, uint8_t chan_num, bool realtime);
+
+/**
+ * @brief Get the replay throughput counters
+ *
+ * @param stats Filled with a snapshot of the counters
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_STATE: Replay was not started
+ */
+esp_err_t app_sr_replay_get_stats(sr_replay_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,205 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "app_sr_trace.h"
+
+static const char *TAG = "sr_trace";
+
+static const char *g_stage_name[SR_TRACE_STAGE_MAX] = {
+    "i2s_read",
+    "afe_feed",
+    "afe_fetch",
+    "wake",
+    "verified",
+    "mn_detected",
+    "queued",
+    "dequeued",
+    "send_start",
+    "send_finish",
+    "net_done",
+};
+
+static portMUX_TYPE g_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t g_last_chunk[SR_TRACE_WAKE_DETECTED];
+static sr_trace_record_t g_records[SR_TRACE_RECORD_NUM];
+static uint32_t g_next_id = 0;
+static sr_trace_record_t *g_current = NULL;
+static sr_trace_report_cb_t g_report_cb = NULL;
+
+/* Offsets from the I2S read over every completed utterance */
+static uint32_t g_stage_num[SR_TRACE_STAGE_MAX];
+static int64_t g_stage_sum[SR_TRACE_STAGE_MAX];
+static int64_t g_stage_max[SR_TRACE_STAGE_MAX];
+
+const char *sr_trace_stage_name(sr_trace_stage_t stage)
+{
+    return stage < SR_TRACE_STAGE_MAX ? g_stage_name[stage] : "unknown";
+}
+
+static sr_trace_record_t *sr_trace_open(void)
+{
+    sr_trace_record_t *record = &g_records[g_next_id % SR_TRACE_RECORD_NUM];
+    memset(record, 0, sizeof(sr_trace_record_t));
+    record->id = g_next_id++;
+    record->command_id = -1;
+    memcpy(record->stamp_us, g_last_chunk, sizeof(g_last_chunk));
+    return record;
+}
+
+/**
+ * Results pass the handler and the dispatch queue in order, so a stage after
+ * RESULT_QUEUED belongs to the oldest record that reached the stage before it.
+ */
+static sr_trace_record_t *sr_trace_find(sr_trace_stage_t stage)
+{
+    sr_trace_stage_t prev = stage > SR_TRACE_SEND_START ? SR_TRACE_SEND_START : stage - 1;
+    uint32_t num = g_next_id < SR_TRACE_RECORD_NUM ? g_next_id : SR_TRACE_RECORD_NUM;
+    for (uint32_t id = g_next_id - num; id != g_next_id; id++) {
+        sr_trace_record_t *r = &g_records[id % SR_TRACE_RECORD_NUM];
+        if (r->stamp_us[prev] && !r->stamp_us[stage] && !r->stamp_us[SR_TRACE_SEND_FINISH]) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+void sr_trace_mark(sr_trace_stage_t stage)
+{
+    int64_t now = esp_timer_get_time();
+    sr_trace_record_t done;
+    bool finished = false;
+
+    portENTER_CRITICAL(&g_lock);
+    if (stage < SR_TRACE_WAKE_DETECTED) {
+        g_last_chunk[stage] = now;
+    } else if (SR_TRACE_WAKE_DETECTED == stage) {
+        g_current = sr_trace_open();
+        g_current->stamp_us[stage] = now;
+    } else if (stage <= SR_TRACE_RESULT_QUEUED) {
+        /* Every accepted command gets its own record, a follow-up one is based on its own chunk */
+        if (SR_TRACE_MN_DETECTED == stage && (NULL == g_current || g_current->stamp_us[stage])) {
+            g_current = sr_trace_open();
+        }
+        if (g_current) {
+            g_current->stamp_us[stage] = now;
+        }
+    } else {
+        sr_trace_record_t *record = sr_trace_find(stage);
+        if (record) {
+            record->stamp_us[stage] = now;
+        }
+        if (record && SR_TRACE_SEND_FINISH == stage) {
+            memcpy(&done, record, sizeof(sr_trace_record_t));
+            finished = true;
+            for (int i = 0; i < SR_TRACE_STAGE_MAX; i++) {
+                if (done.stamp_us[i]) {
+                    int64_t offset = done.stamp_us[i] - done.stamp_us[SR_TRACE_I2S_READ];
+                    g_stage_num[i]++;
+                    g_stage_sum[i] += offset;
+                    g_stage_max[i] = offset > g_stage_max[i] ? offset : g_stage_max[i];
+                }
+            }
+        }
+    }
+    portEXIT_CRITICAL(&g_lock);
+
+    if (finished) {
+        char json[320];
+        sr_trace_to_json(&done, json, sizeof(json));
+        ESP_LOGI(TAG, "%s", json);
+        if (g_report_cb) {
+            g_report_cb(&done);
+        }
+    }
+}
+
+void sr_trace_set_command(int command_id)
+{
+    portENTER_CRITICAL(&g_lock);
+    if (g_current) {
+        g_current->command_id = command_id;
+    }
+    portEXIT_CRITICAL(&g_lock);
+}
+
+void sr_trace_set_report_cb(sr_trace_report_cb_t cb)
+{
+    g_report_cb = cb;
+}
+
+int sr_trace_to_json(const sr_trace_record_t *record, char *buf, size_t len)
+{
+    int64_t base = record->stamp_us[SR_TRACE_I2S_READ];
+    int n = snprintf(buf, len, "{\"id\": %u, \"command_id\": %d", record->id, record->command_id);
+    for (int i = 0; i < SR_TRACE_STAGE_MAX && n < len; i++) {
+        if (record->stamp_us[i]) {
+            n += snprintf(buf + n, len - n, ", \"%s\": %lld", g_stage_name[i], record->stamp_us[i] - base);
+        }
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, "}");
+    }
+    return n < len ? n : len - 1;
+}
+
+void sr_trace_dump(void)
+{
+    sr_trace_record_t records[SR_TRACE_RECORD_NUM];
+    uint32_t next_id;
+
+    portENTER_CRITICAL(&g_lock);
+    memcpy(records, g_records, sizeof(records));
+    next_id = g_next_id;
+    portEXIT_CRITICAL(&g_lock);
+
+    uint32_t num = next_id < SR_TRACE_RECORD_NUM ? next_id : SR_TRACE_RECORD_NUM;
+    printf("Utterance latency (us from I2S read)\n");
+    printf("%-12s", "id");
+    for (int i = 0; i < SR_TRACE_STAGE_MAX; i++) {
+        printf("%12s", g_stage_name[i]);
+    }
+    printf("\n");
+
+    for (uint32_t id = next_id - num; id != next_id; id++) {
+        const sr_trace_record_t *r = &records[id % SR_TRACE_RECORD_NUM];
+        printf("%-12u", r->id);
+        for (int i = 0; i < SR_TRACE_STAGE_MAX; i++) {
+            if (r->stamp_us[i]) {
+                printf("%12lld", r->stamp_us[i] - r->stamp_us[SR_TRACE_I2S_READ]);
+            } else {
+                printf("%12s", "-");
+            }
+        }
+        printf("\n");
+    }
+}
+
+void sr_trace_dump_summary(void)
+{
+    uint32_t num[SR_TRACE_STAGE_MAX];
+    int64_t sum[SR_TRACE_STAGE_MAX];
+    int64_t max[SR_TRACE_STAGE_MAX];
+
+    portENTER_CRITICAL(&g_lock);
+    memcpy(num, g_stage_num, sizeof(num));
+    memcpy(sum, g_stage_sum, sizeof(sum));
+    memcpy(max, g_stage_max, sizeof(max));
+    portEXIT_CRITICAL(&g_lock);
+
+    printf("Stage latency over %u utterances (us from I2S read)\n", num[SR_TRACE_SEND_FINISH]);
+    printf("%-12s%12s%12s%12s\n", "stage", "count", "avg", "max");
+    for (int i = 0; i < SR_TRACE_STAGE_MAX; i++) {
+        if (num[i]) {
+            printf("%-12s%12u%12lld%12lld\n", g_stage_name[i], num[i], sum[i] / num[i], max[i]);
+        }
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_TRACE_RECORD_NUM (8)
+
+typedef enum {
+    SR_TRACE_I2S_READ,          /**< Per chunk, latest value copied at wake */
+    SR_TRACE_AFE_FEED,          /**< Per chunk, latest value copied at wake */
+    SR_TRACE_AFE_FETCH,         /**< Per chunk, latest value copied at wake */
+    SR_TRACE_WAKE_DETECTED,     /**< Starts a new utterance record */
+    SR_TRACE_CHANNEL_VERIFIED,
+    SR_TRACE_MN_DETECTED,       /**< Starts a new record if the current one already has a command */
+    SR_TRACE_RESULT_QUEUED,
+    SR_TRACE_HANDLER_DEQUEUE,
+    SR_TRACE_SEND_START,        /**< app_hass_send_cmd entered */
+    SR_TRACE_SEND_FINISH,       /**< app_hass_send_cmd returned, completes the record once */
+    SR_TRACE_NET_DONE,          /**< HTTP response received or MQTT message handed over */
+    SR_TRACE_STAGE_MAX,
+} sr_trace_stage_t;
+
+typedef struct {
+    uint32_t id;
+    int command_id;
+    int64_t stamp_us[SR_TRACE_STAGE_MAX];   /**< esp_timer time, 0 if the stage was not reached */
+} sr_trace_record_t;
+
+typedef void (*sr_trace_report_cb_t)(const sr_trace_record_t *record);
+
+/**
+ * @brief Stamp a stage of the current utterance
+ *
+ * @note Stages from SR_TRACE_HANDLER_DEQUEUE on go to the oldest command still waiting
+ *       for them, as results are handled in the order they were queued.
+ */
+void sr_trace_mark(sr_trace_stage_t stage);
+
+/**
+ * @brief Attach the recognized command to the current utterance
+ */
+void sr_trace_set_command(int command_id);
+
+/**
+ * @brief Call `cb` with every completed utterance, in addition to the console log
+ */
+void sr_trace_set_report_cb(sr_trace_report_cb_t cb);
+
+/**
+ * @brief Print the last SR_TRACE_RECORD_NUM utterances to the console
+ */
+void sr_trace_dump(void);
+
+/**
+ * @brief Print the average and worst offset of every stage over all utterances completed so far
+ */
+void sr_trace_dump_summary(void);
+
+/**
+ * @brief Format a record as JSON with per-stage offsets from the I2S read in microseconds
+ *
+ * @return Length written, excluding the terminator
+ */
+int sr_trace_to_json(const sr_trace_record_t *record, char *buf, size_t len);
+
+const char *sr_trace_stage_name(sr_trace_stage_t stage);
+
+#ifdef __cplusplus
+}
+#endif
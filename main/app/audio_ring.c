@@ -0,0 +1,96 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "audio_ring.h"
+
+struct audio_ring {
+    int16_t *buffer;
+    size_t frame_len;
+    size_t frame_num;
+    atomic_uint_least32_t head;
+};
+
+audio_ring_t *audio_ring_create(size_t frame_len, size_t frame_num)
+{
+    audio_ring_t *ring = heap_caps_calloc(1, sizeof(audio_ring_t), MALLOC_CAP_8BIT);
+    if (NULL == ring) {
+        return NULL;
+    }
+
+    ring->buffer = heap_caps_calloc(frame_len * frame_num, sizeof(int16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == ring->buffer) {
+        heap_caps_free(ring);
+        return NULL;
+    }
+    ring->frame_len = frame_len;
+    ring->frame_num = frame_num;
+    atomic_init(&ring->head, 0);
+    return ring;
+}
+
+void audio_ring_delete(audio_ring_t *ring)
+{
+    if (ring) {
+        heap_caps_free(ring->buffer);
+        heap_caps_free(ring);
+    }
+}
+
+void audio_ring_push(audio_ring_t *ring, const int16_t *frame)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    memcpy(ring->buffer + (head % ring->frame_num) * ring->frame_len, frame, ring->frame_len * sizeof(int16_t));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+uint32_t audio_ring_head(const audio_ring_t *ring)
+{
+    return atomic_load_explicit(&((audio_ring_t *)ring)->head, memory_order_acquire);
+}
+
+size_t audio_ring_capacity(const audio_ring_t *ring)
+{
+    return ring->frame_num;
+}
+
+size_t audio_ring_frame_len(const audio_ring_t *ring)
+{
+    return ring->frame_len;
+}
+
+bool audio_ring_is_valid(const audio_ring_t *ring, uint32_t seq)
+{
+    /* The slot of `head - frame_num` may be under rewrite right now */
+    uint32_t age = audio_ring_head(ring) - seq;
+    return age >= 1 && age < ring->frame_num;
+}
+
+esp_err_t audio_ring_window(const audio_ring_t *ring, uint32_t first, uint32_t count, audio_ring_span_t *span)
+{
+    uint32_t head = audio_ring_head(ring);
+    if ((uint32_t)(head - first) < count || 0 == count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if ((uint32_t)(head - first) >= ring->frame_num) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    size_t start = first % ring->frame_num;
+    size_t part = ring->frame_num - start;
+    if (part > count) {
+        part = count;
+    }
+    span->data[0] = ring->buffer + start * ring->frame_len;
+    span->len[0] = part * ring->frame_len;
+    span->data[1] = ring->buffer;
+    span->len[1] = (count - part) * ring->frame_len;
+    span->first = first;
+    span->count = count;
+    return ESP_OK;
+}
@@ -0,0 +1,85 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Lock-free single producer ring of fixed size audio frames
+ *
+ * Every pushed frame gets a sequence number. Readers take zero-copy views by
+ * sequence number and check `audio_ring_is_valid` once done with the data,
+ * as the producer never waits and may overwrite the oldest frames meanwhile.
+ */
+typedef struct audio_ring audio_ring_t;
+
+/**
+ * @brief A window of the ring, split in at most two contiguous parts
+ */
+typedef struct {
+    const int16_t *data[2];
+    size_t len[2];          /**< Length of each part in samples */
+    uint32_t first;         /**< Sequence number of the first frame */
+    uint32_t count;         /**< Number of frames */
+} audio_ring_span_t;
+
+/**
+ * @brief Create a ring in PSRAM
+ *
+ * @param frame_len Samples per frame
+ * @param frame_num Number of frames kept
+ * @return Ring handle, NULL if out of memory
+ */
+audio_ring_t *audio_ring_create(size_t frame_len, size_t frame_num);
+
+void audio_ring_delete(audio_ring_t *ring);
+
+/**
+ * @brief Append one frame, only to be called from the producer task
+ */
+void audio_ring_push(audio_ring_t *ring, const int16_t *frame);
+
+/**
+ * @brief Sequence number the next pushed frame will get
+ */
+uint32_t audio_ring_head(const audio_ring_t *ring);
+
+/**
+ * @brief Number of frames the ring keeps
+ */
+size_t audio_ring_capacity(const audio_ring_t *ring);
+
+/**
+ * @brief Samples per frame
+ */
+size_t audio_ring_frame_len(const audio_ring_t *ring);
+
+/**
+ * @brief Get a zero-copy view of `count` frames starting at `first`
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_ARG: Frames not pushed yet
+ *    - ESP_ERR_NOT_FOUND: Frames already overwritten
+ */
+esp_err_t audio_ring_window(const audio_ring_t *ring, uint32_t first, uint32_t count, audio_ring_span_t *span);
+
+/**
+ * @brief Check whether the frame with sequence number `seq` is still intact
+ */
+bool audio_ring_is_valid(const audio_ring_t *ring, uint32_t seq);
+
+#ifdef __cplusplus
+}
+#endif
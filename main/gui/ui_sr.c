@@ -52,7 +52,8 @@ static void sr_label_event_handler(lv_event_t *event)
 {
     char *text = (char *) event-> param;
     if (NULL != text) {
-        lv_label_set_text_static(g_sr_label, text);
+        /* Copied, callers pass command strings that can be freed by a reload */
+        lv_label_set_text(g_sr_label, text);
     }
 }
 
@@ -183,15 +184,21 @@ void ui_sr_anim_init(void)
 
 void sr_anim_start(void)
 {
+    ui_acquire();
     lv_event_send(g_sr_mask, LV_EVENT_VALUE_CHANGED, (void *) true);
+    ui_release();
 }
 
 void sr_anim_stop(void)
 {
+    ui_acquire();
     lv_event_send(g_sr_mask, LV_EVENT_VALUE_CHANGED, (void *) false);
+    ui_release();
 }
 
 void sr_anim_set_text(char *text)
 {
+    ui_acquire();
     lv_event_send(g_sr_label, LV_EVENT_VALUE_CHANGED, (void *) text);
+    ui_release();
 }
@@ -17,6 +17,8 @@
 #include "settings.h"
 #include "app_led.h"
 #include "app_sr.h"
+#include "app_sr_replay.h"
+#include "app_sr_ref.h"
 #include "app_wifi.h"
 #include "audio_player.h"
 #include "file_iterator.h"
@@ -113,12 +115,13 @@ void app_main(void)
     bsp_display_brightness_set(param->brightness);
     ESP_ERROR_CHECK(ui_main_start());
 
-    bsp_codec_config_t *codec_handle = bsp_board_get_codec_handle();
+    /* All playback goes through the reference tap so SR can cancel it */
+    ESP_ERROR_CHECK(sr_ref_init());
     file_iterator = file_iterator_new("/spiffs/mp3");
     assert(file_iterator != NULL);
     audio_player_config_t config = { .mute_fn = audio_mute_function,
-                                     .write_fn = codec_handle->i2s_write_fn,
-                                     .clk_set_fn = codec_handle->i2s_reconfig_clk_fn,
+                                     .write_fn = sr_ref_write,
+                                     .clk_set_fn = sr_ref_reconfig_clk,
                                      .priority = 5
                                    };
     ESP_ERROR_CHECK(audio_player_new(config));
@@ -126,6 +129,10 @@ void app_main(void)
     const board_res_desc_t *brd = bsp_board_get_description();
     app_pwm_led_init(brd->PMOD2->row1[1], brd->PMOD2->row1[2], brd->PMOD2->row1[3]);
     ESP_LOGI(TAG, "speech recognition start");
+#if SR_RUN_REPLAY
+    ESP_ERROR_CHECK(bsp_sdcard_init_default());
+    ESP_ERROR_CHECK(app_sr_replay_start(SR_REPLAY_FILE, 0, false));
+#endif
     app_sr_start(false);
 
     /* Initialize Wi-Fi. */